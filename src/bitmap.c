@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "types.h"
 #include "const.h"
 #include "cache.h"
 #include "comms.h"
@@ -44,65 +49,266 @@ void bitmap_print(struct generic_bitmap *bmap)
 
 }
 
+/* the bitmap is searched a 64 bit word at a time, skipping CHUNK_WORDS words
+ * at once while they are all set. */
+#define WORD_BITS 64
+#define CHUNK_WORDS 8
+
+/**
+ * Returns whether every bit of the CHUNK_WORDS words at 'p' is set.
+ */
+static inline int chunk_full(const u64 *p)
+{
+#ifdef __SSE2__
+	__m128i v;
+
+	v = _mm_and_si128(
+		_mm_and_si128(_mm_load_si128((const __m128i *) p), 
+			_mm_load_si128((const __m128i *) (p + 2))),
+		_mm_and_si128(_mm_load_si128((const __m128i *) (p + 4)),
+			_mm_load_si128((const __m128i *) (p + 6))));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(-1))) == 
+		0xffff;
+#else
+	return (p[0] & p[1] & p[2] & p[3] & p[4] & p[5] & p[6] & p[7]) == 
+		~(u64) 0;
+#endif
+}
+
+/**
+ * Returns the first clear bit at or after bit 'from' and before bit 'to' of
+ * the bitmap block 'data', or -1 if they are all set.
+ *
+ * Bit n of a bitmap is bit n % 8 of byte n / 8, so a little endian load of 
+ * a word puts the bits in order and the lowest clear one is found by 
+ * counting trailing zeros.
+ */
+static int find_clear(const char *data, int from, int to)
+{
+	const u64 *words = (const u64 *) data;	/* blk_data is aligned */
+	int w = from / WORD_BITS;
+	int end = (to + WORD_BITS - 1) / WORD_BITS;
+	int nr;
+	u64 k;
+
+	if(from >= to)
+		return -1;
+
+	/* ignore the bits of the first word before 'from' */
+	k = ~le64toh(words[w]) & (~(u64) 0 << (from % WORD_BITS));
+	while(k == 0) {
+		if(++w == end)
+			return -1;
+		while(w % CHUNK_WORDS == 0 && w + CHUNK_WORDS <= end &&
+			chunk_full(&words[w]))
+			w += CHUNK_WORDS;
+		if(w == end)
+			return -1;
+		k = ~le64toh(words[w]);
+	}
+
+	nr = w * WORD_BITS + __builtin_ctzll(k);
+	return nr < to ? nr : -1;
+}
+
 /**
  * Attempts to allocate and return a bit in the given bitmap that is as close 
- * to the specified 'origin' bit as possible.
+ * to the specified 'origin' bit as possible. The first clear bit at or after
+ * 'origin' is taken, wrapping round to the start of the bitmap if need be.
+ * Returns -1 if every bit is set.
+ *
+ * A bitmap with a tree of its free extents is searched through that instead.
  */
 int alloc_bit(struct generic_bitmap *bitmap, int origin)
 {
-	register unsigned k;		/* current word being scanned */
-	register int a;			/* the return bit */
-	register int *wptr, *wlim;	/* word pointers */
-	int i, b, w, o, block_count;
+	int bits = (int) BITS_PER_BLOCK;
+	int b, n, from, to, nr;
 	struct minix_block *bp;
 
-	if(origin >= bitmap->num_bits) origin = 0;
-
-	b = origin >> 13;	/* the block where searching starts */
-	o = origin - (b << 13); /* the bit offset into the block */
-	w = o/INT_BITS;		/* the word offset into the block */
-	
-	block_count = bitmap->num_blocks;
-	while(block_count--) {
-		bp = bitmap->blocks[b];			/* block to search */
-		wptr = ((int *) bp->blk_data) + w;	/* addr of start word */
-		wlim = ((int *) bp->blk_data) + 
-				INTS_PER_BLOCK;	/* the final address of block */
-		a = w * INT_BITS;
-		while(wptr != wlim) {
-			/* loop through all words in block */
-			if((k = (unsigned) *wptr) != (unsigned) ~0) {
-				/* word at wptr has a free bit */
-				for(i = 0; i < INT_BITS; i++) {
-					if(!bit((char *)wptr, i)) {
-						/* bit i @ word wptr is free */
-						a += (b * INTS_PER_BLOCK * 
-							INT_BITS) + i;
-
-						if(a >= bitmap->num_bits) {
-							wptr = wlim - 1;
-							break;
-						}
-						setbit((char *)wptr, i);
-						bp->blk_dirty = TRUE;
-						return a;
-					}
-				}
-			}
+	if(origin < 0 || origin >= bitmap->num_bits) origin = 0;
+
+	if(bitmap->tree != NULL) {
+		if((nr = extent_tree_find(bitmap->tree, origin, 1)) < 0)
+			return -1;
+		extent_tree_take(bitmap->tree, nr, 1);
+		bp = bitmap->blocks[nr / bits];
+		lock_block(bp);
+		setbit(bp->blk_data, nr % bits);
+		mark_dirty(bp);
+		unlock_block(bp);
+		return nr;
+	}
 
-			wptr++;			/* move on to next word */
-			a += INT_BITS;
+	b = origin / bits;	/* the block where searching starts */
+	from = origin % bits;	/* the bit offset into the block */
+
+	/* every block from origin's on, then origin's again for the bits 
+	 * before origin */
+	for(n = 0; n <= bitmap->num_blocks; n++) {
+		to = MIN(bits, bitmap->num_bits - b * bits);
+		if(n == bitmap->num_blocks)
+			to = MIN(to, origin % bits);
+
+		bp = bitmap->blocks[b];
+		lock_block(bp);
+		if((nr = find_clear(bp->blk_data, from, to)) >= 0) {
+			setbit(bp->blk_data, nr);
+			mark_dirty(bp);
+			unlock_block(bp);
+			return b * bits + nr;
 		}
+		unlock_block(bp);
+
 		/* wrap if necessary */
 		if(++b == bitmap->num_blocks) b = 0;
-		w = 0;
+		from = 0;
 	}
 
 	/* no free bits found */
 	return -1;
 }
 
+int alloc_bits(struct generic_bitmap *bitmap, int origin, int count, 
+	int *got)
+{
+	int first;
+
+	if(bitmap->tree == NULL || count <= 1) {
+		*got = 1;
+		return alloc_bit(bitmap, origin);
+	}
+
+	if((first = reserve_bits(bitmap, origin, count, got)) >= 0)
+		claim_bits(bitmap, first, *got);
+	return first;
+}
+
+int reserve_bits(struct generic_bitmap *bitmap, int origin, int count, 
+	int *got)
+{
+	int first;
+
+	if(bitmap->tree == NULL)
+		return -1;
+
+	if(origin < 0 || origin >= bitmap->num_bits) origin = 0;
+	if((first = extent_tree_find(bitmap->tree, origin, count)) < 0 &&
+		(count = extent_tree_largest(bitmap->tree, &first)) == 0)
+		return -1;
+
+	extent_tree_take(bitmap->tree, first, count);
+	*got = count;
+	return first;
+}
+
+void claim_bits(struct generic_bitmap *bitmap, int first, int count)
+{
+	int bits = (int) BITS_PER_BLOCK;
+	struct minix_block *bp = NULL;
+	int nr;
+
+	for(nr = first; nr < first + count; nr++) {
+		if(bp != bitmap->blocks[nr / bits]) {
+			if(bp != NULL) {
+				mark_dirty(bp);
+				unlock_block(bp);
+			}
+			bp = bitmap->blocks[nr / bits];
+			lock_block(bp);
+		}
+		if(setbit(bp->blk_data, nr % bits))
+			panic("claim_bits(%d, %d): bit %d already set", first,
+				count, nr);
+	}
+	if(bp != NULL) {
+		mark_dirty(bp);
+		unlock_block(bp);
+	}
+}
+
+void unreserve_bits(struct generic_bitmap *bitmap, int first, int count)
+{
+	extent_tree_give(bitmap->tree, first, count);
+}
+
+/**
+ * Clears bits 'from' to 'to' - 1 of the bitmap block 'data' a word at a time.
+ * Returns FALSE, with some maybe cleared, if any of them were already clear.
+ */
+static int clear_run(char *data, int from, int to)
+{
+	u64 *words = (u64 *) data;
+	u64 mask;
+	int w, lo, hi;
+
+	for(w = from / WORD_BITS; w * WORD_BITS < to; w++) {
+		/* the bits of this word in the run */
+		lo = MAX(from - w * WORD_BITS, 0);
+		hi = MIN(to - w * WORD_BITS, WORD_BITS);
+		if(hi - lo == WORD_BITS)
+			mask = ~(u64) 0;
+		else
+			mask = htole64((((u64) 1 << (hi - lo)) - 1) << lo);
+
+		if((words[w] & mask) != mask)
+			return FALSE;
+		words[w] &= ~mask;
+	}
+	return TRUE;
+}
+
+void free_bits(struct generic_bitmap *bitmap, int first, int count)
+{
+	int bits = (int) BITS_PER_BLOCK;
+	int nr, from, to;
+	struct minix_block *bp;
 
+	for(nr = first; nr < first + count; nr += to - from) {
+		bp = bitmap->blocks[nr / bits];
+		from = nr % bits;
+		to = MIN(bits, from + first + count - nr);
+		lock_block(bp);
+		if(!clear_run(bp->blk_data, from, to))
+			panic("free_bits(%d, %d): bit is already free", first,
+				count);
+		mark_dirty(bp);
+		unlock_block(bp);
+	}
+	if(bitmap->tree != NULL)
+		extent_tree_give(bitmap->tree, first, count);
+}
+
+void bitmap_build_tree(struct generic_bitmap *bitmap)
+{
+	int bits = (int) BITS_PER_BLOCK;
+	int nr, first = -1;
+
+	bitmap->tree = extent_tree_new();
+	for(nr = 0; nr <= bitmap->num_bits; nr++) {
+		if(nr < bitmap->num_bits && 
+			!bit(bitmap->blocks[nr / bits]->blk_data, nr % bits)) {
+			if(first < 0)
+				first = nr;
+		}
+		else if(first >= 0) {
+			extent_tree_give(bitmap->tree, first, nr - first);
+			first = -1;
+		}
+	}
+}
+
+
+
+/*
+ * Returns whether a bit in the given bitmap is set.
+ */
+int test_bit(struct generic_bitmap *bitmap, int bit_num)
+{
+	int bits_per_block = BLOCK_SIZE * 8;
+
+	return bit(bitmap->blocks[bit_num / bits_per_block]->blk_data,
+		bit_num % bits_per_block) != 0;
+}
 
 /*
  * Free's a bit in the given gitmap.
@@ -119,7 +325,11 @@ void free_bit(struct generic_bitmap *bitmap, int bit_num)
 		panic("free_bit(%d): bit is already free", bit_num);
 	}
 
+	lock_block(bitmap->blocks[block]);
 	clrbit(bitmap->blocks[block]->blk_data, block_bit);
-	bitmap->blocks[block]->blk_dirty = TRUE;
+	mark_dirty(bitmap->blocks[block]);
+	unlock_block(bitmap->blocks[block]);
+	if(bitmap->tree != NULL)
+		extent_tree_give(bitmap->tree, bit_num, 1);
 }
 
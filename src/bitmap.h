@@ -1,6 +1,8 @@
 #ifndef _MINIX_BITMAP
 #define _MINIX_BITMAP
 
+#include "extent_tree.h"
+
 /**
  * A generic bitmap.
  */
@@ -8,10 +10,48 @@ struct generic_bitmap {
 	int num_blocks;			/* # of blocks to hold the bitmap */
 	struct minix_block **blocks;	/* the bitmap blocks */
 	int num_bits;			/* # of bits in bitmap */
+	struct extent_tree *tree;	/* free extents, or NULL if not kept */
 };
 
 void bitmap_print(struct generic_bitmap *bmap);
 int alloc_bit(struct generic_bitmap *bitmap, int origin);
 void free_bit(struct generic_bitmap *bitmap, int bit);
+int test_bit(struct generic_bitmap *bitmap, int bit);
+
+/**
+ * Frees the 'count' bits from 'first', which must all be set, clearing them
+ * a word at a time.
+ */
+void free_bits(struct generic_bitmap *bitmap, int first, int count);
+
+/**
+ * Allocates up to 'count' bits in a row as near to 'origin' as possible and
+ * sets *got to how many. All 'count' are allocated if any free extent is
+ * that long, otherwise the longest there is. Returns the first bit, or -1 
+ * if every bit is set.
+ *
+ * Only bitmaps with a tree can find a run. Others allocate one bit.
+ */
+int alloc_bits(struct generic_bitmap *bitmap, int origin, int count, 
+	int *got);
+
+/**
+ * Reservations. reserve_bits() sets aside up to 'count' bits in a row near
+ * 'origin' as alloc_bits() would, but only takes them out of the tree, so 
+ * that nothing else is given them while the bitmap itself is left alone.
+ * claim_bits() then sets reserved bits when they are used and 
+ * unreserve_bits() puts back those that weren't. Bitmaps without a tree 
+ * can't reserve and reserve_bits() always returns -1 for them.
+ */
+int reserve_bits(struct generic_bitmap *bitmap, int origin, int count, 
+	int *got);
+void claim_bits(struct generic_bitmap *bitmap, int first, int count);
+void unreserve_bits(struct generic_bitmap *bitmap, int first, int count);
+
+/**
+ * Builds the tree of the bitmap's free extents, which alloc_bit(), 
+ * alloc_bits() and free_bit() then keep up to date.
+ */
+void bitmap_build_tree(struct generic_bitmap *bitmap);
 
 #endif
@@ -8,130 +8,633 @@
 #define _GNU_SOURCE		/* for O_DIRECT */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE		/* linux/fs.h's. ours is in const.h */
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "const.h"
 #include "comms.h"
 #include "short_array.h"
 #include "cache.h"
 
-struct minix_block *front;	/* front of buffer chain. LRU. */
-struct minix_block *rear;	/* back of buffer chain. MRU. */
-struct minix_block 
-	*cache_hash[NR_BUF_HASH];	/* hash table of block chains */
-int bufs_in_use = 0;			/* number of buffers in use */
+/* the shard a block lives in and its bucket within that shard's hash table */
+#define SHARD_OF(b)	(&shards[(b) & (NR_CACHE_SHARDS - 1)])
+#define HASH_OF(s, b)	(((b) / NR_CACHE_SHARDS) & ((s)->nr_hash - 1))
+
+/* 2Q tuning, as recommended by Johnson and Shasha */
+#define A1IN_SHARE 4		/* Kin: 1/4 of the buffers for A1in */
+#define GHOST_SHARE 2		/* Kout: remember 1/2 as many blocks in A1out */
+#define NO_GHOST -1
+
+/* a field of the cache_opts given to init_cache(), or its default */
+#define OPT(opts, f, def) \
+	((opts) != NULL && (opts)->f != 0 ? (opts)->f : (def))
+
+#define CLEAN_SCAN 8		/* idle buffers a miss looks past for a clean
+				 * one before settling for a dirty one */
+
+#define IO_RUN_MAX 256		/* most adjacent blocks read or written by a
+				 * single request */
+#define IO_QUEUE_DEPTH 128	/* io_uring requests in flight at most */
+
+#define SLAB_ALIGN (2 * 1024 * 1024)	/* align the buffer slab so it can be
+					 * backed by huge pages */
+
+/* the kind of block passed to put_block, without the placement hints */
+#define BLOCK_KIND(t)	((t) & ~(WRITE_IMMED | ONE_SHOT))
+#define IS_METADATA(t)	(BLOCK_KIND(t) <= BLOCK_KIND(INDIRECT_BLOCK))
+
+/**
+ * A read or write of a run of adjacent blocks, as handed to an I/O backend.
+ * Every block in the run is flagged BLK_READING or BLK_WRITING until the
+ * request completes.
+ */
+struct io_req {
+	int write;			/* TRUE to write, FALSE to read */
+	int unpin;			/* unpin blocks on completion */
+	struct io_batch *batch;		/* told of completion, may be NULL */
+	int n;				/* # of blocks */
+	struct minix_block *blks[IO_RUN_MAX];
+	struct iovec iov[IO_RUN_MAX];
+};
+
+/**
+ * Lets a caller wait for a number of requests to complete.
+ */
+struct io_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;			/* requests not yet complete */
+};
+
+/**
+ * A way of doing block I/O. submit() may complete the request before it
+ * returns or leave it queued until kick() is called, and complete it at any
+ * time after that from any thread, by calling io_complete().
+ */
+struct io_backend {
+	const char *name;
+	int (*setup)(void);		/* returns 0 if usable */
+	void (*submit)(struct io_req *req);
+	void (*kick)(void);		/* start queued requests */
+	void (*teardown)(void);		/* after all requests complete */
+};
+
+/**
+ * A chain of unpinned buffers. Buffers are evicted from the front.
+ */
+struct buf_queue {
+	struct minix_block *front;	/* front of buffer chain. LRU. */
+	struct minix_block *rear;	/* back of buffer chain. MRU. */
+	int len;			/* # of buffers on the chain */
+};
+
+/**
+ * An independently locked part of the buffer cache. Every block number maps
+ * to exactly one shard which owns a fixed set of buffers, its own LRU chains
+ * and its own hash table.
+ */
+struct cache_shard {
+	pthread_mutex_t lock;		/* protects everything below and the
+					 * header of every buffer in bufs */
+	pthread_cond_t io_done;		/* broadcast when blk_state changes */
+	struct minix_block *bufs;	/* buffers owned by shard */
+	int nr_bufs;			/* # of buffers in bufs */
+	struct buf_queue q[NR_QUEUES];	/* unpinned buffers, see blk_queue */
+	struct minix_block **hash;	/* hash table of block chains */
+	int nr_hash;			/* # of chains. power of 2 */
+	int bufs_in_use;		/* number of buffers in use */
+	unsigned long hits;		/* get_block's found in this shard */
+	unsigned long misses;		/* get_block's that had to evict */
+
+	/* 2Q's A1out. a FIFO ring of the numbers of blocks recently evicted
+	 * from A1in, hashed so a miss can check it in constant time. */
+	int *ghost;			/* block numbers or NO_GHOST */
+	int *ghost_next;		/* next entry in hash chain */
+	int *ghost_hash;		/* first entry of each chain */
+	int ghost_slots;		/* size of the three arrays above */
+	int ghost_head;			/* oldest entry in the ring */
+	int nr_ghosts;			/* # of ring entries in use */
+	int a1in_max;			/* most buffers A1in may hold */
+};
+
+static struct cache_shard shards[NR_CACHE_SHARDS];
+static struct minix_block *headers;	/* every buffer header */
+static char *slab;			/* every buffer's data portion */
+static int nr_bufs;			/* # of buffers in the cache */
+static int policy = CACHE_POLICY_LRU;	/* replacement policy in use */
+static FILE *trace_fp = NULL;		/* get/put trace, if recording */
+
+static const char *policy_names[] = { "lru", "2q" };
+static struct io_backend *io;		/* how blocks get to and from disk */
 int fd;					/* I/O device file descriptor */
 struct short_array *write_log;		/* where we record every block written
 					 * to disk. */
+static pthread_mutex_t write_log_lock = PTHREAD_MUTEX_INITIALIZER;
 
-unsigned long cache_read_count = 0;	/* number of device reads */
+unsigned long cache_read_count = 0;	/* number of blocks read */
+unsigned long cache_read_calls = 0;	/* number of device reads */
+unsigned long cache_ra_count = 0;	/* of those, by cache_readahead() */
+unsigned long cache_write_count = 0;	/* number of blocks written */
+unsigned long cache_write_calls = 0;	/* number of device writes */
+unsigned long cache_flush_count = 0;	/* of those, by the flusher */
+unsigned long cache_direct_count = 0;	/* of those, by cache_write_direct() */
+
+/* background writeback. the thresholds are in buffers. */
+static int nr_dirty;			/* dirty buffers over all shards */
+static int dirty_bg;			/* flusher writes while above this */
+static int dirty_max;			/* put_block writes while above this */
+static int dirty_expire;		/* secs a block may stay dirty */
+static int flush_interval;		/* secs between flusher passes */
+static pthread_t flusher_thread;
+static int flusher_running = FALSE;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+static int flush_kicked;		/* flusher woken early */
+static int flush_stop;			/* flusher asked to exit */
+static void (*flush_hook)(time_t before);
+static pthread_mutex_t hook_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *flusher(void *arg);
+
+/* counters above are updated with atomic adds outside the shard locks and
+ * read with this */
+#define COUNTER(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
 
 /**
- * Create a new empty block with the data portion set to BLOCK_SIZE bytes
- * and correctly aligned for O_DIRECT I/O.
+ * Sets up an empty block whose data portion is the BLOCK_SIZE bytes at 'data'.
+ * 'data' must be aligned for O_DIRECT I/O.
  */
-static struct minix_block *mk_block(void)
+static void mk_block(struct minix_block *blk, char *data)
 {
-	struct minix_block *blk = (struct minix_block *) 
-		malloc(sizeof(struct minix_block));
-	if(blk == NULL)
-		panic("mk_block(): unable to malloc new block");
-
 	blk->blk_nr = NO_BLOCK;
 	blk->blk_next = NIL_BUF;
 	blk->blk_prev = NIL_BUF;
 	blk->blk_hash = NIL_BUF;
+	blk->blk_hash_prev = NIL_BUF;
 	blk->blk_dirty = FALSE;
-	blk->blk_count = 0;
+	blk->blk_state = 0;
+	blk->blk_queue = Q_MAIN;
+	blk->blk_pins = 0;
+	blk->blk_dirtied = 0;
+	blk->blk_data = data;
+}
 
-	/* allocate BLOCK_SIZE bytes for data region of our block. this region
- 	 * must be mem aligned when using direct I/O (via the O_DIRECT flag)
- 	 * with our device. we do this to bypass the linux buffer cache. */
-	if(posix_memalign((void **) &blk->blk_data, BLOCK_ALIGN, 
-		BLOCK_SIZE) != 0) 
-		panic("mk_block(): unable to posix_memalign data region of "
-			"new block");
+/**
+ * Takes blk off the chain it is on. Done whenever a block becomes pinned so
+ * that chains only ever hold blocks that could be evicted.
+ */
+static void lru_remove(struct buf_queue *q, struct minix_block *blk)
+{
+	if(blk->blk_prev == NIL_BUF) 
+		q->front = blk->blk_next;	/* block was on front */
+	else
+		blk->blk_prev->blk_next = blk->blk_next;
 
-	/* everything constructed okay, return our new block */
-	return blk;
+	if(blk->blk_next == NIL_BUF)
+		q->rear = blk->blk_prev;	/* block was on rear */
+	else
+		blk->blk_next->blk_prev = blk->blk_prev;
+
+	blk->blk_next = NIL_BUF;
+	blk->blk_prev = NIL_BUF;
+	q->len--;
+}
+
+/**
+ * Puts blk on the front (LRU end) of the chain, i.e. next to be evicted.
+ */
+static void lru_add_front(struct buf_queue *q, struct minix_block *blk)
+{
+	blk->blk_prev = NIL_BUF;	/* nothing goes before front */
+	blk->blk_next = q->front;
+	if(q->front == NIL_BUF)
+		q->rear = blk;		/* LRU chain was empty */
+	else
+		q->front->blk_prev = blk;
+	q->front = blk;
+	q->len++;
+}
+
+/**
+ * Puts blk on the rear (MRU end) of the chain.
+ */
+static void lru_add_rear(struct buf_queue *q, struct minix_block *blk)
+{
+	blk->blk_prev = q->rear;
+	blk->blk_next = NIL_BUF;	/* nothing goes after rear */
+	if(q->rear == NIL_BUF)
+		q->front = blk;		/* LRU chain was empty */
+	else
+		q->rear->blk_next = blk;
+	q->rear = blk;
+	q->len++;
 }
 
 /**
- * Writes the given block to the device previously opened by
- * open_blk_device(...).
+ * Called by the I/O backend when a request completes with result res, the
+ * return value of the pread/pwritev it stands for. Releases the blocks to
+ * anyone waiting for them.
  *
- * Failure to write the block will result in an error message and the program
- * terminating.
+ * Failure to transfer all of the blocks will result in an error message and
+ * the program terminating.
  */
-static void write_block(struct minix_block *blk)
+static void io_complete(struct io_req *req, int res)
 {
-	int disk_offset = blk->blk_nr * BLOCK_SIZE;
-	info("\033[31mwrite_block(%d): writing block %d to disk offset %d...\033[0m", 
-		blk->blk_nr, blk->blk_nr, disk_offset);
-	
-	short_array_add(blk->blk_nr, write_log);	
-	
-	if(lseek(fd, disk_offset, SEEK_SET) != disk_offset) {
-		/* seek failed */
-		panic("write_block(%d): unable to seek to disk offset %d", 
-			blk->blk_nr, disk_offset);
+	struct cache_shard *s;
+	struct minix_block *blk;
+	int i;
+
+	if(res != req->n * BLOCK_SIZE) {
+		panic("io_complete(%d): unable to %s all %d blocks (%d)", 
+			req->blks[0]->blk_nr, req->write ? "write" : "read",
+			req->n, res);
 	}
 
-	if(write(fd, blk->blk_data, BLOCK_SIZE) != BLOCK_SIZE) {
-		panic("write_block(%d): unable to write all block data",
-			blk->blk_nr);
+	for(i = 0; i < req->n; i++) {
+		blk = req->blks[i];
+		s = SHARD_OF(blk->blk_nr);
+		pthread_mutex_lock(&s->lock);
+		blk->blk_state &= req->write ? ~BLK_WRITING : ~BLK_READING;
+		pthread_cond_broadcast(&s->io_done);
+		if(req->unpin && --blk->blk_pins == 0) {
+			s->bufs_in_use--;
+			lru_add_rear(&s->q[(int) blk->blk_queue], blk);
+		}
+		pthread_mutex_unlock(&s->lock);
 	}
-	
-	blk->blk_dirty = FALSE;
+
+	if(req->batch != NULL) {
+		pthread_mutex_lock(&req->batch->lock);
+		if(--req->batch->pending == 0)
+			pthread_cond_broadcast(&req->batch->done);
+		pthread_mutex_unlock(&req->batch->lock);
+	}
+	free(req);
 }
 
 /**
- * Reads a data block from the device previously opened by open_blk_device(...)
- * and copies it over to the data section of the given minix_block struct. The
- * block read is set in blk->blk_nr.
- *
- * Failure to read the block will result in an error message and the program
- * terminating.
- */ 
-static void read_block(struct minix_block *blk)
+ * Hands the run of n adjacent blocks in blks to the I/O backend to be read
+ * or written. Each block must already be flagged BLK_READING or BLK_WRITING.
+ * If 'unpin' is TRUE the blocks are unpinned once done. No shard lock may be
+ * held, and io->kick() must be called once the caller has nothing more to
+ * submit.
+ */
+static void start_io(struct minix_block **blks, int n, int write, int unpin,
+	struct io_batch *batch)
 {
-	int disk_offset = blk->blk_nr * BLOCK_SIZE;
+	struct io_req *req;
+	int i;
 
-	info("\033[32mread_block(%d): reading block %d from disk offset %d...\033[0m", 
-		blk->blk_nr, blk->blk_nr, disk_offset);
+	if((req = malloc(sizeof(struct io_req))) == NULL)
+		panic("start_io(): unable to allocate request");
+	req->write = write;
+	req->unpin = unpin;
+	req->batch = batch;
+	req->n = n;
+	for(i = 0; i < n; i++) {
+		req->blks[i] = blks[i];
+		req->iov[i].iov_base = blks[i]->blk_data;
+		req->iov[i].iov_len = BLOCK_SIZE;
+	}
+
+	if(write) {
+		info("\033[31mstart_io(%d): writing %d blocks to disk offset "
+			"%ld...\033[0m", blks[0]->blk_nr, n, 
+			(long) blks[0]->blk_nr * BLOCK_SIZE);
+		pthread_mutex_lock(&write_log_lock);
+		for(i = 0; i < n; i++)
+			short_array_add(blks[i]->blk_nr, write_log);	
+		pthread_mutex_unlock(&write_log_lock);
+		__sync_fetch_and_add(&cache_write_count, n);
+		__sync_fetch_and_add(&cache_write_calls, 1);
+	}
+	else {
+		info("\033[32mstart_io(%d): reading %d blocks from disk offset "
+			"%ld...\033[0m", blks[0]->blk_nr, n, 
+			(long) blks[0]->blk_nr * BLOCK_SIZE);
+		__sync_fetch_and_add(&cache_read_count, n);
+		__sync_fetch_and_add(&cache_read_calls, 1);
+	}
+
+	if(batch != NULL) {
+		pthread_mutex_lock(&batch->lock);
+		batch->pending++;
+		pthread_mutex_unlock(&batch->lock);
+	}
+	io->submit(req);
+}
+
+static void batch_init(struct io_batch *batch)
+{
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->done, NULL);
+	batch->pending = 0;
+}
+
+/**
+ * Starts any queued requests and waits for every request in batch to
+ * complete.
+ */
+static void batch_wait(struct io_batch *batch)
+{
+	io->kick();
+	pthread_mutex_lock(&batch->lock);
+	while(batch->pending > 0)
+		pthread_cond_wait(&batch->done, &batch->lock);
+	pthread_mutex_unlock(&batch->lock);
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->done);
+}
+
+/*
+ * The synchronous backend. Each request is a single preadv/pwritev made by
+ * the thread submitting it.
+ */
+
+static int sync_setup(void)
+{
+	return 0;
+}
+
+static void sync_submit(struct io_req *req)
+{
+	off_t disk_offset = (off_t) req->blks[0]->blk_nr * BLOCK_SIZE;
+
+	/* preadv/pwritev rather than lseek+read/write since other threads 
+	 * share fd */
+	if(req->write)
+		io_complete(req, pwritev(fd, req->iov, req->n, disk_offset));
+	else
+		io_complete(req, preadv(fd, req->iov, req->n, disk_offset));
+}
+
+static void sync_kick(void)
+{
+}
+
+static void sync_teardown(void)
+{
+}
+
+static struct io_backend sync_io = {
+	"sync", sync_setup, sync_submit, sync_kick, sync_teardown
+};
+
+/*
+ * The io_uring backend. Requests are queued on the submission ring as they
+ * are submitted and handed to the kernel together by kick(), so a batch of
+ * runs from readahead or writeback costs one system call. A reaper thread
+ * waits on the completion ring and completes requests as they finish. The
+ * rings are driven with raw system calls so no liburing is needed.
+ */
 
-	cache_read_count++;
+static struct {
+	int fd;
+	void *sq_ring, *cq_ring;	/* may be the same mapping */
+	size_t sq_ring_sz, cq_ring_sz;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned entries;		/* size of the submission ring */
+
+	pthread_mutex_t lock;		/* protects the submission ring and
+					 * the two counts below */
+	pthread_cond_t room;		/* signalled as requests complete */
+	unsigned queued;		/* on the ring awaiting kick() */
+	unsigned in_flight;		/* queued or with the kernel */
+	pthread_t reaper;
+} uring;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, 
+	unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
 
-	if(lseek(fd, disk_offset, SEEK_SET) != disk_offset) {
-		panic("read_block(%d): unable to seek to disk offset %d",
-			blk->blk_nr, disk_offset);
+/**
+ * Hands the queued requests to the kernel. uring.lock must be held.
+ */
+static void uring_submit_queued(void)
+{
+	int ret;
+
+	while(uring.queued > 0) {
+		if((ret = uring_enter(uring.queued, 0, 0)) < 0) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			panic("uring_submit_queued(): io_uring_enter failed");
+		}
+		uring.queued -= ret;
 	}
-	if(read(fd, blk->blk_data, BLOCK_SIZE) != BLOCK_SIZE) {
-		panic("read_block(%d): unable to read all block data",
-			blk->blk_nr);
+}
+
+/**
+ * Reaps completions until told to stop by a request with no io_req.
+ */
+static void *uring_reaper(void *arg)
+{
+	struct io_uring_cqe *cqe;
+	struct io_req *req;
+	unsigned head;
+	int res, stop = FALSE, more = TRUE;
+
+	while(more) {
+		if(uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && 
+			errno != EINTR)
+			panic("uring_reaper(): io_uring_enter failed");
+
+		head = *uring.cq_head;
+		while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &uring.cqes[head & *uring.cq_mask];
+			req = (struct io_req *) (unsigned long) cqe->user_data;
+			res = cqe->res;
+			head++;
+			__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+			/* taking the lock the request was queued under also
+			 * orders its setup before its completion for tools
+			 * that can't see through the rings */
+			pthread_mutex_lock(&uring.lock);
+			if(req == NULL)
+				stop = TRUE;
+			uring.in_flight--;
+			more = !stop || uring.in_flight > 0;
+			pthread_cond_signal(&uring.room);
+			pthread_mutex_unlock(&uring.lock);
+
+			if(req != NULL)
+				io_complete(req, res);
+		}
 	}
-	blk->blk_dirty = FALSE;
+	return NULL;
 }
 
+/**
+ * Puts an operation on the submission ring, waiting for room if need be.
+ */
+static void uring_queue(int opcode, struct io_req *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	pthread_mutex_lock(&uring.lock);
+	while(uring.in_flight >= uring.entries) {
+		uring_submit_queued();	/* the reaper can't free what the
+					 * kernel has not been given */
+		pthread_cond_wait(&uring.room, &uring.lock);
+	}
+
+	tail = *uring.sq_tail;
+	idx = tail & *uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long) req;
+	if(req != NULL) {
+		sqe->addr = (unsigned long) req->iov;
+		sqe->len = req->n;
+		sqe->off = (off_t) req->blks[0]->blk_nr * BLOCK_SIZE;
+	}
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	uring.queued++;
+	uring.in_flight++;
+	pthread_mutex_unlock(&uring.lock);
+}
+
+static void uring_submit(struct io_req *req)
+{
+	uring_queue(req->write ? IORING_OP_WRITEV : IORING_OP_READV, req);
+}
+
+static void uring_kick(void)
+{
+	pthread_mutex_lock(&uring.lock);
+	uring_submit_queued();
+	pthread_mutex_unlock(&uring.lock);
+}
+
+static void uring_unmap(void)
+{
+	if(uring.sqes != MAP_FAILED)
+		munmap(uring.sqes, uring.entries * sizeof(struct io_uring_sqe));
+	if(uring.cq_ring != MAP_FAILED && uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_sz);
+	if(uring.sq_ring != MAP_FAILED)
+		munmap(uring.sq_ring, uring.sq_ring_sz);
+	close(uring.fd);
+}
+
+static int uring_setup(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+	if(uring.fd < 0)
+		return -1;
+
+	uring.entries = p.sq_entries;
+	uring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_sz = p.cq_off.cqes + 
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		uring.sq_ring_sz = uring.cq_ring_sz = 
+			MAX(uring.sq_ring_sz, uring.cq_ring_sz);
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	uring.cq_ring = uring.sq_ring;
+	if(uring.sq_ring != MAP_FAILED && 
+		!(p.features & IORING_FEAT_SINGLE_MMAP))
+		uring.cq_ring = mmap(NULL, uring.cq_ring_sz, 
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			uring.fd, IORING_OFF_CQ_RING);
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+		IORING_OFF_SQES);
+	if(uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED ||
+		uring.sqes == MAP_FAILED) {
+		uring_unmap();
+		return -1;
+	}
+
+	uring.sq_tail = (unsigned *) ((char *) uring.sq_ring + p.sq_off.tail);
+	uring.sq_mask = (unsigned *) ((char *) uring.sq_ring + 
+		p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *) ((char *) uring.sq_ring + 
+		p.sq_off.array);
+	uring.cq_head = (unsigned *) ((char *) uring.cq_ring + p.cq_off.head);
+	uring.cq_tail = (unsigned *) ((char *) uring.cq_ring + p.cq_off.tail);
+	uring.cq_mask = (unsigned *) ((char *) uring.cq_ring + 
+		p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) ((char *) uring.cq_ring + 
+		p.cq_off.cqes);
+
+	pthread_mutex_init(&uring.lock, NULL);
+	pthread_cond_init(&uring.room, NULL);
+	uring.queued = 0;
+	uring.in_flight = 0;
+	if(pthread_create(&uring.reaper, NULL, uring_reaper, NULL) != 0) {
+		uring_unmap();
+		return -1;
+	}
+	return 0;
+}
+
+static void uring_teardown(void)
+{
+	/* a no-op with no request tells the reaper to finish up */
+	uring_queue(IORING_OP_NOP, NULL);
+	uring_kick();
+	pthread_join(uring.reaper, NULL);
+
+	uring_unmap();
+	pthread_mutex_destroy(&uring.lock);
+	pthread_cond_destroy(&uring.room);
+}
+
+static struct io_backend uring_io = {
+	"uring", uring_setup, uring_submit, uring_kick, uring_teardown
+};
+
+static struct io_backend *io_backends[] = { &sync_io, &uring_io };
+#define NR_IO_BACKENDS (sizeof(io_backends) / sizeof(io_backends[0]))
+
 static void print_cache_block(struct minix_block *blk)
 {
 	printf("  blk_nr: %d\n", blk->blk_nr);
 	printf("  blk_dirty: %s\n", blk->blk_dirty == TRUE ? "true" : "false");
+	printf("  blk_pins: %d\n", blk->blk_pins);
+	printf("  blk_queue: %s\n", blk->blk_queue == Q_HOT ? "hot" : "main");
 	printf("  blk_data: %p\n", blk->blk_data);
 }
 						
 void print_cache(void)
 {
-	struct minix_block *blk;
-	blk = front;
-	int i = 0;
+	int i = 0, s, j;
 
-	while(blk != NIL_BUF) {
-		printf("Cache Block %d:\n", i++);
-		print_cache_block(blk);
-		blk = blk->blk_next;
+	for(s = 0; s < NR_CACHE_SHARDS; s++) {
+		pthread_mutex_lock(&shards[s].lock);
+		for(j = 0; j < shards[s].nr_bufs; j++) {
+			printf("Cache Block %d (shard %d):\n", i++, s);
+			print_cache_block(&shards[s].bufs[j]);
+		}
+		pthread_mutex_unlock(&shards[s].lock);
 	}
 }
 
@@ -155,46 +658,145 @@ void open_blk_device(const char *d)
 	debug("open_device(\"%s\"): successfully opened device", d);
 }
 
+/**
+ * Returns the smallest power of 2 >= n.
+ */
+static int pow2_roundup(int n)
+{
+	int p = 1;
+	while(p < n) 
+		p <<= 1;
+	return p;
+}
+
 /**
  * Initiate the buffer cache by preallocating the necessary buffers and
  * linking them together.
+ *
+ * The data portions of all buffers come from a single aligned slab and the
+ * headers from a single array, rather than an allocation per buffer. Each
+ * shard's hash table is sized to twice its number of buffers.
+ *
+ * opts may be NULL in which case the defaults are used.
  */
-void init_cache(void)
+void init_cache(const struct cache_opts *opts)
 {
-	int i;
+	int i, j;
+	struct cache_shard *s;
 	struct minix_block *blk;
+	size_t slab_size;
+
+	policy = CACHE_POLICY_LRU;
+	if(opts != NULL && opts->policy != NULL) {
+		for(policy = 0; policy < NR_CACHE_POLICIES; policy++)
+			if(strcmp(opts->policy, policy_names[policy]) == 0)
+				break;
+		if(policy == NR_CACHE_POLICIES)
+			panic("init_cache(): unknown cache policy \"%s\"",
+				opts->policy);
+	}
+
+	io = &sync_io;
+	if(opts != NULL && opts->io != NULL) {
+		for(i = 0; i < NR_IO_BACKENDS; i++)
+			if(strcmp(opts->io, io_backends[i]->name) == 0)
+				break;
+		if(i == NR_IO_BACKENDS)
+			panic("init_cache(): unknown I/O backend \"%s\"",
+				opts->io);
+		io = io_backends[i];
+	}
+	if(io->setup() != 0) {
+		info_1("init_cache(): unable to set up %s I/O, falling back "
+			"to %s", io->name, sync_io.name);
+		io = &sync_io;
+		io->setup();
+	}
+
+	if(opts != NULL && opts->trace_file != NULL) {
+		if((trace_fp = fopen(opts->trace_file, "w")) == NULL)
+			panic("init_cache(): unable to open trace file \"%s\"",
+				opts->trace_file);
+	}
+
+	nr_bufs = NR_BUFS;
+	if(opts != NULL && opts->cache_mb > 0)
+		nr_bufs = opts->cache_mb * (1024 * 1024 / BLOCK_SIZE);
+	nr_bufs -= nr_bufs % NR_CACHE_SHARDS;	/* same share for each shard */
+	if(nr_bufs < NR_CACHE_SHARDS * 4)
+		panic("init_cache(): cache of %d blocks is too small", nr_bufs);
+
+	nr_dirty = 0;
+	dirty_bg = nr_bufs * OPT(opts, dirty_bg, DIRTY_BG_RATIO) / 100;
+	dirty_max = nr_bufs * OPT(opts, dirty_max, DIRTY_MAX_RATIO) / 100;
+	dirty_expire = OPT(opts, dirty_expire, DIRTY_EXPIRE);
+	flush_interval = OPT(opts, flush_interval, FLUSH_INTERVAL);
+	if(dirty_bg > dirty_max)
+		dirty_bg = dirty_max;
 	
-	front = NIL_BUF;
-	rear = NIL_BUF;
-
-	debug("init_cache(): allocating %d cache blocks...", NR_BUFS);
-	for(i = 0; i < NR_BUFS; i++) {
-		blk = mk_block();
-		/* put block on front of chain */
-		if(front == NIL_BUF) {
-			rear = blk;
-		}
-		else { 
-			front->blk_prev = blk;
-			blk->blk_next = front;
+	debug("init_cache(): allocating %d cache blocks in %d shards...", 
+		nr_bufs, NR_CACHE_SHARDS);
+	slab_size = (size_t) nr_bufs * BLOCK_SIZE;
+	if(posix_memalign((void **) &slab, SLAB_ALIGN, slab_size) != 0)
+		panic("init_cache(): unable to posix_memalign %lu byte buffer "
+			"slab", (unsigned long) slab_size);
+#ifdef MADV_HUGEPAGE
+	madvise(slab, slab_size, MADV_HUGEPAGE);	/* only a hint */
+#endif
+	if((headers = calloc(nr_bufs, sizeof(struct minix_block))) == NULL)
+		panic("init_cache(): unable to allocate buffer headers");
+
+	for(i = 0; i < NR_CACHE_SHARDS; i++) {
+		s = &shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->io_done, NULL);
+		memset(s->q, 0, sizeof(s->q));
+		s->bufs_in_use = 0;
+		s->hits = 0;
+		s->misses = 0;
+
+		s->nr_bufs = nr_bufs / NR_CACHE_SHARDS;
+		s->bufs = &headers[i * s->nr_bufs];
+		for(j = 0; j < s->nr_bufs; j++) {
+			blk = &s->bufs[j];
+			mk_block(blk, slab + 
+				(size_t) (i * s->nr_bufs + j) * BLOCK_SIZE);
+
+			/* put block on the main chain. it stays out of the
+			 * hash table until it is first used. */
+			lru_add_front(&s->q[Q_MAIN], blk);
 		}
+	
+		s->nr_hash = pow2_roundup(s->nr_bufs * 2);
+		s->hash = (struct minix_block **) 
+			calloc(s->nr_hash, sizeof(struct minix_block *));
 
-		blk->blk_hash = front;	/* just to set up initial hash chain */
-		front = blk;		/* finially place new block at front */
+		s->a1in_max = s->nr_bufs / A1IN_SHARE;
+		s->ghost_slots = s->nr_bufs / GHOST_SHARE;
+		s->ghost = malloc(s->ghost_slots * sizeof(int));
+		s->ghost_next = malloc(s->ghost_slots * sizeof(int));
+		s->ghost_hash = malloc(s->ghost_slots * sizeof(int));
+		if(s->hash == NULL || s->ghost == NULL || 
+			s->ghost_next == NULL || s->ghost_hash == NULL)
+			panic("init_cache(): unable to allocate shard %d", i);
+		for(j = 0; j < s->ghost_slots; j++) {
+			s->ghost[j] = NO_GHOST;
+			s->ghost_hash[j] = NO_GHOST;
+		}
+		s->ghost_head = 0;
+		s->nr_ghosts = 0;
 	}
 	
-	debug("init_cache(): clearing cache hash table of size %d...", 
-		NR_BUF_HASH);
-	for(i = 0; i < NR_BUF_HASH; i++)
-		cache_hash[i] = NIL_BUF;
-
-	debug("init_cache(): creating initial cache block hash chain at "
-		"cache_hash[%d]...",
-		 NO_BLOCK & (NR_BUF_HASH - 1));
-	cache_hash[NO_BLOCK & (NR_BUF_HASH - 1)] = front;
-	
 	/* init the write log */
 	write_log = short_array_init(ARR_DEFAULT_SIZE);	
+
+	flush_stop = FALSE;
+	flush_kicked = FALSE;
+	if(flush_interval > 0) {
+		if(pthread_create(&flusher_thread, NULL, flusher, NULL) != 0)
+			panic("init_cache(): unable to start flusher thread");
+		flusher_running = TRUE;
+	}
 }
 
 /**
@@ -205,9 +807,20 @@ void init_cache(void)
  */
 void cache_destroy(void)
 {
-	/* TODO: Should really clean up cache memory. */
+	int i;
 
-	info_1("cache_destory(): total device reads = %u\n", cache_read_count);
+	if(flusher_running) {
+		pthread_mutex_lock(&flush_lock);
+		flush_stop = TRUE;
+		pthread_cond_signal(&flush_wake);
+		pthread_mutex_unlock(&flush_lock);
+		pthread_join(flusher_thread, NULL);
+		flusher_running = FALSE;
+	}
+	io->teardown();
+
+	info_1("cache_destory(): total device reads = %lu\n", 
+		cache_read_count);
 
 	info_1("cache_destroy(): saving %d entries from cache write log to"
 		" %s... ", write_log->size, CACHE_WRITE_LOG_FILE);
@@ -221,34 +834,513 @@ void cache_destroy(void)
 
 	debug("cache_destroy(): destroying cache write log...");
 	short_array_destroy(write_log);
+
+	if(trace_fp != NULL) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+
+	debug("cache_destroy(): freeing cache buffers...");
+	for(i = 0; i < NR_CACHE_SHARDS; i++) {
+		free(shards[i].hash);
+		free(shards[i].ghost);
+		free(shards[i].ghost_next);
+		free(shards[i].ghost_hash);
+		pthread_mutex_destroy(&shards[i].lock);
+		pthread_cond_destroy(&shards[i].io_done);
+	}
+	free(headers);
+	free(slab);
+}
+
+/**
+ * Returns the number of buffers in the cache.
+ */
+int cache_nr_bufs(void)
+{
+	return nr_bufs;
+}
+
+/**
+ * Returns the total number of hash chains over all shards.
+ */
+int cache_nr_hash(void)
+{
+	return shards[0].nr_hash * NR_CACHE_SHARDS;
+}
+
+/**
+ * Returns the name of the I/O backend in use.
+ */
+const char *cache_io_name(void)
+{
+	return io->name;
+}
+
+/**
+ * Returns the name of the replacement policy in use.
+ */
+const char *cache_policy_name(void)
+{
+	return policy_names[policy];
+}
+
+/**
+ * Wakes the flusher thread ahead of its next pass.
+ */
+static void wake_flusher(void)
+{
+	if(!flusher_running)
+		return;
+	pthread_mutex_lock(&flush_lock);
+	flush_kicked = TRUE;
+	pthread_cond_signal(&flush_wake);
+	pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Writes out a dirty block while holding its shard lock on entry and exit.
+ * The lock is dropped for the duration of the I/O. The block is flagged
+ * BLK_WRITING meanwhile so it cannot be evicted or locked under us.
+ *
+ * The block is marked clean before the write is issued so that anyone
+ * modifying it while the write is in progress marks it dirty again.
+ */
+static void flush_block(struct cache_shard *s, struct minix_block *blk)
+{
+	blk->blk_state |= BLK_WRITING;
+	blk->blk_dirty = FALSE;
+	__sync_fetch_and_sub(&nr_dirty, 1);
+	pthread_mutex_unlock(&s->lock);
+
+	start_io(&blk, 1, TRUE, FALSE, NULL);
+	io->kick();
+
+	pthread_mutex_lock(&s->lock);
+	while(blk->blk_state & BLK_WRITING)
+		pthread_cond_wait(&s->io_done, &s->lock);
+}
+
+/**
+ * Claims up to max dirty blocks for writing, flagging each BLK_WRITING and
+ * marking it clean as flush_block() does, and puts them in batch. Only blocks
+ * that became dirty no later than 'before' are taken, and pinned ones only if
+ * 'pinned' is TRUE. Blocks that are locked or already being written are
+ * skipped rather than waited for.
+ *
+ * Returns the number of blocks claimed. They must be passed to write_batch().
+ */
+static int claim_dirty(struct minix_block **batch, int max, time_t before,
+	int pinned)
+{
+	struct cache_shard *s;
+	struct minix_block *blk;
+	int n = 0;
+	int i, j;
+
+	for(i = 0; i < NR_CACHE_SHARDS && n < max; i++) {
+		s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		for(j = 0; j < s->nr_bufs && n < max; j++) {
+			blk = &s->bufs[j];
+			if(blk->blk_dirty == TRUE && blk->blk_state == 0 &&
+				(pinned || blk->blk_pins == 0) &&
+				blk->blk_dirtied <= before) {
+				blk->blk_state |= BLK_WRITING;
+				blk->blk_dirty = FALSE;
+				__sync_fetch_and_sub(&nr_dirty, 1);
+				batch[n++] = blk;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return n;
+}
+
+static int cmp_blk_nr(const void *a, const void *b)
+{
+	return (*(struct minix_block **) a)->blk_nr - 
+		(*(struct minix_block **) b)->blk_nr;
+}
+
+/**
+ * Writes out n blocks claimed by claim_dirty() in block number order, with
+ * each run of adjacent blocks merged into a single write, and releases them.
+ * All of the writes are submitted before any is waited for. No shard lock 
+ * may be held.
+ */
+static void write_batch(struct minix_block **batch, int n)
+{
+	struct io_batch writes;
+	int i, run;
+
+	batch_init(&writes);
+	qsort(batch, n, sizeof(struct minix_block *), cmp_blk_nr);
+	for(i = 0; i < n; i += run) {
+		for(run = 1; i + run < n && run < IO_RUN_MAX &&
+			batch[i + run]->blk_nr == batch[i]->blk_nr + run; run++)
+			;
+		start_io(&batch[i], run, TRUE, FALSE, &writes);
+	}
+	batch_wait(&writes);
 }
 
 /**
  * Sync's the buffer cache by writing all dirty blocks to disk.
  *
+ * Dirty blocks are gathered from every shard and written in block number
+ * order, adjacent blocks together, so the number of writes made is the
+ * number of runs of dirty blocks rather than the number of blocks. Anything
+ * that was locked or already being written at the time is waited for and
+ * written afterwards.
+ *
  * Returns the number of dirty blocks written.
  */
 int sync_cache(void)
 {
-	struct minix_block *blk;
-	int flush_count = 0;
-	blk = front;
-	while(blk != NIL_BUF) {
-		//if(blk->blk_dirty == TRUE && blk->blk_count == 0) {
-		if(blk->blk_dirty == TRUE) {
-			/* found block that is dirty and not in use so flush it
-			 * to disk. */
-			debug("sync_cache(): flushing block %d...", 
-				blk->blk_nr);
-			write_block(blk);
-			flush_count++;
+	struct cache_shard *s;
+	struct minix_block *blk, **batch;
+	int flush_count;
+	int i, j;
+
+	if((batch = malloc(nr_bufs * sizeof(struct minix_block *))) == NULL)
+		panic("sync_cache(): unable to allocate batch");
+	flush_count = claim_dirty(batch, nr_bufs, time(NULL), TRUE);
+	debug("sync_cache(): flushing %d blocks...", flush_count);
+	write_batch(batch, flush_count);
+	free(batch);
+
+	/* now the stragglers, one at a time. walk the shard's own buffer
+	 * array rather than its LRU chain since the chain may be reordered
+	 * while we wait on I/O. */
+	for(i = 0; i < NR_CACHE_SHARDS; i++) {
+		s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		for(j = 0; j < s->nr_bufs; j++) {
+			blk = &s->bufs[j];
+			while(blk->blk_dirty == TRUE && 
+				(blk->blk_state & (BLK_LOCKED | BLK_WRITING)))
+				pthread_cond_wait(&s->io_done, &s->lock);
+			if(blk->blk_dirty == TRUE) {
+				debug("sync_cache(): flushing block %d...", 
+					blk->blk_nr);
+				flush_block(s, blk);
+				flush_count++;
+			}
 		}
-		blk = blk->blk_next;
+		pthread_mutex_unlock(&s->lock);
 	}
 
 	return flush_count;
 }
 
+/**
+ * Writes back unpinned dirty blocks that became dirty no later than 'before'
+ * until no more than 'target' blocks are dirty. Pinned blocks are left to
+ * their users, put_block() and sync_cache(). Like sync_cache() the blocks are
+ * written sorted and coalesced. 'batch' must have room for nr_bufs blocks.
+ *
+ * Returns the number of blocks written.
+ */
+static int writeback(struct minix_block **batch, time_t before, int target)
+{
+	int n = COUNTER(nr_dirty) - target;
+
+	if(n <= 0)
+		return 0;
+	n = claim_dirty(batch, n, before, FALSE);
+	write_batch(batch, n);
+
+	__sync_fetch_and_add(&cache_flush_count, n);
+	return n;
+}
+
+/**
+ * The flusher thread. Every flush_interval seconds, or sooner if woken, it
+ * calls the flush hook, writes back blocks that have been dirty for longer
+ * than dirty_expire and then, if more than dirty_bg blocks are still dirty,
+ * enough of the rest to bring them down to dirty_bg. This keeps clean buffers
+ * at the front of the LRU chains so a miss seldom has to write out a victim
+ * itself.
+ */
+static void *flusher(void *arg)
+{
+	struct minix_block **batch;
+	struct timespec until;
+	time_t before;
+	int n;
+
+	if((batch = malloc(nr_bufs * sizeof(struct minix_block *))) == NULL)
+		panic("flusher(): unable to allocate batch");
+
+	pthread_mutex_lock(&flush_lock);
+	while(!flush_stop) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += flush_interval;
+		while(!flush_stop && !flush_kicked && pthread_cond_timedwait(
+			&flush_wake, &flush_lock, &until) != ETIMEDOUT)
+			;
+		if(flush_stop)
+			break;
+		flush_kicked = FALSE;
+		pthread_mutex_unlock(&flush_lock);
+
+		before = time(NULL) - dirty_expire;
+		pthread_mutex_lock(&hook_lock);
+		if(flush_hook != NULL)
+			flush_hook(before);
+		pthread_mutex_unlock(&hook_lock);
+
+		n = writeback(batch, before, 0);
+		if(COUNTER(nr_dirty) > dirty_bg)
+			n += writeback(batch, time(NULL), dirty_bg);
+		debug("flusher(): wrote back %d blocks, %d still dirty", n, 
+			COUNTER(nr_dirty));
+
+		pthread_mutex_lock(&flush_lock);
+	}
+	pthread_mutex_unlock(&flush_lock);
+	free(batch);
+	return NULL;
+}
+
+/**
+ * Looks up blk_nr in the hash table of shard s. Shard lock must be held.
+ */
+static struct minix_block *hash_find(struct cache_shard *s, int blk_nr)
+{
+	struct minix_block *blk = s->hash[HASH_OF(s, blk_nr)];
+
+	while(blk != NIL_BUF && blk->blk_nr != blk_nr)
+		blk = blk->blk_hash;
+	return blk;
+}
+
+static void hash_insert(struct cache_shard *s, struct minix_block *blk)
+{
+	struct minix_block **head = &s->hash[HASH_OF(s, blk->blk_nr)];
+
+	blk->blk_hash_prev = NIL_BUF;
+	blk->blk_hash = *head;
+	if(*head != NIL_BUF)
+		(*head)->blk_hash_prev = blk;
+	*head = blk;
+}
+
+/**
+ * Removes blk from the hash chain it is on, if any. The chain is doubly 
+ * linked so this never has to walk it. Shard lock must be held.
+ */
+static void hash_remove(struct cache_shard *s, struct minix_block *blk)
+{
+	struct minix_block **head = &s->hash[HASH_OF(s, blk->blk_nr)];
+
+	if(blk->blk_hash_prev != NIL_BUF)
+		blk->blk_hash_prev->blk_hash = blk->blk_hash;
+	else if(*head == blk)
+		*head = blk->blk_hash;
+	else
+		return;		/* never been hashed */
+
+	if(blk->blk_hash != NIL_BUF)
+		blk->blk_hash->blk_hash_prev = blk->blk_hash_prev;
+	blk->blk_hash = NIL_BUF;
+	blk->blk_hash_prev = NIL_BUF;
+}
+
+/**
+ * Pins blk for the caller. Shard lock must be held.
+ */
+static void pin_block(struct cache_shard *s, struct minix_block *blk)
+{
+	if(blk->blk_pins == 0) {
+		lru_remove(&s->q[(int) blk->blk_queue], blk);
+		s->bufs_in_use++;
+	}
+	blk->blk_pins++;
+}
+
+/**
+ * Remembers that blk_nr was just evicted from A1in. Once the ring is full the
+ * oldest entry is forgotten. Shard lock must be held.
+ */
+static void ghost_add(struct cache_shard *s, int blk_nr)
+{
+	int slot, *pp;
+
+	if(s->nr_ghosts == s->ghost_slots) {
+		/* reuse the oldest slot, unhashing whatever it held */
+		slot = s->ghost_head;
+		s->ghost_head = (s->ghost_head + 1) % s->ghost_slots;
+		if(s->ghost[slot] != NO_GHOST) {
+			pp = &s->ghost_hash[HASH_OF(s, s->ghost[slot]) % 
+				s->ghost_slots];
+			while(*pp != slot)
+				pp = &s->ghost_next[*pp];
+			*pp = s->ghost_next[slot];
+		}
+	}
+	else {
+		slot = (s->ghost_head + s->nr_ghosts) % s->ghost_slots;
+		s->nr_ghosts++;
+	}
+
+	s->ghost[slot] = blk_nr;
+	pp = &s->ghost_hash[HASH_OF(s, blk_nr) % s->ghost_slots];
+	s->ghost_next[slot] = *pp;
+	*pp = slot;
+}
+
+/**
+ * Returns TRUE and forgets blk_nr if it is in A1out, FALSE otherwise. Its
+ * ring slot is left empty until the ring comes round to it again.
+ */
+static int ghost_take(struct cache_shard *s, int blk_nr)
+{
+	int *pp = &s->ghost_hash[HASH_OF(s, blk_nr) % s->ghost_slots];
+
+	while(*pp != NO_GHOST) {
+		if(s->ghost[*pp] == blk_nr) {
+			s->ghost[*pp] = NO_GHOST;
+			*pp = s->ghost_next[*pp];
+			return TRUE;
+		}
+		pp = &s->ghost_next[*pp];
+	}
+	return FALSE;
+}
+
+/**
+ * Returns the first buffer on q that has no I/O in progress. A clean buffer
+ * is preferred if there is one among the first CLEAN_SCAN idle buffers.
+ */
+static struct minix_block *first_idle(struct buf_queue *q)
+{
+	struct minix_block *blk, *idle = NIL_BUF;
+	int n = 0;
+
+	for(blk = q->front; blk != NIL_BUF; blk = blk->blk_next) {
+		if(blk->blk_state != 0)
+			continue;
+		if(blk->blk_dirty == FALSE)
+			return blk;
+		if(idle == NIL_BUF)
+			idle = blk;
+		if(++n == CLEAN_SCAN)
+			break;
+	}
+	return idle;
+}
+
+/**
+ * Chooses the buffer to evict on a miss, or NIL_BUF if every unpinned buffer
+ * is busy with I/O.
+ *
+ * LRU simply takes the front of the main chain. 2Q evicts from A1in (the
+ * main chain) while it holds more than its share of the shard, and from Am
+ * (the hot chain) otherwise. Metadata and blocks that were asked for again
+ * after leaving A1in live on Am, so a long sequential read only ever cycles
+ * through A1in.
+ */
+static struct minix_block *pick_victim(struct cache_shard *s)
+{
+	struct minix_block *blk;
+	int q = Q_MAIN;
+
+	if(policy == CACHE_POLICY_2Q && s->q[Q_MAIN].len <= s->a1in_max &&
+		s->q[Q_HOT].len > 0)
+		q = Q_HOT;
+
+	if((blk = first_idle(&s->q[q])) == NIL_BUF)
+		blk = first_idle(&s->q[q == Q_MAIN ? Q_HOT : Q_MAIN]);
+	return blk;
+}
+
+/**
+ * Evicts the clean, idle and unpinned buffer blk and gives it to blk_nr,
+ * which must not be in the cache. The buffer is returned pinned. Shard lock
+ * must be held.
+ */
+static void reuse_block(struct cache_shard *s, struct minix_block *blk,
+	int blk_nr)
+{
+	debug("reuse_block(%d): evicting block %d from cache...", blk_nr, 
+		blk->blk_nr);	
+	/* remove the block from its existing hash chain */
+	hash_remove(s, blk);
+	if(policy == CACHE_POLICY_2Q && blk->blk_queue == Q_MAIN)
+		ghost_add(s, blk->blk_nr);
+
+	/* fill in block fields and add to the hash chain corresponding to the
+	 * new block number. with 2Q a block evicted from A1in not long ago
+	 * has shown it is worth keeping and goes to the hot chain. */
+	blk->blk_nr = blk_nr;
+	pin_block(s, blk);
+	hash_insert(s, blk);
+	blk->blk_queue = Q_MAIN;
+	if(policy == CACHE_POLICY_2Q && ghost_take(s, blk_nr))
+		blk->blk_queue = Q_HOT;
+}
+
+/**
+ * Finds blk_nr in shard s, or a buffer to hold it, and pins it for the 
+ * caller. The shard lock must be held and is held again on return, though it
+ * may be dropped meanwhile. *missed is set TRUE if the block was not in the
+ * cache, in which case the buffer is set up for blk_nr but its data is not 
+ * read.
+ */
+static struct minix_block *claim_block(struct cache_shard *s, int blk_nr,
+	int *missed)
+{
+	struct minix_block *blk;
+
+retry:
+	/* try to find the block requested in the cache */
+	if((blk = hash_find(s, blk_nr)) != NIL_BUF) {
+		if(blk->blk_state & BLK_READING) {
+			/* someone else is reading it in, wait for them */
+			pthread_cond_wait(&s->io_done, &s->lock);
+			goto retry;
+		}
+		/* cache hit */
+		pin_block(s, blk);	/* block is now in use */
+		s->hits++;
+		*missed = FALSE;
+		debug("claim_block(%d): cache hit", blk_nr);
+		return blk;
+	}
+
+	/* cache miss. we'll have to find a free space in our cache and read 
+	 * the block in to that space. pinned blocks are kept off the LRU 
+	 * chains so the victim is at the front of one of them, unless it is 
+	 * being written out by someone else in which case we step past it. */
+	debug("claim_block(%d): cache miss", blk_nr);
+	if(s->bufs_in_use == s->nr_bufs)
+		panic("get_block(...): cannot read in block from disk. all "
+			"buffers are in use");
+	if((blk = pick_victim(s)) == NIL_BUF) {
+		/* everything unpinned is busy with I/O. wait for some of it
+		 * to finish and look again. */
+		pthread_cond_wait(&s->io_done, &s->lock);
+		goto retry;
+	}
+
+	/* dirty blocks must be written to disk. the block stays hashed under
+	 * its old number while we do so, and since the lock is dropped
+	 * someone may have brought blk_nr in meanwhile so start over. having
+	 * to do this means the flusher is falling behind. */
+	if(blk->blk_dirty == TRUE) {
+		wake_flusher();
+		flush_block(s, blk);
+		goto retry;
+	}
+
+	s->misses++;
+	reuse_block(s, blk, blk_nr);
+	*missed = TRUE;
+	return blk;
+}
+
 /**
  * Returns a minix_block struct corresponding to block identified by blk_nr. 
  * The buffer cache is first searched. If the block is found in the cache its
@@ -261,129 +1353,136 @@ int sync_cache(void)
  * read a block from disk if the calling code knows in advance that it is
  * going to overwrite all data in the block. In this instance do_read is set to
  * FALSE and a free block is returned without any disk I/O being made.
+ *
+ * Only the shard holding blk_nr is locked and never across disk I/O. A block
+ * being read in stays in the hash table flagged BLK_READING so that anyone
+ * else asking for it waits for that read rather than issuing their own.
  */
 struct minix_block *get_block(int blk_nr, char do_read)
 {
+	struct cache_shard *s = SHARD_OF(blk_nr);
+	struct minix_block *blk;
+	int missed;
 
-	register struct minix_block *blk, *prev_ptr;
-
-	blk = cache_hash[blk_nr & (NR_BUF_HASH - 1)];
-	
-	/* try to find the block requested in the cache */
-	while(blk != NIL_BUF) {
-		if(blk->blk_nr == blk_nr) {
-			/* cache hit */
-			if(blk->blk_count == 0) bufs_in_use++;
-			blk->blk_count++; /* block is now in use */
-			debug("get_block(%d): cache hit", blk_nr);
-			return blk;
-		}
-		
-		/* not the block we want, get next one in the hash chain */
-		blk = blk->blk_hash;
-	}
-
-	/* cache miss. we'll have to find a free space in our cache and read 
-	 * the block in to that space. a free space is a space not in use 
-	 * (i.e blk_count == 0)*/
-	debug("get_block(%d): cache miss", blk_nr);
-	if(bufs_in_use == NR_BUFS)
-		panic("get_block(...): cannot read in block from disk. all "
-			"buffers are in use");
-	bufs_in_use++;
-	blk = front;
-	while(blk->blk_count > 0 && blk->blk_next != NIL_BUF) 
-		blk = blk->blk_next;
-	if(blk->blk_count > 0) {
-		/* we looked through entire chain and couldn't find a free
- 		 * space. */
-		panic("get_block(...): cannot read in block from disk. "
-			"searched all buffers and all are in use");
-	}
-
-	debug("get_block(%d): evicting block %d from cache...", blk_nr, 
-		blk->blk_nr);	
-	/* blk is now the block we will fill with data from disk.
- 	 * remove the block from its existing hash chain */
-	prev_ptr = cache_hash[blk->blk_nr & (NR_BUF_HASH - 1)];
-	if(prev_ptr == blk) {
-		/* the block was at the front of the hash chain */
-		cache_hash[blk->blk_nr & (NR_BUF_HASH - 1)] = blk->blk_hash;
-	}
-	else {
-		/* the block is not at the front of the chain so we're gonna
- 		 * have to search the hash chain to find its position. */
-		while(prev_ptr->blk_hash != NIL_BUF) {
-			if(prev_ptr->blk_hash == blk) {
-				/* found it */
-				prev_ptr->blk_hash = blk->blk_hash;
-				break;
-			}
-			
-			/* keep on looking */
-			prev_ptr = prev_ptr->blk_hash;
-		}
-	}
-	
-	/* dirty blocks must be written to disk */
-	if(blk->blk_dirty == TRUE) write_block(blk);
+	if(trace_fp != NULL)
+		fprintf(trace_fp, "g %d %d\n", blk_nr, do_read);
 
-	/* fill in block fields and add to the hash chain corresponding to the
-	 * new block number */
-	blk->blk_nr = blk_nr;
-	blk->blk_count++;
-	blk->blk_hash = cache_hash[blk_nr & (NR_BUF_HASH - 1)];
-	cache_hash[blk_nr & (NR_BUF_HASH - 1)] = blk;
+	pthread_mutex_lock(&s->lock);
+	blk = claim_block(s, blk_nr, &missed);
 
 	/* read the block in from disk if necessary. it won't always be
 	 * necessary if the routine calling get_block expects to re-write the 
 	 * entire block anyway. */
-	if(do_read == TRUE) read_block(blk);
+	if(missed && do_read == TRUE) {
+		blk->blk_state |= BLK_READING;
+		pthread_mutex_unlock(&s->lock);
+
+		start_io(&blk, 1, FALSE, FALSE, NULL);
+		io->kick();
+
+		pthread_mutex_lock(&s->lock);
+		while(blk->blk_state & BLK_READING)
+			pthread_cond_wait(&s->io_done, &s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
 
 	return blk;
 }
 
+/**
+ * Pins the count blocks from blk_nr, which are adjacent on disk, and puts
+ * them in blks[0] to blks[count - 1]. Each must be put with put_block() as 
+ * though it came from get_block().
+ *
+ * Blocks that are not cached are read, if do_read is TRUE, with a single
+ * read for each run of them rather than a read each. count may be no more
+ * than MAX_RUN.
+ *
+ * Reads are only started once every block is claimed. Blocks are claimed in
+ * ascending order so two callers can never wait on each other's reads.
+ */
+void get_blocks(int blk_nr, int count, char do_read, struct minix_block **blks)
+{
+	struct cache_shard *s;
+	struct minix_block *run[MAX_RUN];
+	int missed[MAX_RUN];
+	int i, j;
+
+	if(count > MAX_RUN)
+		panic("get_blocks(%d, %d): can't get more than %d blocks at "
+			"once", blk_nr, count, MAX_RUN);
+
+	for(i = 0; i < count; i++) {
+		if(trace_fp != NULL)
+			fprintf(trace_fp, "g %d %d\n", blk_nr + i, do_read);
+		s = SHARD_OF(blk_nr + i);
+		pthread_mutex_lock(&s->lock);
+		blks[i] = claim_block(s, blk_nr + i, &missed[i]);
+		missed[i] = missed[i] && do_read == TRUE;
+		if(missed[i])
+			blks[i]->blk_state |= BLK_READING;
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	/* read in each run of misses */
+	for(i = 0; i < count; i = j) {
+		for(j = i; j < count && missed[j]; j++)
+			run[j - i] = blks[j];
+		if(j > i)
+			start_io(run, j - i, FALSE, FALSE, NULL);
+		else
+			j++;
+	}
+	io->kick();
+
+	for(i = 0; i < count; i++) {
+		if(!missed[i])
+			continue;
+		s = SHARD_OF(blk_nr + i);
+		pthread_mutex_lock(&s->lock);
+		while(blks[i]->blk_state & BLK_READING)
+			pthread_cond_wait(&s->io_done, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
 void put_block(struct minix_block *blk, int block_type)
 {
-	register struct minix_block *next_ptr, *prev_ptr;
+	struct cache_shard *s;
+	struct buf_queue *q;
 
 	if(blk == NIL_BUF) { 
 		debug("put_block(?): attempting to put a NIL block");
 		return;
 	}
 
-	if(blk->blk_count == 0) {
+	if(trace_fp != NULL)
+		fprintf(trace_fp, "p %d %d\n", blk->blk_nr, block_type);
+
+	s = SHARD_OF(blk->blk_nr);
+	pthread_mutex_lock(&s->lock);
+
+	if(blk->blk_pins == 0) {
 		panic("put_block(%d): attempting to put block that is not in "
 			"use", blk->blk_nr);
 	}
 
-	blk->blk_count--;
-	if(blk->blk_count > 0) {
+	blk->blk_pins--;
+	if(blk->blk_pins > 0) {
 		/* block still in use */
 		debug("put_block(%d, %d): block still in use. not modifying "
 			"LRU chain", blk->blk_nr, block_type);
+		pthread_mutex_unlock(&s->lock);
 		return;
 	}
 	
-	bufs_in_use--;
-	next_ptr = blk->blk_next;
-	prev_ptr = blk->blk_prev;
-	
-	/* remove this block from current position in LRU chain */
-	if(prev_ptr == NIL_BUF) {
-		/* block is on front of LRU chain */
-		front = next_ptr;
-	}
-	else {
-		prev_ptr->blk_next = next_ptr;
-	}
-	if(next_ptr == NIL_BUF) {
-		/* block is on the back of LRU chain */
-		rear = prev_ptr;
-	}
-	else {
-		next_ptr->blk_prev = prev_ptr;
-	}
+	s->bufs_in_use--;
+
+	/* with 2Q metadata always lives on the hot chain, out of reach of
+	 * streaming data blocks. */
+	if(policy == CACHE_POLICY_2Q && IS_METADATA(block_type))
+		blk->blk_queue = Q_HOT;
+	q = &s->q[(int) blk->blk_queue];
 
 	/* now put the block back on the LRU chain. the position we place the
 	 * block at is determined by the block_type. some blocks when 'put' are
@@ -396,44 +1495,265 @@ void put_block(struct minix_block *blk, int block_type)
 		 * front of the LRU chain. */
 		debug("put_block(%d, %d): putting block on front of LRU chain",
 			blk->blk_nr, block_type);
-		blk->blk_prev = NIL_BUF;	/* nothing goes before front */
-		blk->blk_next = front;
-		if(front == NIL_BUF)
-			rear = blk;		/* LRU chain was empty */
-		else
-			front->blk_prev = blk;
-		front = blk;
+		lru_add_front(q, blk);
 	}
 	else {
 		/* block is more likely to be requested again soon so place it
 		 * at the back of the LRU chain. */
 		debug("put_block(%d, %d): putting block on rear of LRU chain",
 			blk->blk_nr, block_type);
-		blk->blk_prev = rear;
-		blk->blk_next = NIL_BUF;	/* nothing goes after rear */
-		if(rear == NIL_BUF)
-			front = blk;		/* LRU chain was empty */
-		else
-			rear->blk_next = blk;
-		rear = blk;
+		lru_add_rear(q, blk);
 	}
 
 	/* write the critical blocks to disk immedietely instead of waiting for
 	 * them to be written by a sync or when otherwise emptied from the 
-	 * buffer cache. */
-	if((block_type & WRITE_IMMED) && blk->blk_dirty == TRUE) {
-		debug("put_block(%d, %d): critical block is dirty, writing "
+	 * buffer cache. the same goes for any block once too much of the
+	 * cache is dirty, which holds back whoever is dirtying it until the
+	 * flusher catches up. */
+	if(((block_type & WRITE_IMMED) || COUNTER(nr_dirty) > dirty_max) && 
+		blk->blk_dirty == TRUE &&
+		(blk->blk_state & (BLK_LOCKED | BLK_WRITING)) == 0) {
+		debug("put_block(%d, %d): block is dirty, writing "
 			"immedietely...", blk->blk_nr, block_type);
-		write_block(blk);
+		flush_block(s, blk);
 	}
 
+	pthread_mutex_unlock(&s->lock);
 }
 
+/**
+ * Reads blocks blk_nr to blk_nr + n - 1 into the cache, so that get_block()
+ * finds them there, without pinning them. Blocks already cached are left
+ * alone and each run of blocks that are not is read with a single read. The
+ * reads are only started. Depending on the I/O backend they may complete
+ * after this returns.
+ *
+ * Readahead is only ever a hint. A block is skipped rather than wait for a
+ * buffer, write out a dirty one or pin more than half of a shard to make
+ * room for it.
+ *
+ * Returns the number of blocks read.
+ */
+int cache_readahead(int blk_nr, int n)
+{
+	struct minix_block *run[IO_RUN_MAX], *blk;
+	struct cache_shard *s;
+	int end = blk_nr + n, nr_run, nr_read = 0;
 
-	
+	while(blk_nr < end) {
+		/* claim buffers for the run of uncached blocks from blk_nr */
+		for(nr_run = 0; blk_nr < end && nr_run < IO_RUN_MAX; 
+			blk_nr++, nr_run++) {
+			s = SHARD_OF(blk_nr);
+			pthread_mutex_lock(&s->lock);
+			if(hash_find(s, blk_nr) == NIL_BUF && 
+				s->bufs_in_use < s->nr_bufs / 2 &&
+				(blk = pick_victim(s)) != NIL_BUF && 
+				blk->blk_dirty == FALSE) {
+				reuse_block(s, blk, blk_nr);
+				blk->blk_state |= BLK_READING;
+			}
+			else
+				blk = NIL_BUF;
+			pthread_mutex_unlock(&s->lock);
+			if(blk == NIL_BUF)
+				break;
+			run[nr_run] = blk;
+		}
+		if(nr_run == 0) {
+			blk_nr++;	/* cached already or no room for it */
+			continue;
+		}
 
-	
+		/* read the run in. it is released to the LRU chains once
+		 * read, and anyone asking for it meanwhile waits. */
+		start_io(run, nr_run, FALSE, TRUE, NULL);
+		nr_read += nr_run;
+	}
+	io->kick();
+
+	__sync_fetch_and_add(&cache_ra_count, nr_read);
+	return nr_read;
+}
+
+/**
+ * Makes sure the cache holds nothing for blk_nr that could be written over
+ * the data about to be written to it directly. Any read or write of the block
+ * in progress is waited for, as is a user that has it locked. An unpinned
+ * buffer is dropped from the cache and put on the front of its chain to be
+ * reused first, whether dirty or not. A pinned one cannot be dropped so it is
+ * given a copy of 'data' instead, and marked clean since the disk is about to
+ * agree with it. Nobody can lock it in between as the shard lock is held.
+ */
+static void invalidate_block(int blk_nr, const char *data)
+{
+	struct cache_shard *s = SHARD_OF(blk_nr);
+	struct minix_block *blk;
+
+	pthread_mutex_lock(&s->lock);
+	while((blk = hash_find(s, blk_nr)) != NIL_BUF && (blk->blk_state &
+		(BLK_READING | BLK_WRITING | BLK_LOCKED)))
+		pthread_cond_wait(&s->io_done, &s->lock);
+
+	if(blk != NIL_BUF) {
+		debug("invalidate_block(%d): dropping cached copy", blk_nr);
+		if(blk->blk_dirty == TRUE) {
+			blk->blk_dirty = FALSE;
+			__sync_fetch_and_sub(&nr_dirty, 1);
+		}
+		if(blk->blk_pins > 0)
+			memcpy(blk->blk_data, data, BLOCK_SIZE);
+		else {
+			hash_remove(s, blk);
+			lru_remove(&s->q[(int) blk->blk_queue], blk);
+			blk->blk_queue = Q_MAIN;
+			lru_add_front(&s->q[Q_MAIN], blk);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Writes the n blocks from blk_nr straight from 'data' to the device without
+ * copying them into the cache. Any copies of the blocks in the cache are
+ * invalidated first, so large writes neither pay for a copy nor push more
+ * useful blocks out. The caller must stop anyone else reading the blocks
+ * until this returns.
+ *
+ * O_DIRECT needs the memory written from to be aligned so data that is not
+ * goes through a bounce buffer.
+ *
+ * Failure to write all of the blocks will result in an error message and the
+ * program terminating.
+ */
+void cache_write_direct(int blk_nr, int n, const char *data)
+{
+	size_t len = (size_t) n * BLOCK_SIZE;
+	void *bounce = NULL;
+	ssize_t res;
+	int i;
+
+	for(i = 0; i < n; i++)
+		invalidate_block(blk_nr + i, data + i * BLOCK_SIZE);
+
+	if((unsigned long) data % BLOCK_SIZE != 0) {
+		if(posix_memalign(&bounce, BLOCK_SIZE, len) != 0)
+			panic("cache_write_direct(%d): unable to allocate "
+				"bounce buffer", blk_nr);
+		memcpy(bounce, data, len);
+		data = bounce;
+	}
+
+	info("\033[31mcache_write_direct(%d): writing %d blocks to disk offset "
+		"%ld...\033[0m", blk_nr, n, (long) blk_nr * BLOCK_SIZE);
+	res = pwrite(fd, data, len, (off_t) blk_nr * BLOCK_SIZE);
+	if(res != len) {
+		panic("cache_write_direct(%d): unable to write all %d blocks "
+			"(%ld)", blk_nr, n, (long) res);
+	}
+	free(bounce);
+
+	pthread_mutex_lock(&write_log_lock);
+	for(i = 0; i < n; i++)
+		short_array_add(blk_nr + i, write_log);	
+	pthread_mutex_unlock(&write_log_lock);
+	__sync_fetch_and_add(&cache_write_count, n);
+	__sync_fetch_and_add(&cache_write_calls, 1);
+	__sync_fetch_and_add(&cache_direct_count, n);
+}
 
+/**
+ * Gives the caller exclusive use of the data portion of a block it already
+ * has pinned with get_block(). Waits for any write of the block in progress
+ * to finish first.
+ */
+void lock_block(struct minix_block *blk)
+{
+	struct cache_shard *s = SHARD_OF(blk->blk_nr);
+
+	pthread_mutex_lock(&s->lock);
+	while(blk->blk_state & (BLK_LOCKED | BLK_WRITING))
+		pthread_cond_wait(&s->io_done, &s->lock);
+	blk->blk_state |= BLK_LOCKED;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void unlock_block(struct minix_block *blk)
+{
+	struct cache_shard *s = SHARD_OF(blk->blk_nr);
+
+	pthread_mutex_lock(&s->lock);
+	blk->blk_state &= ~BLK_LOCKED;
+	pthread_cond_broadcast(&s->io_done);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void sync_block(struct minix_block *blk)
+{
+	struct cache_shard *s = SHARD_OF(blk->blk_nr);
+
+	pthread_mutex_lock(&s->lock);
+	/* a write already under way may have started before the latest
+	 * change, in which case the block is dirty again once it finishes */
+	while(blk->blk_state & (BLK_LOCKED | BLK_WRITING))
+		pthread_cond_wait(&s->io_done, &s->lock);
+	if(blk->blk_dirty == TRUE)
+		flush_block(s, blk);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void mark_dirty(struct minix_block *blk)
+{
+	mark_dirty_since(blk, time(NULL));
+}
+
+void mark_dirty_since(struct minix_block *blk, time_t since)
+{
+	struct cache_shard *s = SHARD_OF(blk->blk_nr);
+	int n = 0;
+
+	pthread_mutex_lock(&s->lock);
+	if(blk->blk_dirty == FALSE) {
+		blk->blk_dirty = TRUE;
+		blk->blk_dirtied = since;
+		n = __sync_add_and_fetch(&nr_dirty, 1);
+	}
+	else if(since < blk->blk_dirtied)
+		blk->blk_dirtied = since;
+	pthread_mutex_unlock(&s->lock);
 
+	if(n == dirty_bg + 1)
+		wake_flusher();		/* just crossed the watermark */
+}
 
+void cache_set_flush_hook(void (*hook)(time_t before))
+{
+	pthread_mutex_lock(&hook_lock);
+	flush_hook = hook;
+	pthread_mutex_unlock(&hook_lock);
+}
 
+/**
+ * Fills in 'stats' with the cache totals accumulated since init_cache().
+ */
+void cache_get_stats(struct cache_stats *stats)
+{
+	int i;
+
+	stats->hits = 0;
+	stats->misses = 0;
+	for(i = 0; i < NR_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		stats->hits += shards[i].hits;
+		stats->misses += shards[i].misses;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	stats->reads = COUNTER(cache_read_count);
+	stats->read_calls = COUNTER(cache_read_calls);
+	stats->readahead = COUNTER(cache_ra_count);
+	stats->writes = COUNTER(cache_write_count);
+	stats->write_calls = COUNTER(cache_write_calls);
+	stats->flushed = COUNTER(cache_flush_count);
+	stats->direct = COUNTER(cache_direct_count);
+	stats->dirty = COUNTER(nr_dirty);
+}
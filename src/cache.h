@@ -1,6 +1,8 @@
 #ifndef _MINIX_CACHE
 #define _MINIX_CACHE
 
+#include <time.h>
+
 #define CACHE_WRITE_LOG_FILE "cache_write.log"
 
 /* Define if we do _not_ want to immedietely flush critical blocks such as
@@ -20,11 +22,15 @@
 struct minix_block {
 	/* header portion of block */
 	int blk_nr;				/* the block number */
-	struct minix_block *blk_next;		/* next block in chain */
-	struct minix_block *blk_prev;		/* prev block in chain */
+	struct minix_block *blk_next;		/* next block in LRU chain */
+	struct minix_block *blk_prev;		/* prev block in LRU chain */
 	struct minix_block *blk_hash;		/* next block in hash chain */
+	struct minix_block *blk_hash_prev;	/* prev block in hash chain */
 	char blk_dirty;				/* clean or dirty */
-	char blk_count;				/* # of users of this block */
+	char blk_state;				/* BLK_* I/O and lock state */
+	char blk_queue;				/* Q_* chain block belongs on */
+	int blk_pins;				/* # of users of this block */
+	time_t blk_dirtied;			/* when block last became dirty */
 
 	/* data portion of block */
 	char *blk_data;			/* should be aligned for O_DIRECT */
@@ -32,6 +38,54 @@ struct minix_block {
 
 #define NIL_BUF (struct minix_block *)0		/* no buffer entry */
 
+/* blk_state bits. a block with any of these set is never chosen for eviction.
+ * get_block() waits for BLK_READING to clear before handing a block out. */
+#define BLK_READING	01	/* data is being read in from disk */
+#define BLK_WRITING	02	/* data is being written out to disk */
+#define BLK_LOCKED	04	/* data locked by a user, see lock_block() */
+
+/* the chains unpinned buffers wait on to be evicted. the LRU policy only
+ * uses Q_MAIN. 2Q uses Q_MAIN as its A1in FIFO and Q_HOT as its Am chain. */
+#define Q_MAIN		0
+#define Q_HOT		1
+#define NR_QUEUES	2
+
+/* replacement policies, chosen at mount time with -cache_policy= */
+#define CACHE_POLICY_LRU 0	/* one LRU chain. ONE_SHOT blocks to front */
+#define CACHE_POLICY_2Q	 1	/* 2Q. scan resistant, protects metadata */
+#define NR_CACHE_POLICIES 2
+
+/**
+ * Settings for init_cache(). Any field may be left 0 or NULL for the default.
+ */
+struct cache_opts {
+	int cache_mb;		/* size of the cache in MB, 0 for NR_BUFS */
+	char *policy;		/* "lru" (default) or "2q" */
+	char *trace_file;	/* record every get_block/put_block here */
+	int dirty_bg;		/* DIRTY_BG_RATIO */
+	int dirty_max;		/* DIRTY_MAX_RATIO */
+	int dirty_expire;	/* DIRTY_EXPIRE */
+	int flush_interval;	/* FLUSH_INTERVAL. < 0 for no flusher */
+	char *io;		/* "sync" (default) or "uring" */
+};
+
+/**
+ * Running totals kept by the buffer cache. hits + misses is the number of
+ * get_block() calls made.
+ */
+struct cache_stats {
+	unsigned long hits;		/* requests satisfied from the cache */
+	unsigned long misses;		/* requests that needed a new buffer */
+	unsigned long reads;		/* blocks read from the device */
+	unsigned long read_calls;	/* reads they took */
+	unsigned long readahead;	/* of the blocks, read ahead */
+	unsigned long writes;		/* blocks written to the device */
+	unsigned long write_calls;	/* writes they took, see sync_cache() */
+	unsigned long flushed;		/* of which by the flusher thread */
+	unsigned long direct;		/* of which by cache_write_direct() */
+	unsigned long dirty;		/* blocks dirty right now */
+};
+
 #define WRITE_IMMED 	0100	/* write block straight away */
 #define ONE_SHOT 	0200	/* block unlikely to be needed soon */
 
@@ -65,15 +119,95 @@ void open_blk_device(const char *d);
 
 /**
  * Initiate the buffer cache by preallocating the necessary buffers and linking
- * them together.
+ * them together. opts may be NULL for the defaults.
+ *
+ * If opts->trace_file is given every get_block is recorded in it as a line
+ * "g blk_nr do_read" and every put_block as "p blk_nr block_type", ready to
+ * be replayed by test_cache_trace.
  */
-void init_cache(void);
+void init_cache(const struct cache_opts *opts);
+const char *cache_policy_name(void);
+const char *cache_io_name(void);
+int cache_nr_bufs(void);
+int cache_nr_hash(void);
 
 
+/**
+ * get_block() and put_block() may be called from any number of threads. The
+ * cache is split into NR_CACHE_SHARDS shards, each with its own lock, so
+ * requests for blocks in different shards never wait on one another.
+ */
 struct minix_block *get_block(int blk_nr, char do_read);
 void put_block(struct minix_block *blk, int block_type);
 
-/* disk I/O */
+/**
+ * As get_block() for the count <= MAX_RUN blocks from blk_nr, which are put
+ * in blks. Blocks not in the cache are read with one read per run of them.
+ */
+#define MAX_RUN 32
+void get_blocks(int blk_nr, int count, char do_read, struct minix_block **blks);
+
+/**
+ * Brings the n blocks from blk_nr into the cache ahead of their being asked
+ * for, reading each run of them that is not cached with a single read. Best
+ * effort only. Returns the number of blocks read.
+ */
+int cache_readahead(int blk_nr, int n);
+
+/**
+ * Writes the n blocks from blk_nr to the device straight from data, which
+ * holds n * BLOCK_SIZE bytes, instead of through cache buffers. Cached copies
+ * of the blocks are invalidated. Meant for large writes of whole blocks.
+ */
+void cache_write_direct(int blk_nr, int n, const char *data);
+
+/**
+ * Gives the caller exclusive use of the data portion of a block it already
+ * has pinned with get_block(). Writes of the block to disk wait until it is
+ * unlocked so they never see a half modified block. Every change to a cached
+ * block's data is made with it locked, and marked dirty before it is
+ * unlocked. A block must not be locked twice, or passed to sync_block()
+ * while the caller has it locked.
+ */
+void lock_block(struct minix_block *blk);
+void unlock_block(struct minix_block *blk);
+
+/**
+ * Writes a block the caller has pinned to disk now if it is dirty, and waits
+ * for the write. For blocks that must reach disk before some other block
+ * does, whatever the flusher's order.
+ */
+void sync_block(struct minix_block *blk);
+
+/**
+ * Marks a block the caller has pinned as modified. Every change to a block's
+ * data must be followed by a call to this so that the flusher thread knows
+ * how much there is to write back and how long it has been waiting.
+ */
+void mark_dirty(struct minix_block *blk);
+
+/**
+ * mark_dirty() for data that was changed at 'since' but only put in the
+ * block now, so that the flusher writes it when it would have had it been
+ * in the cache all along.
+ */
+void mark_dirty_since(struct minix_block *blk, time_t since);
+
+/**
+ * Sets a function the flusher calls at the start of each pass, with the time
+ * before which dirty data has expired, to put data held outside the cache
+ * into it so that it is written back in the same pass (see delalloc.h). NULL
+ * for none. Setting it waits for any call in progress to return.
+ */
+void cache_set_flush_hook(void (*hook)(time_t before));
+
+void cache_get_stats(struct cache_stats *stats);
+
+/**
+ * Writes every dirty block to disk. Blocks are written in block number order
+ * with each run of adjacent blocks written together. Returns the number of
+ * blocks written.
+ */
 int sync_cache(void);
 
 void print_cache(void);
@@ -14,6 +14,7 @@
 #define NO_BLOCK 0			/* indicates an empty block */
 #define NO_INODE 0			/* indicates no inode entry */
 #define DENTRY_SIZE 32                  /* bytes per directory entry */
+#define DENTRIES_PER_BLOCK (BLOCK_SIZE/DENTRY_SIZE)
 
 #define NR_ZONE_NUMS 9                  /* zone entries per inode */
 #define NR_DZONE_NUM 7                  /* direct zones per inode */
@@ -33,6 +34,7 @@
 
 /* handy macros */
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
 
 /* test not sure if i need these?? */
@@ -40,9 +42,29 @@
 #define HAVE_GETXATTR 1
 
 /* buffer cache */
-#define NR_BUFS	1024*1	/* blocks in buffer cache - 10 Meg */
-#define NR_BUF_HASH 16384	/* size of buffer hash table. power of 2 */
-				/* gives us 6.25 entries per bucket */
+#define NR_BUFS	1024		/* default blocks in buffer cache - 1 Meg.
+				 * set at mount time with -cache_mb= */
+#define NR_CACHE_SHARDS 16	/* independently locked parts of the buffer
+				 * cache. power of 2 */
+
+/* background writeback. each can be changed at mount time, see README */
+#define DIRTY_BG_RATIO 10	/* % of buffers dirty before the flusher
+				 * starts writing them out */
+#define DIRTY_MAX_RATIO 40	/* % of buffers dirty before anyone putting a
+				 * dirty block must write it themselves */
+#define DIRTY_EXPIRE 30		/* secs a block may stay dirty */
+#define FLUSH_INTERVAL 5	/* secs between flusher passes */
+
+#define INODE_CLUSTER 4		/* inode table blocks read together. see
+				 * rw_inode() */
+#define READDIR_BATCH 8		/* directory blocks whose entries' inodes are
+				 * read together. see read_dir() */
+
+/* sequential readahead, see minix_read() */
+#define RA_MIN 4		/* blocks read ahead once a read is found to be
+				 * sequential. doubled each time it is used up */
+#define RA_MAX 128		/* default most blocks read ahead at a time. set
+				 * at mount time with -readahead= */
 #define BLOCK_ALIGN 1024	/* the alignment of the address for the data 
 				 * portion of a minix_block */
 
@@ -51,9 +73,22 @@
 #define FILENAME_SIZE 30	/* max length of file name */
 
 #define ROOT_INODE (inode_nr) 1 /* number of root inode */
-#define NR_INODES 32		/* size of inode table */
+#define NR_INODES 32		/* initial # of inode cache hash chains. the
+				 * table doubles as the cache grows */
+#define INODE_CACHE_IDLE 1024	/* unreferenced inodes kept in memory */
+#define DCACHE_ENTRIES 4096	/* names remembered by the dentry cache. also
+				 * its # of hash chains so a power of 2 */
+#define DIR_INDEX_MIN 64	/* entries a directory has before it is given
+				 * a hashed index. set with -dir_index= */
+#define RESV_ZONES 64		/* zones set aside for a file being written.
+				 * set with -resv_zones= */
+#define RESV_LOW 32		/* none are set aside when less than 
+				 * 1/RESV_LOW of the zones are free */
+#define PCACHE_ENTRIES 1024	/* whole paths remembered. a power of 2 */
+#define PCACHE_PATH_LEN 256	/* longest path remembered, with the \0 */
 
 #define READ 1			
 #define WRITE 2
+#define WRITE_SYNC 3		/* WRITE, and wait for it to reach disk */
 
 #endif
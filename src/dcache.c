@@ -0,0 +1,249 @@
+/**
+ * Implements the dentry cache, a fixed pool of DCACHE_ENTRIES (directory,
+ * name) -> inode number entries. Every entry is on the LRU chain and those
+ * in use are also on a hash chain. A new entry takes the least recently used
+ * one's place.
+ *
+ * The path cache beside it is direct mapped. A path can only be in the slot
+ * its hash picks, and a new path simply replaces whatever was there.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "const.h"
+#include "types.h"
+#include "comms.h"
+#include "dcache.h"
+
+#define NO_DENTRY (struct dentry *)0
+
+struct dentry {
+	inode_nr d_dir;			/* directory the name is in */
+	inode_nr d_ino;			/* what the name is. NO_INODE if it
+					 * isn't there */
+	char d_name[FILENAME_SIZE];
+	char d_used;			/* on a hash chain */
+	struct dentry *d_hash;		/* next entry in hash chain */
+	struct dentry *d_next;		/* next in LRU chain */
+	struct dentry *d_prev;		/* prev in LRU chain */
+};
+
+struct path_entry {
+	unsigned p_gen;			/* generation when entered */
+	inode_nr p_ino;			/* what the path resolved to */
+	char p_path[PCACHE_PATH_LEN];
+};
+
+static struct dentry pool[DCACHE_ENTRIES];
+static struct dentry *hash[DCACHE_ENTRIES];
+static struct dentry *front;		/* LRU. reused first */
+static struct dentry *rear;		/* MRU */
+static struct dcache_stats stats;
+
+static struct path_entry paths[PCACHE_ENTRIES];
+static unsigned generation = 1;		/* slots with any other are stale */
+
+/* lookups come from shared-locked operations such as getattr */
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * FNV-1a of the string, starting from 'seed'.
+ */
+static unsigned fnv(unsigned seed, const char *str)
+{
+	unsigned h = 2166136261u ^ seed;
+
+	while(*str != '\0') {
+		h ^= (unsigned char) *str++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static unsigned dhash(inode_nr dir, const char *name)
+{
+	return fnv(dir, name) & (DCACHE_ENTRIES - 1);
+}
+
+static void lru_remove(struct dentry *d)
+{
+	if(d->d_prev != NO_DENTRY)
+		d->d_prev->d_next = d->d_next;
+	else
+		front = d->d_next;
+	if(d->d_next != NO_DENTRY)
+		d->d_next->d_prev = d->d_prev;
+	else
+		rear = d->d_prev;
+}
+
+static void lru_add_rear(struct dentry *d)
+{
+	d->d_next = NO_DENTRY;
+	d->d_prev = rear;
+	if(rear != NO_DENTRY)
+		rear->d_next = d;
+	else
+		front = d;
+	rear = d;
+}
+
+static void lru_add_front(struct dentry *d)
+{
+	d->d_prev = NO_DENTRY;
+	d->d_next = front;
+	if(front != NO_DENTRY)
+		front->d_prev = d;
+	else
+		rear = d;
+	front = d;
+}
+
+static struct dentry *find(inode_nr dir, const char *name, unsigned h)
+{
+	struct dentry *d;
+
+	for(d = hash[h]; d != NO_DENTRY; d = d->d_hash)
+		if(d->d_dir == dir && strcmp(d->d_name, name) == 0)
+			return d;
+	return NO_DENTRY;
+}
+
+static void unhash(struct dentry *d)
+{
+	struct dentry **pp = &hash[dhash(d->d_dir, d->d_name)];
+
+	while(*pp != d)
+		pp = &(*pp)->d_hash;
+	*pp = d->d_hash;
+	d->d_used = FALSE;
+}
+
+void dcache_init(void)
+{
+	int i;
+
+	pthread_mutex_lock(&dcache_lock);
+	front = rear = NO_DENTRY;
+	for(i = 0; i < DCACHE_ENTRIES; i++) {
+		hash[i] = NO_DENTRY;
+		pool[i].d_used = FALSE;
+		lru_add_rear(&pool[i]);
+	}
+	memset(&stats, 0, sizeof(stats));
+	generation++;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcache_lookup(inode_nr dir, const char *name, inode_nr *i_num)
+{
+	struct dentry *d;
+
+	pthread_mutex_lock(&dcache_lock);
+	if((d = find(dir, name, dhash(dir, name))) == NO_DENTRY) {
+		stats.misses++;
+		pthread_mutex_unlock(&dcache_lock);
+		return FALSE;
+	}
+
+	*i_num = d->d_ino;
+	stats.hits++;
+	if(d->d_ino == NO_INODE)
+		stats.neg_hits++;
+	lru_remove(d);
+	lru_add_rear(d);
+	pthread_mutex_unlock(&dcache_lock);
+	debug("dcache_lookup(%d, \"%s\"): cached as %d", dir, name, *i_num);
+	return TRUE;
+}
+
+void dcache_enter(inode_nr dir, const char *name, inode_nr i_num)
+{
+	struct dentry *d;
+	unsigned h;
+
+	/* a name that fills its directory entry has no terminator on disk
+	 * so is never cached. the directory is always scanned for it. */
+	if(strlen(name) >= FILENAME_SIZE)
+		return;
+
+	h = dhash(dir, name);
+	pthread_mutex_lock(&dcache_lock);
+	if((d = find(dir, name, h)) == NO_DENTRY) {
+		/* take over the least recently used entry */
+		d = front;
+		if(d->d_used)
+			unhash(d);
+		d->d_dir = dir;
+		strcpy(d->d_name, name);
+		d->d_hash = hash[h];
+		hash[h] = d;
+		d->d_used = TRUE;
+	}
+	d->d_ino = i_num;
+	lru_remove(d);
+	lru_add_rear(d);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(inode_nr dir, const char *name)
+{
+	dcache_enter(dir, name, NO_INODE);
+	pthread_mutex_lock(&dcache_lock);
+	generation++;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_purge(inode_nr dir)
+{
+	int i;
+
+	debug("dcache_purge(%d): forgetting directory's entries", dir);
+	pthread_mutex_lock(&dcache_lock);
+	generation++;
+	for(i = 0; i < DCACHE_ENTRIES; i++) {
+		if(pool[i].d_used && pool[i].d_dir == dir) {
+			unhash(&pool[i]);
+			lru_remove(&pool[i]);
+			lru_add_front(&pool[i]);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcache_path_lookup(const char *path, inode_nr *i_num)
+{
+	struct path_entry *p = &paths[fnv(0, path) & (PCACHE_ENTRIES - 1)];
+	int found;
+
+	pthread_mutex_lock(&dcache_lock);
+	found = p->p_gen == generation && strcmp(p->p_path, path) == 0;
+	if(found) {
+		*i_num = p->p_ino;
+		stats.path_hits++;
+	}
+	else
+		stats.path_misses++;
+	pthread_mutex_unlock(&dcache_lock);
+	return found;
+}
+
+void dcache_path_enter(const char *path, inode_nr i_num)
+{
+	struct path_entry *p = &paths[fnv(0, path) & (PCACHE_ENTRIES - 1)];
+
+	if(strlen(path) >= PCACHE_PATH_LEN)
+		return;
+
+	pthread_mutex_lock(&dcache_lock);
+	strcpy(p->p_path, path);
+	p->p_ino = i_num;
+	p->p_gen = generation;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *s)
+{
+	pthread_mutex_lock(&dcache_lock);
+	*s = stats;
+	pthread_mutex_unlock(&dcache_lock);
+}
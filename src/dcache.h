@@ -0,0 +1,64 @@
+#ifndef _MINIX_DCACHE
+#define _MINIX_DCACHE
+
+#include "types.h"
+
+/**
+ * The dentry cache. Remembers what recent directory lookups found, keyed by
+ * the directory's inode number and the name looked up, so that looking the
+ * same name up again needs no directory blocks. Names that were not found
+ * are remembered too, as negative entries with inode number NO_INODE.
+ *
+ * The cache only ever holds what is on disk. Anything that changes a
+ * directory must tell the cache with dcache_enter(), and a directory's
+ * entries must be purged with dcache_purge() when its inode is freed, since
+ * the inode number may be reused.
+ */
+struct dcache_stats {
+	unsigned long hits;		/* lookups answered by the cache */
+	unsigned long neg_hits;		/* of those, that found no entry */
+	unsigned long misses;		/* lookups that scanned the directory */
+	unsigned long path_hits;	/* whole paths found in the path cache */
+	unsigned long path_misses;	/* whole paths that had to be walked */
+};
+
+/**
+ * Empties the cache. Called at mount time.
+ */
+void dcache_init(void);
+
+/**
+ * Looks 'name' up in directory 'dir'. Returns TRUE and sets *i_num if the
+ * cache knows the answer, which may be NO_INODE. Returns FALSE otherwise.
+ */
+int dcache_lookup(inode_nr dir, const char *name, inode_nr *i_num);
+
+/**
+ * Records that 'name' in directory 'dir' is inode i_num, or that there is no
+ * such entry if i_num is NO_INODE. Replaces anything cached for the name.
+ */
+void dcache_enter(inode_nr dir, const char *name, inode_nr i_num);
+
+/**
+ * Records that 'name' has been removed from directory 'dir'. Unlike
+ * dcache_enter(dir, name, NO_INODE) this also invalidates the path cache.
+ */
+void dcache_remove(inode_nr dir, const char *name);
+
+/**
+ * Forgets every entry of directory 'dir'.
+ */
+void dcache_purge(inode_nr dir);
+
+/**
+ * The path cache remembers the inode whole paths from the root resolved to.
+ * Only names being removed can make a path resolve differently, or not at
+ * all, so rather than find the paths affected every entry is stamped with a
+ * generation that dcache_remove() and dcache_purge() move on, which makes 
+ * every path cached before stale. Paths that don't resolve are not cached.
+ */
+int dcache_path_lookup(const char *path, inode_nr *i_num);
+void dcache_path_enter(const char *path, inode_nr i_num);
+
+void dcache_get_stats(struct dcache_stats *stats);
+#endif
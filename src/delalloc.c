@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "const.h"
+#include "comms.h"
+#include "inode.h"
+#include "delalloc.h"
+
+static int enabled = FALSE;
+
+/* files with blocks pending, oldest first */
+static struct delalloc *front, *rear;
+static int nr_pending;		/* blocks pending in all of them */
+
+void delalloc_set(int on)
+{
+	enabled = on;
+}
+
+int delalloc_on(void)
+{
+	return enabled;
+}
+
+/**
+ * Returns the slot of file block 'blk' in the sorted pending blocks, or the
+ * slot it would go in if it isn't pending.
+ */
+static int find_slot(struct delalloc *d, int blk)
+{
+	int lo = 0, hi = d->nr_blks, mid;
+
+	/* writes mostly append, so try the end first */
+	if(hi > 0 && d->blks[hi - 1].d_blk < blk)
+		return hi;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(d->blks[mid].d_blk < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+char *delalloc_find(struct minix_inode *inode, int blk)
+{
+	struct delalloc *d = inode->i_delalloc;
+	int slot;
+
+	if(d == NULL)
+		return NULL;
+	slot = find_slot(d, blk);
+	if(slot < d->nr_blks && d->blks[slot].d_blk == blk)
+		return d->blks[slot].d_data;
+	return NULL;
+}
+
+char *delalloc_add(struct minix_inode *inode, int blk)
+{
+	struct delalloc *d = inode->i_delalloc;
+	char *data;
+	int slot;
+
+	if(d == NULL) {
+		if((d = calloc(1, sizeof(struct delalloc))) == NULL)
+			panic("delalloc_add(%d, %d): out of memory",
+				inode->i_num, blk);
+		d->inode = inode;
+		d->since = time(NULL);
+		inode->i_delalloc = d;
+		get_inode(inode->i_num);	/* see delalloc.h */
+
+		d->prev = rear;
+		if(rear != NULL)
+			rear->next = d;
+		else
+			front = d;
+		rear = d;
+	}
+
+	if(d->nr_blks == d->cap) {
+		d->cap = d->cap == 0 ? 16 : d->cap * 2;
+		d->blks = realloc(d->blks, d->cap *
+			sizeof(struct delalloc_blk));
+		if(d->blks == NULL)
+			panic("delalloc_add(%d, %d): out of memory",
+				inode->i_num, blk);
+	}
+	if((data = calloc(1, BLOCK_SIZE)) == NULL)
+		panic("delalloc_add(%d, %d): out of memory", inode->i_num, blk);
+
+	slot = find_slot(d, blk);
+	memmove(&d->blks[slot + 1], &d->blks[slot], (d->nr_blks - slot) *
+		sizeof(struct delalloc_blk));
+	d->blks[slot].d_blk = blk;
+	d->blks[slot].d_data = data;
+	d->nr_blks++;
+	nr_pending++;
+	return data;
+}
+
+int delalloc_pending(struct minix_inode *inode)
+{
+	return inode->i_delalloc != NULL ? inode->i_delalloc->nr_blks : 0;
+}
+
+int delalloc_pending_all(void)
+{
+	return nr_pending;
+}
+
+void delalloc_free(struct minix_inode *inode)
+{
+	struct delalloc *d = inode->i_delalloc;
+	int i;
+
+	if(d == NULL)
+		return;
+
+	for(i = 0; i < d->nr_blks; i++)
+		free(d->blks[i].d_data);
+	nr_pending -= d->nr_blks;
+	free(d->blks);
+
+	if(d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		front = d->next;
+	if(d->next != NULL)
+		d->next->prev = d->prev;
+	else
+		rear = d->prev;
+	free(d);
+
+	inode->i_delalloc = NULL;
+	put_inode(inode);
+}
+
+void delalloc_trim(struct minix_inode *inode, int blk)
+{
+	struct delalloc *d = inode->i_delalloc;
+	int slot, i;
+
+	if(d == NULL)
+		return;
+
+	slot = find_slot(d, blk);
+	if(slot == 0) {
+		delalloc_free(inode);
+		return;
+	}
+	for(i = slot; i < d->nr_blks; i++)
+		free(d->blks[i].d_data);
+	nr_pending -= d->nr_blks - slot;
+	d->nr_blks = slot;
+}
+
+struct minix_inode *delalloc_oldest(void)
+{
+	return front != NULL ? front->inode : NULL;
+}
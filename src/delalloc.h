@@ -0,0 +1,80 @@
+#ifndef _MINIX_DELALLOC
+#define _MINIX_DELALLOC
+
+#include <time.h>
+#include "inode.h"
+
+#define DELALLOC_FILE_MAX 256	/* blocks held back for one file */
+#define DELALLOC_MAX 4096	/* blocks held back for all files */
+
+/**
+ * Delayed allocation. With it on, write_buf() gives no zone to a block of a
+ * file that has none yet. The data is kept in memory against the inode
+ * instead, and zones are only allocated when the file's pending blocks are
+ * flushed (see flush_delalloc()), all together, so that they can be given
+ * one run of zones on disk however their writes were interleaved with other
+ * files'.
+ *
+ * An inode with blocks pending holds a reference to itself so that it stays
+ * cached. Pending blocks are only added or flushed under the exclusive
+ * filesystem lock and may be read under the shared one. Like dirty blocks,
+ * they are written back once they have been pending for dirty_expire seconds
+ * if the front end sets flush_delalloc_expired() as the flush hook.
+ */
+struct delalloc_blk {
+	int d_blk;			/* file relative block */
+	char *d_data;			/* BLOCK_SIZE bytes */
+};
+
+struct delalloc {
+	struct minix_inode *inode;
+	struct delalloc_blk *blks;	/* sorted by d_blk */
+	int nr_blks;
+	int cap;
+	time_t since;			/* when the first was held back */
+	struct delalloc *next, *prev;	/* files with blocks pending */
+};
+
+/**
+ * Turns delayed allocation on or off. Off by default. Files already with
+ * blocks pending keep them until they are flushed.
+ */
+void delalloc_set(int on);
+int delalloc_on(void);
+
+/**
+ * Returns the pending data of file block 'blk', or NULL if it isn't.
+ */
+char *delalloc_find(struct minix_inode *inode, int blk);
+
+/**
+ * Makes file block 'blk' pending and returns its data, zeroed.
+ */
+char *delalloc_add(struct minix_inode *inode, int blk);
+
+/**
+ * Returns the number of blocks the inode has pending, or all files together
+ * for delalloc_pending_all().
+ */
+int delalloc_pending(struct minix_inode *inode);
+int delalloc_pending_all(void);
+
+/**
+ * Frees the inode's pending blocks, once written or when they are no longer
+ * wanted, and releases the reference they held.
+ */
+void delalloc_free(struct minix_inode *inode);
+
+/**
+ * Frees the inode's pending blocks from file block 'blk' on, for a file cut
+ * short. Any it has before 'blk' stay pending.
+ */
+void delalloc_trim(struct minix_inode *inode, int blk);
+
+/**
+ * Returns the file that has had blocks pending the longest, or NULL if none
+ * have. Files are in the order they were first given blocks to hold back.
+ */
+struct minix_inode *delalloc_oldest(void);
+
+#endif
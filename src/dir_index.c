@@ -0,0 +1,272 @@
+/**
+ * Implements the hashed directory index, see dir_index.h.
+ *
+ * Slots are chained by the hash of their names. A chain only ever leads to
+ * slots whose names might match so a lookup reads the one directory block
+ * holding the slot it settles on, to check the name, and no others.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "const.h"
+#include "types.h"
+#include "comms.h"
+#include "cache.h"
+#include "inode.h"
+#include "read.h"
+#include "dir_index.h"
+
+#define NO_SLOT -1
+
+static int index_min = DIR_INDEX_MIN;
+
+/* only held to build an index. once built an index is changed only under the
+ * exclusive filesystem lock. */
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dir_index_set_min(int entries)
+{
+	index_min = entries == 0 ? DIR_INDEX_MIN : entries;
+}
+
+/**
+ * FNV-1a of the name as stored in a dentry, which is only terminated if it
+ * is shorter than FILENAME_SIZE.
+ */
+static unsigned name_hash(const char *name)
+{
+	unsigned h = 2166136261u;
+	int i;
+
+	for(i = 0; i < FILENAME_SIZE && name[i] != '\0'; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void *grow(void *p, int n, size_t size)
+{
+	if((p = realloc(p, n * size)) == NULL)
+		panic("dir_index: unable to allocate %d entries", n);
+	return p;
+}
+
+/**
+ * Makes room for slots up to 'slot' in next and hash.
+ */
+static void reserve(struct dir_index *ix, int slot)
+{
+	if(slot < ix->cap)
+		return;
+	while(ix->cap <= slot)
+		ix->cap *= 2;
+	ix->next = grow(ix->next, ix->cap, sizeof(int));
+	ix->hash = grow(ix->hash, ix->cap, sizeof(unsigned));
+}
+
+/**
+ * Adds a slot to the free slots, a binary min-heap so that new entries 
+ * always go in the lowest free slot as they do in a directory scanned for
+ * one.
+ */
+static void push_free(struct dir_index *ix, int slot)
+{
+	int i, parent;
+
+	if(ix->nr_free == ix->free_cap) {
+		ix->free_cap *= 2;
+		ix->free = grow(ix->free, ix->free_cap, sizeof(int));
+	}
+	for(i = ix->nr_free++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if(ix->free[parent] <= slot)
+			break;
+		ix->free[i] = ix->free[parent];
+	}
+	ix->free[i] = slot;
+}
+
+static int pop_free(struct dir_index *ix)
+{
+	int lowest = ix->free[0], last = ix->free[--ix->nr_free];
+	int i = 0, child;
+
+	while((child = 2 * i + 1) < ix->nr_free) {
+		if(child + 1 < ix->nr_free && 
+			ix->free[child + 1] < ix->free[child])
+			child++;
+		if(last <= ix->free[child])
+			break;
+		ix->free[i] = ix->free[child];
+		i = child;
+	}
+	ix->free[i] = last;
+	return lowest;
+}
+
+static void chain_insert(struct dir_index *ix, int slot)
+{
+	int *head = &ix->chain[ix->hash[slot] & (ix->nr_hash - 1)];
+
+	ix->next[slot] = *head;
+	*head = slot;
+}
+
+/**
+ * Doubles the number of chains once there are more entries than chains.
+ */
+static void rehash(struct dir_index *ix)
+{
+	int *old = ix->chain, old_nr = ix->nr_hash, b, slot, next;
+
+	ix->nr_hash *= 2;
+	ix->chain = grow(NULL, ix->nr_hash, sizeof(int));
+	for(b = 0; b < ix->nr_hash; b++)
+		ix->chain[b] = NO_SLOT;
+	for(b = 0; b < old_nr; b++) {
+		for(slot = old[b]; slot != NO_SLOT; slot = next) {
+			next = ix->next[slot];
+			chain_insert(ix, slot);
+		}
+	}
+	free(old);
+}
+
+void dir_index_add(struct dir_index *ix, const char *name, int slot)
+{
+	reserve(ix, slot);
+	ix->hash[slot] = name_hash(name);
+	chain_insert(ix, slot);
+	if(++ix->nr_entries > ix->nr_hash)
+		rehash(ix);
+}
+
+void dir_index_remove(struct dir_index *ix, const char *name, int slot)
+{
+	int *pp = &ix->chain[name_hash(name) & (ix->nr_hash - 1)];
+
+	while(*pp != slot) {
+		if(*pp == NO_SLOT)
+			panic("dir_index_remove(\"%s\", %d): slot not indexed",
+				name, slot);
+		pp = &ix->next[*pp];
+	}
+	*pp = ix->next[slot];
+	ix->nr_entries--;
+	push_free(ix, slot);
+}
+
+void dir_index_extend(struct dir_index *ix, int first, int n)
+{
+	int slot;
+
+	for(slot = first; slot < first + n; slot++)
+		push_free(ix, slot);
+}
+
+int dir_index_take_slot(struct dir_index *ix)
+{
+	return ix->nr_free > 0 ? pop_free(ix) : NO_SLOT;
+}
+
+/**
+ * Reads the whole of directory 'dir' to build its index.
+ */
+static struct dir_index *build(struct minix_inode *dir)
+{
+	struct dir_index *ix;
+	struct minix_block *blk;
+	zone_nr z;
+	int pos, i, slot;
+
+	debug("dir_index build(%d): indexing %d entries...", dir->i_num,
+		dir->i_size / DENTRY_SIZE);
+	if((ix = calloc(1, sizeof(struct dir_index))) == NULL)
+		panic("dir_index build(%d): unable to allocate index", 
+			dir->i_num);
+	ix->nr_hash = NR_INODES;
+	ix->chain = grow(NULL, ix->nr_hash, sizeof(int));
+	for(i = 0; i < ix->nr_hash; i++)
+		ix->chain[i] = NO_SLOT;
+	ix->cap = DENTRIES_PER_BLOCK;
+	ix->next = grow(NULL, ix->cap, sizeof(int));
+	ix->hash = grow(NULL, ix->cap, sizeof(unsigned));
+	ix->free_cap = DENTRIES_PER_BLOCK;
+	ix->free = grow(NULL, ix->free_cap, sizeof(int));
+
+	for(pos = 0; (z = read_map(dir, pos)) != NO_ZONE; pos += BLOCK_SIZE) {
+		blk = get_block(z, TRUE);
+		for(i = 0; i < BLOCK_SIZE; i += DENTRY_SIZE) {
+			slot = (pos + i) / DENTRY_SIZE;
+			if(*((inode_nr *)(blk->blk_data + i)) != NO_INODE)
+				dir_index_add(ix, blk->blk_data + i + 2, slot);
+			else
+				push_free(ix, slot);
+		}
+		put_block(blk, DIR_BLOCK);
+	}
+	return ix;
+}
+
+struct dir_index *dir_index_get(struct minix_inode *dir)
+{
+	struct dir_index *ix;
+
+	if((ix = __atomic_load_n(&dir->i_index, __ATOMIC_ACQUIRE)) != NULL)
+		return ix;
+	if(index_min < 0 || dir->i_size / DENTRY_SIZE < index_min)
+		return NULL;
+
+	/* lookups hold the filesystem lock shared so two of them may want
+	 * to build the same index */
+	pthread_mutex_lock(&build_lock);
+	if((ix = dir->i_index) == NULL) {
+		ix = build(dir);
+		__atomic_store_n(&dir->i_index, ix, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&build_lock);
+	return ix;
+}
+
+int dir_index_find(struct minix_inode *dir, struct dir_index *ix, 
+	const char *name, inode_nr *i_num)
+{
+	struct minix_block *blk;
+	unsigned h = name_hash(name);
+	char *dentry;
+	int slot, pos;
+
+	if(strlen(name) > FILENAME_SIZE)
+		return NO_SLOT;
+
+	for(slot = ix->chain[h & (ix->nr_hash - 1)]; slot != NO_SLOT; 
+		slot = ix->next[slot]) {
+		if(ix->hash[slot] != h)
+			continue;
+		pos = slot * DENTRY_SIZE;
+		blk = get_block(read_map(dir, pos), TRUE);
+		dentry = blk->blk_data + pos % BLOCK_SIZE;
+		if(strncmp(dentry + 2, name, FILENAME_SIZE) == 0) {
+			*i_num = *((inode_nr *) dentry);
+			put_block(blk, DIR_BLOCK);
+			return slot;
+		}
+		put_block(blk, DIR_BLOCK);
+	}
+	return NO_SLOT;
+}
+
+void dir_index_destroy(struct minix_inode *dir)
+{
+	struct dir_index *ix = dir->i_index;
+
+	if(ix == NULL)
+		return;
+	free(ix->chain);
+	free(ix->next);
+	free(ix->hash);
+	free(ix->free);
+	free(ix);
+	dir->i_index = NULL;
+}
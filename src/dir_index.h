@@ -0,0 +1,71 @@
+#ifndef _MINIX_DIR_INDEX
+#define _MINIX_DIR_INDEX
+
+#include "types.h"
+#include "inode.h"
+
+/**
+ * An in memory hashed index of a directory's entries, built the first time a
+ * directory of DIR_INDEX_MIN or more entries is searched or changed, and
+ * kept for as long as its inode is cached. It maps names to the slots
+ * (dentry numbers) holding them and keeps a heap of free slots, so finding
+ * a name or a place for a new one no longer means scanning the directory.
+ *
+ * Nothing about it is written to disk. The directory keeps its usual linear
+ * layout and every change is made to it exactly as before, with the index 
+ * told of it.
+ */
+struct dir_index {
+	int nr_hash;		/* # of chains. power of 2 */
+	int *chain;		/* first slot on each chain, or -1 */
+	int cap;		/* slots next and hash have room for */
+	int *next;		/* next slot on the same chain, or -1 */
+	unsigned *hash;		/* hash of the name in each slot in use */
+	int nr_entries;		/* slots in use */
+	int *free;		/* min-heap of free slots */
+	int nr_free;
+	int free_cap;
+};
+
+/**
+ * Sets how many entries a directory must have to be indexed. < 0 for never.
+ */
+void dir_index_set_min(int entries);
+
+/**
+ * Returns the index of directory 'dir', building it if need be, or NULL if
+ * the directory is too small to have one. Needs the filesystem lock, shared
+ * will do.
+ */
+struct dir_index *dir_index_get(struct minix_inode *dir);
+
+/**
+ * Looks 'name' up in the directory. Returns the slot holding it and sets 
+ * *i_num, or returns -1 if it isn't there.
+ */
+int dir_index_find(struct minix_inode *dir, struct dir_index *ix, 
+	const char *name, inode_nr *i_num);
+
+/**
+ * Takes the lowest free slot for a new entry. Returns -1 if there are none
+ * and the directory must be extended.
+ */
+int dir_index_take_slot(struct dir_index *ix);
+
+/**
+ * Records that the n slots from 'first' have been added to the directory, 
+ * empty.
+ */
+void dir_index_extend(struct dir_index *ix, int first, int n);
+
+/**
+ * Records that 'name' has been written to slot 'slot', or removed from it.
+ */
+void dir_index_add(struct dir_index *ix, const char *name, int slot);
+void dir_index_remove(struct dir_index *ix, const char *name, int slot);
+
+/**
+ * Frees the index of 'dir', if it has one.
+ */
+void dir_index_destroy(struct minix_inode *dir);
+#endif
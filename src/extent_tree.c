@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include "const.h"
+#include "comms.h"
+#include "extent_tree.h"
+
+static int height(struct extent_node *n)
+{
+	return n != NULL ? n->height : 0;
+}
+
+static int max_len(struct extent_node *n)
+{
+	return n != NULL ? n->max_len : 0;
+}
+
+static void update(struct extent_node *n)
+{
+	n->height = 1 + MAX(height(n->left), height(n->right));
+	n->max_len = MAX(n->len, MAX(max_len(n->left), max_len(n->right)));
+}
+
+static struct extent_node *rotate_right(struct extent_node *y)
+{
+	struct extent_node *x = y->left;
+
+	y->left = x->right;
+	x->right = y;
+	update(y);
+	update(x);
+	return x;
+}
+
+static struct extent_node *rotate_left(struct extent_node *x)
+{
+	struct extent_node *y = x->right;
+
+	x->right = y->left;
+	y->left = x;
+	update(x);
+	update(y);
+	return y;
+}
+
+/**
+ * Brings the subtree at 'n' back into balance after one of its children
+ * changed height, and returns its new root.
+ */
+static struct extent_node *balance(struct extent_node *n)
+{
+	update(n);
+	if(height(n->left) > height(n->right) + 1) {
+		if(height(n->left->left) < height(n->left->right))
+			n->left = rotate_left(n->left);
+		return rotate_right(n);
+	}
+	if(height(n->right) > height(n->left) + 1) {
+		if(height(n->right->right) < height(n->right->left))
+			n->right = rotate_right(n->right);
+		return rotate_left(n);
+	}
+	return n;
+}
+
+static struct extent_node *insert(struct extent_node *n,
+	struct extent_node *new)
+{
+	if(n == NULL)
+		return new;
+	if(new->start < n->start)
+		n->left = insert(n->left, new);
+	else
+		n->right = insert(n->right, new);
+	return balance(n);
+}
+
+static struct extent_node *remove_min(struct extent_node *n,
+	struct extent_node **min)
+{
+	if(n->left == NULL) {
+		*min = n;
+		return n->right;
+	}
+	n->left = remove_min(n->left, min);
+	return balance(n);
+}
+
+/**
+ * Removes and frees the extent starting at 'start', which must exist.
+ */
+static struct extent_node *delete(struct extent_node *n, int start)
+{
+	struct extent_node *l, *r, *m;
+
+	if(start < n->start)
+		n->left = delete(n->left, start);
+	else if(start > n->start)
+		n->right = delete(n->right, start);
+	else {
+		l = n->left;
+		r = n->right;
+		free(n);
+		if(r == NULL)
+			return l;
+		r = remove_min(r, &m);
+		m->left = l;
+		m->right = r;
+		n = m;
+	}
+	return balance(n);
+}
+
+/**
+ * Returns the extent holding 'bit', or NULL if it isn't free.
+ */
+static struct extent_node *find_at(struct extent_node *n, int bit)
+{
+	while(n != NULL) {
+		if(bit < n->start)
+			n = n->left;
+		else if(bit >= n->start + n->len)
+			n = n->right;
+		else
+			return n;
+	}
+	return NULL;
+}
+
+/**
+ * Returns the extent with the greatest start before 'bit', or NULL.
+ */
+static struct extent_node *find_before(struct extent_node *n, int bit)
+{
+	struct extent_node *best = NULL;
+
+	while(n != NULL) {
+		if(n->start < bit) {
+			best = n;
+			n = n->right;
+		}
+		else
+			n = n->left;
+	}
+	return best;
+}
+
+/**
+ * Returns the first extent starting after 'bit' that is at least 'len' long,
+ * or NULL. Subtrees with no extent that long are never entered.
+ */
+static struct extent_node *first_after(struct extent_node *n, int bit,
+	int len)
+{
+	struct extent_node *found;
+
+	if(n == NULL || n->max_len < len)
+		return NULL;
+	if(n->start <= bit)
+		return first_after(n->right, bit, len);
+	if((found = first_after(n->left, bit, len)) != NULL)
+		return found;
+	if(n->len >= len)
+		return n;
+	return first_after(n->right, bit, len);
+}
+
+/**
+ * Changes the extent starting at 'key' to the 'len' bits from 'start'. It
+ * must not overlap or pass any other extent, so that it keeps its place in
+ * the tree.
+ */
+static void resize(struct extent_node *n, int key, int start, int len)
+{
+	if(key < n->start)
+		resize(n->left, key, start, len);
+	else if(key > n->start)
+		resize(n->right, key, start, len);
+	else {
+		n->start = start;
+		n->len = len;
+	}
+	update(n);
+}
+
+static void add(struct extent_tree *tree, int start, int len)
+{
+	struct extent_node *n;
+
+	if((n = malloc(sizeof(struct extent_node))) == NULL)
+		panic("add(%d, %d): out of memory", start, len);
+	n->start = start;
+	n->len = n->max_len = len;
+	n->height = 1;
+	n->left = n->right = NULL;
+	tree->root = insert(tree->root, n);
+	tree->nr_extents++;
+}
+
+static void del(struct extent_tree *tree, int start)
+{
+	tree->root = delete(tree->root, start);
+	tree->nr_extents--;
+}
+
+struct extent_tree *extent_tree_new(void)
+{
+	struct extent_tree *tree;
+
+	if((tree = calloc(1, sizeof(struct extent_tree))) == NULL)
+		panic("extent_tree_new(): out of memory");
+	return tree;
+}
+
+static void free_nodes(struct extent_node *n)
+{
+	if(n == NULL)
+		return;
+	free_nodes(n->left);
+	free_nodes(n->right);
+	free(n);
+}
+
+void extent_tree_destroy(struct extent_tree *tree)
+{
+	free_nodes(tree->root);
+	free(tree);
+}
+
+void extent_tree_give(struct extent_tree *tree, int start, int len)
+{
+	struct extent_node *before, *after;
+	int end = start + len;
+
+	before = find_before(tree->root, start);
+	if(before != NULL && before->start + before->len > start)
+		panic("extent_tree_give(%d, %d): already free", start, len);
+	if(before != NULL && before->start + before->len != start)
+		before = NULL;
+	after = find_at(tree->root, end);
+	if(after != NULL && after->start != end)
+		panic("extent_tree_give(%d, %d): already free", start, len);
+
+	/* join on to the extents either side if they touch */
+	if(before != NULL && after != NULL) {
+		end = after->start + after->len;
+		del(tree, after->start);
+		resize(tree->root, before->start, before->start,
+			end - before->start);
+	}
+	else if(before != NULL)
+		resize(tree->root, before->start, before->start, 
+			end - before->start);
+	else if(after != NULL)
+		resize(tree->root, end, start, after->len + len);
+	else
+		add(tree, start, len);
+	tree->nr_free += len;
+}
+
+void extent_tree_take(struct extent_tree *tree, int start, int len)
+{
+	struct extent_node *n;
+	int first, end;
+
+	n = find_at(tree->root, start);
+	if(n == NULL || start + len > n->start + n->len)
+		panic("extent_tree_take(%d, %d): not free", start, len);
+
+	/* what is left either side of the bits taken */
+	first = n->start;
+	end = n->start + n->len;
+	if(first == start && end == start + len)
+		del(tree, first);
+	else if(first == start)
+		resize(tree->root, first, start + len, end - start - len);
+	else {
+		resize(tree->root, first, first, start - first);
+		if(start + len < end)
+			add(tree, start + len, end - start - len);
+	}
+	tree->nr_free -= len;
+}
+
+int extent_tree_find(struct extent_tree *tree, int near, int len)
+{
+	struct extent_node *n;
+
+	n = find_at(tree->root, near);
+	if(n != NULL && n->start + n->len - near >= len)
+		return near;
+	if((n = first_after(tree->root, near, len)) != NULL)
+		return n->start;
+	if((n = first_after(tree->root, -1, len)) != NULL)
+		return n->start;
+	return -1;
+}
+
+int extent_tree_free_at(struct extent_tree *tree, int bit)
+{
+	struct extent_node *n = find_at(tree->root, bit);
+
+	return n != NULL ? n->start + n->len - bit : 0;
+}
+
+int extent_tree_largest(struct extent_tree *tree, int *start)
+{
+	struct extent_node *n = tree->root;
+
+	if(n == NULL)
+		return 0;
+	while(n->len != n->max_len)
+		n = max_len(n->left) == n->max_len ? n->left : n->right;
+	*start = n->start;
+	return n->len;
+}
@@ -0,0 +1,64 @@
+#ifndef _MINIX_EXTENT_TREE
+#define _MINIX_EXTENT_TREE
+
+/**
+ * An in memory index of the free extents (runs of clear bits) of a bitmap.
+ * It is an AVL tree keyed by the first bit of each extent, with every node
+ * also knowing the longest extent below it, so that finding a run of a given
+ * length near some bit or the longest run there is takes O(log n) rather
+ * than a scan of the bitmap.
+ *
+ * The tree only mirrors the bitmap and nothing about it is written to disk.
+ * alloc_bit(), alloc_bits() and free_bit() keep it up to date for bitmaps
+ * that have one, see bitmap_build_tree().
+ */
+struct extent_node {
+	int start;			/* first free bit */
+	int len;			/* # of free bits */
+	int max_len;			/* longest len in this subtree */
+	int height;
+	struct extent_node *left, *right;
+};
+
+struct extent_tree {
+	struct extent_node *root;
+	int nr_extents;
+	int nr_free;			/* free bits in all extents */
+};
+
+struct extent_tree *extent_tree_new(void);
+void extent_tree_destroy(struct extent_tree *tree);
+
+/**
+ * Records that the 'len' bits from 'start' are free, joining them to the
+ * extents either side if they touch.
+ */
+void extent_tree_give(struct extent_tree *tree, int start, int len);
+
+/**
+ * Records that the 'len' bits from 'start', all within one free extent, are
+ * no longer free.
+ */
+void extent_tree_take(struct extent_tree *tree, int start, int len);
+
+/**
+ * Looks for 'len' free bits in a row nearest to 'near': from 'near' itself if
+ * it is free, else at the start of the first long enough extent after it,
+ * else at the start of the first long enough extent from the beginning.
+ * Returns the first of them or -1 if no extent is that long.
+ */
+int extent_tree_find(struct extent_tree *tree, int near, int len);
+
+/**
+ * Returns how many bits from 'bit' on are free before the next one that 
+ * isn't, 0 if 'bit' itself isn't.
+ */
+int extent_tree_free_at(struct extent_tree *tree, int bit);
+
+/**
+ * Returns the length of the longest free extent and sets *start to its first
+ * bit, or returns 0 if nothing is free.
+ */
+int extent_tree_largest(struct extent_tree *tree, int *start);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "const.h"
 #include "types.h"
 #include "comms.h"
@@ -8,10 +10,32 @@
 #include "superblock.h"
 #include "const.h"
 #include "write.h"
+#include "read.h"
 #include "inode.h"
+#include "dcache.h"
+#include "dir_index.h"
+#include "orphan.h"
 
 extern struct minix_super_block sb;
 
+/* the inode cache. every cached inode is on a hash chain and those with no
+ * users are also on the idle chain, least recently used at the front. */
+#define INODE_HASH(n)	((n) & (nr_hash - 1))
+
+static struct minix_inode **inode_hash = NULL;
+static int nr_hash;			/* # of chains. power of 2 */
+static int nr_cached;			/* # of inodes cached */
+static struct minix_inode *idle_front = NULL;	/* LRU */
+static struct minix_inode *idle_rear = NULL;	/* MRU */
+static int nr_idle;			/* # of inodes on the idle chain */
+
+/* protects the inode cache. get_inode and put_inode are called from 
+ * concurrent shared-locked operations such as getattr. it is dropped while an
+ * inode is read or written, the inode being left hashed but marked i_busy.
+ * inode_wait is broadcast as each stops being busy. */
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inode_wait = PTHREAD_COND_INITIALIZER;
+
 /**
  * Clear all fields in an inode.
  */
@@ -28,9 +52,11 @@ static void wipe_inode(struct minix_inode *inode)
 
 	inode->i_num = 0;
 	inode->i_dirty = FALSE;
+	inode->i_free_hint = 0;
 
 	for(i = 0; i < NR_ZONE_NUMS; i++)
 		inode->i_zone[i] = NO_ZONE;		
+	map_cache_clear(inode);
 }
 
 /**
@@ -41,6 +67,8 @@ static struct minix_inode *mk_inode(inode_nr i_num)
 	struct minix_inode *inode;
 
 	inode = (struct minix_inode *) calloc(1, sizeof(struct minix_inode));
+	if(inode == NULL)
+		panic("mk_inode(%d): unable to allocate inode", i_num);
 	inode->i_num = i_num;
 	inode->i_dirty = FALSE;
 
@@ -52,30 +80,51 @@ static struct minix_inode *mk_inode(inode_nr i_num)
  *
  * rw_flag set to READ to read
  * rw_flag set to WRITE to write
+ * rw_flag set to WRITE_SYNC to write and wait for the block to reach disk
  */
 static void rw_inode(struct minix_inode *i, int rw_flag)
 {
 	int i_block;		/* block inode is in */
 	int i_block_offset;	/* byte offset of inode in block */
 	struct minix_block *blk;/* blk containing inode */
+	struct minix_block *cluster[INODE_CLUSTER];
+	int table_start, table_end, c_first, c_count, c;
 
-	i_block = 2 + sb.s_imap_blocks + sb.s_zmap_blocks;
+	table_start = 2 + sb.s_imap_blocks + sb.s_zmap_blocks;
+	table_end = table_start + 
+		(sb.s_ninodes * INODE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	i_block = table_start;
 	i_block += ((i->i_num - 1) * INODE_SIZE) / BLOCK_SIZE;
 	i_block_offset = ((i->i_num - 1) * INODE_SIZE) % BLOCK_SIZE;
 
 	debug("rw_inode(%d): read/writing inode from block %d offset %d...", 
 		i->i_num, i_block, i_block_offset);
 
-	blk = get_block(i_block, TRUE);
-
 	if(rw_flag == READ) {
+		/* the inode table is contiguous on disk. read the cluster of
+		 * blocks around this inode in one go since inodes created
+		 * together tend to be used together. */
+		c_first = table_start + 
+			(i_block - table_start) / INODE_CLUSTER * INODE_CLUSTER;
+		c_count = MIN(INODE_CLUSTER, table_end - c_first);
+		get_blocks(c_first, c_count, TRUE, cluster);
+		for(c = 0; c < c_count; c++)
+			if(c_first + c != i_block)
+				put_block(cluster[c], INODE_BLOCK);
+		blk = cluster[i_block - c_first];
+
 		memcpy((void *)i, (void *) (blk->blk_data + i_block_offset), 
 			INODE_SIZE);
 	}
 	else {
+		blk = get_block(i_block, TRUE);
+		lock_block(blk);
 		memcpy((void *) (blk->blk_data + i_block_offset), (void *) i,
 			INODE_SIZE);
-		blk->blk_dirty = TRUE;
+		mark_dirty(blk);
+		unlock_block(blk);
+		if(rw_flag == WRITE_SYNC)
+			sync_block(blk);
 	}
 
 	put_block(blk, INODE_BLOCK);
@@ -83,56 +132,174 @@ static void rw_inode(struct minix_inode *i, int rw_flag)
 }
 
 
-struct minix_inode *get_inode(inode_nr i_num)
+static struct minix_inode *icache_find(inode_nr i_num)
 {
-	struct minix_inode *i, *free_slot;
-	free_slot = NO_INODE;
-
-	for(i = &inode_table[0]; i < &inode_table[NR_INODES]; i++) {
-		if(i->i_count > 0) {
-			if(i->i_num == i_num) {
-				debug("get_inode(%d): found in inode table",
-					i_num);
-				/* found our inode */
-				i->i_count++;
-				return i;
-			}
-		}
-		else {
-			/* inode slot is free, remember for later */
-			free_slot = i;
+	struct minix_inode *i;
+
+	if(inode_hash == NULL)
+		return NO_INODE;
+	for(i = inode_hash[INODE_HASH(i_num)]; i != NO_INODE; i = i->i_hash)
+		if(i->i_num == i_num)
+			return i;
+	return NO_INODE;
+}
+
+/**
+ * Doubles the number of hash chains, rehashing every cached inode.
+ */
+static void icache_grow(void)
+{
+	struct minix_inode **old = inode_hash, *i, *next;
+	int old_nr = nr_hash, b;
+
+	nr_hash = old_nr * 2;
+	debug("icache_grow(): growing inode hash table to %d chains", nr_hash);
+	inode_hash = calloc(nr_hash, sizeof(struct minix_inode *));
+	if(inode_hash == NULL)
+		panic("icache_grow(): unable to allocate %d chains", nr_hash);
+
+	for(b = 0; b < old_nr; b++) {
+		for(i = old[b]; i != NO_INODE; i = next) {
+			next = i->i_hash;
+			i->i_hash = inode_hash[INODE_HASH(i->i_num)];
+			inode_hash[INODE_HASH(i->i_num)] = i;
 		}
 	}
+	free(old);
+}
+
+static void icache_insert(struct minix_inode *inode)
+{
+	struct minix_inode **head;
+
+	if(inode_hash == NULL) {
+		nr_hash = NR_INODES;
+		inode_hash = calloc(nr_hash, sizeof(struct minix_inode *));
+		if(inode_hash == NULL)
+			panic("icache_insert(): unable to allocate inode hash "
+				"table");
+	}
+	else if(nr_cached >= nr_hash)
+		icache_grow();
+
+	head = &inode_hash[INODE_HASH(inode->i_num)];
+	inode->i_hash = *head;
+	*head = inode;
+	nr_cached++;
+}
+
+static void icache_remove(struct minix_inode *inode)
+{
+	struct minix_inode **pp = &inode_hash[INODE_HASH(inode->i_num)];
+
+	while(*pp != inode)
+		pp = &(*pp)->i_hash;
+	*pp = inode->i_hash;
+	nr_cached--;
+}
+
+static void idle_remove(struct minix_inode *inode)
+{
+	if(inode->i_lru_prev != NO_INODE)
+		inode->i_lru_prev->i_lru_next = inode->i_lru_next;
+	else
+		idle_front = inode->i_lru_next;
+	if(inode->i_lru_next != NO_INODE)
+		inode->i_lru_next->i_lru_prev = inode->i_lru_prev;
+	else
+		idle_rear = inode->i_lru_prev;
+	inode->i_lru_next = inode->i_lru_prev = NO_INODE;
+	nr_idle--;
+}
+
+/**
+ * Puts an inode nobody is using on the rear of the idle chain, then frees 
+ * inodes from the front while more than INODE_CACHE_IDLE are idle. Idle 
+ * inodes are always clean so nothing needs writing.
+ */
+static void idle_add(struct minix_inode *inode)
+{
+	struct minix_inode *victim;
+
+	inode->i_lru_next = NO_INODE;
+	inode->i_lru_prev = idle_rear;
+	if(idle_rear != NO_INODE)
+		idle_rear->i_lru_next = inode;
+	else
+		idle_front = inode;
+	idle_rear = inode;
+	nr_idle++;
+
+	while(nr_idle > INODE_CACHE_IDLE) {
+		victim = idle_front;
+		debug("idle_add(%d): evicting inode %d from inode cache",
+			inode->i_num, victim->i_num);
+		idle_remove(victim);
+		icache_remove(victim);
+		dir_index_destroy(victim);
+		free(victim);
+	}
+}
+
+struct minix_inode *get_inode(inode_nr i_num)
+{
+	struct minix_inode *i;
+
+	pthread_mutex_lock(&inode_lock);
+	if((i = icache_find(i_num)) != NO_INODE) {
+		debug("get_inode(%d): found in inode cache", i_num);
+		/* found our inode. a busy one isn't idle, even unused */
+		if(i->i_count++ == 0 && !i->i_busy)
+			idle_remove(i);
+		while(i->i_busy)
+			pthread_cond_wait(&inode_wait, &inode_lock);
+		pthread_mutex_unlock(&inode_lock);
+		return i;
+	}
 
-	if(free_slot == NO_INODE)
-		panic("get_inode(%d): no free slots in inode table to read in "
-			"read in inode", i_num);
+	debug("get_inode(%d): reading inode from disk", i_num);
 
-	debug("get_inode(%d): reading inode from disk. storing in table entry "
-		"at %p", i_num, free_slot);
+	i = mk_inode(i_num);
+	i->i_count = 1;
+	i->i_busy = TRUE;
+	icache_insert(i);
+	pthread_mutex_unlock(&inode_lock);
 
-	free_slot->i_num = i_num;
-	free_slot->i_count = 1;
-	rw_inode(free_slot, READ);
-	debug("get_inode(%d): inode read. i_count=%d", i_num, 
-		free_slot->i_count);
-	return free_slot;
+	rw_inode(i, READ);
+
+	pthread_mutex_lock(&inode_lock);
+	i->i_busy = FALSE;
+	pthread_cond_broadcast(&inode_wait);
+	pthread_mutex_unlock(&inode_lock);
+	debug("get_inode(%d): inode read. i_count=%d", i_num, i->i_count);
+	return i;
 }
 
 void print_inode_table(void)
 {
 	struct minix_inode *i;
-	for(i = &inode_table[0]; i < &inode_table[NR_INODES]; i++) {
-		printf("    inode %d: count=%d, dirty = %s xxyyzz\n", i->i_num, 
-			i->i_count, i->i_dirty == TRUE ? "Yes" : "No");
+	int b;
+
+	printf("    %d inodes cached, %d idle, %d hash chains\n", nr_cached,
+		nr_idle, nr_hash);
+	for(b = 0; inode_hash != NULL && b < nr_hash; b++) {
+		for(i = inode_hash[b]; i != NO_INODE; i = i->i_hash) {
+			printf("    inode %d: count=%d, dirty = %s\n", 
+				i->i_num, i->i_count, 
+				i->i_dirty == TRUE ? "Yes" : "No");
+		}
 	}
 }
 
 void flush_inode_table(void)
 {
 	struct minix_inode *i;
-	for(i = &inode_table[0]; i < &inode_table[NR_INODES]; i++) {
-		if(i->i_dirty == TRUE) {
+	int b;
+
+	for(b = 0; inode_hash != NULL && b < nr_hash; b++) {
+		for(i = inode_hash[b]; i != NO_INODE; i = i->i_hash) {
+			if(i->i_dirty != TRUE)
+				continue;
 			debug("flush_inode_table(): inode %d is dirty " 
 				"i_count=%d, flushing...", i->i_num, i->i_count);
 			if(i->i_nlinks == 0) {
@@ -140,50 +307,181 @@ void flush_inode_table(void)
 					i->i_num);
 				truncate(i);
 				free_inode(i->i_num);
+				if(S_ISDIR(i->i_mode))
+					dcache_purge(i->i_num);
 			}
 			rw_inode(i, WRITE);
+			if(i->i_nlinks == 0)
+				orphan_remove(i);
+		}
+	}
+}
+
+void inode_cache_destroy(void)
+{
+	struct minix_inode *i, *next;
+	int b;
+
+	pthread_mutex_lock(&inode_lock);
+	for(b = 0; inode_hash != NULL && b < nr_hash; b++) {
+		for(i = inode_hash[b]; i != NO_INODE; i = next) {
+			next = i->i_hash;
+			if(i->i_count > 0)
+				debug("inode_cache_destroy(): inode %d still "
+					"in use. i_count=%d", i->i_num, 
+					i->i_count);
+			dir_index_destroy(i);
+			free(i);
 		}
 	}
+	free(inode_hash);
+	inode_hash = NULL;
+	nr_cached = nr_idle = 0;
+	idle_front = idle_rear = NO_INODE;
+	pthread_mutex_unlock(&inode_lock);
+}
+
+void stat_inode(struct minix_inode *inode, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = inode->i_num;
+	st->st_mode = inode->i_mode;
+	st->st_nlink = inode->i_nlinks;
+	st->st_size = inode->i_size;
+	st->st_uid = inode->i_uid;
+	st->st_gid = inode->i_gid;
+	st->st_atime = inode->i_time;
+	st->st_mtime = inode->i_time;
+	st->st_ctime = inode->i_time;
+}
+
+static int cmp_blk(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+void prefetch_inodes(const inode_nr *i_nums, int n)
+{
+	int blks[PREFETCH_MAX];
+	int table_start, nr_blks = 0, i, run;
+
+	if(n > PREFETCH_MAX)
+		panic("prefetch_inodes(): %d inodes, at most %d", n,
+			PREFETCH_MAX);
+
+	table_start = 2 + sb.s_imap_blocks + sb.s_zmap_blocks;
+	pthread_mutex_lock(&inode_lock);
+	for(i = 0; i < n; i++)
+		if(i_nums[i] != NO_INODE && icache_find(i_nums[i]) == NO_INODE)
+			blks[nr_blks++] = table_start + 
+				((i_nums[i] - 1) * INODE_SIZE) / BLOCK_SIZE;
+	pthread_mutex_unlock(&inode_lock);
+	if(nr_blks == 0)
+		return;
+
+	/* read each run of them, taking in gaps of up to INODE_CLUSTER
+	 * blocks since one read of a few blocks more costs less than two */
+	qsort(blks, nr_blks, sizeof(int), cmp_blk);
+	for(i = 0; i < nr_blks; i = run) {
+		for(run = i + 1; run < nr_blks && 
+			blks[run] - blks[run - 1] <= INODE_CLUSTER; run++)
+			;
+		cache_readahead(blks[i], blks[run - 1] - blks[i] + 1);
+	}
+}
+
+void write_inode(struct minix_inode *inode)
+{
+	if(inode->i_dirty == TRUE)
+		rw_inode(inode, WRITE);
+}
+
+void sync_inode(struct minix_inode *inode)
+{
+	rw_inode(inode, WRITE_SYNC);
 }
-			
 
 void put_inode(struct minix_inode *inode)
 {
+	pthread_mutex_lock(&inode_lock);
 	inode->i_count--;
 	if(inode->i_count < 0) {
 		panic("put_inode(%d): i_count decremeted to %d!", 
 			inode->i_num, inode->i_count);
 	}
 
+	if(inode->i_count > 0) {
+		debug("put_inode(%d): inode still in use. i_count=%d",
+			inode->i_num, inode->i_count);
+		pthread_mutex_unlock(&inode_lock);
+		return;
+	}
+
+	/* the file is closed, it doesn't need zones set aside */
+	release_reservation(inode);
+
+	/* no one is using inode. the reclaimer frees it if it is running, 
+	 * keeping the reference we were dropping */
+	if(inode->i_nlinks == 0 && orphan_reclaim(inode)) {
+		debug("put_inode(%d): nlinks==0, left to the reclaimer",
+			inode->i_num);
+		inode->i_count = 1;
+		pthread_mutex_unlock(&inode_lock);
+		return;
+	}
+
+	if(inode->i_nlinks != 0 && inode->i_dirty != TRUE) {
+		debug("put_inode(%d): inode isn't dirty. no need to write",
+			inode->i_num);
+		idle_add(inode);
+		pthread_mutex_unlock(&inode_lock);
+		return;
+	}
+
+	/* the rest means I/O. anyone getting the inode meanwhile waits */
+	inode->i_busy = TRUE;
+	pthread_mutex_unlock(&inode_lock);
+
+	/* otherwise we can free it now */
+	if(inode->i_nlinks == 0) {
+		debug("put_inode(%d): nlinks==0, freeing inode...",
+			inode->i_num);
+
+		truncate(inode);	/* this will mark inode dirty */
+		free_inode(inode->i_num);
+		/* the number may be reused for another directory */
+		if(S_ISDIR(inode->i_mode))
+			dcache_purge(inode->i_num);
+		/* why dont we mark inode as clean? don't see why we
+ 		 * need to write a deleted inode to disk. */
+	//	inode->i_dirty = FALSE;
+	}
+
+	if(inode->i_dirty == TRUE) {
+		debug("put_inode(%d): inode is dirty. writing...",
+			inode->i_num);
+		 rw_inode(inode, WRITE);
+	}
+	if(inode->i_nlinks == 0)
+		orphan_remove(inode);	/* now it is written */
+
+	pthread_mutex_lock(&inode_lock);
+	inode->i_busy = FALSE;
+	pthread_cond_broadcast(&inode_wait);
+
+	/* keep the inode around in case it is wanted again, unless it no
+	 * longer exists. whoever got it while it was busy puts it later */
 	if(inode->i_count == 0) {
-		/* no one is using inode, we can free it now */
 		if(inode->i_nlinks == 0) {
-			debug("put_inode(%d): nlinks==0, freeing inode...",
-				inode->i_num);
-
-			truncate(inode);	/* this will mark inode dirty */
-			free_inode(inode->i_num);
-			/* why dont we mark inode as clean? don't see why we
- 			 * need to write a deleted inode to disk. */
-		//	inode->i_dirty = FALSE;
-		}
-
-		if(inode->i_dirty == TRUE) {
-			debug("put_inode(%d): inode is dirty. writing...",
-				inode->i_num);
-			 rw_inode(inode, WRITE);
+			icache_remove(inode);
+			dir_index_destroy(inode);
+			free(inode);
 		}
-		else {
-			debug("put_inode(%d): inode isn't dirty. no need to "
-				"write", inode->i_num);
-		}
-	}
-	else {
-		debug("put_inode(%d): inode still in use. i_count=%d",
-			inode->i_num, inode->i_count);
+		else
+			idle_add(inode);
 	}
+	pthread_mutex_unlock(&inode_lock);
 	debug("put_inode(): finished");
-	// else inode is still in use
 }
 
 
@@ -197,12 +495,13 @@ struct minix_inode *alloc_inode(void)
 {
 	struct minix_inode *inode;	
 	inode_nr i_num;			
+	int b;
  
 	debug("alloc_inode(): attempting to allocate free inode...");
 
-	i_num = (inode_nr) alloc_bit(sb.imap, 0);
-	if(i_num < 0) 
+	if((b = alloc_bit(sb.imap, 0)) < 0) 
 		panic("alloc_inode(): no free inodes available");
+	i_num = (inode_nr) b;
 
 	inode = get_inode(i_num);
 	wipe_inode(inode);
@@ -17,6 +17,24 @@ struct minix_inode_disk {
         u16 i_zone[9];
 };
 
+struct dir_index;
+struct delalloc;
+struct stat;
+
+#define INODE_EXTENTS 8		/* zone map extents cached per inode */
+/* most inodes prefetch_inodes() takes at once, a batch of readdir's */
+#define PREFETCH_MAX (READDIR_BATCH * DENTRIES_PER_BLOCK)
+
+/**
+ * A run of a file's zones that lie one after another on disk, as decoded 
+ * from its indirect blocks by read_map().
+ */
+struct zone_extent {
+	int e_start;		/* first file relative zone of the run */
+	int e_len;		/* # of zones in run. 0 if extent unused */
+	zone_nr e_zone;		/* disk zone holding zone e_start */
+};
+
 /**
  * Minix inode as it appear in memory
  */
@@ -32,16 +50,69 @@ struct minix_inode {
 	/* in memory only fields */
 	inode_nr i_num;			/* inode number */
 	char i_dirty;			/* whether inode has been modified */
+	char i_busy;			/* being read in or written out */
 	int i_count;			/* # of users of inode */
+	struct minix_inode *i_hash;	/* next inode in hash chain */
+	struct minix_inode *i_lru_next;	/* next unreferenced inode */
+	struct minix_inode *i_lru_prev;	/* prev unreferenced inode */
+	struct dir_index *i_index;	/* large directories only, see 
+					 * dir_index.h */
+	int i_free_hint;		/* directories. no dentry below this
+					 * slot is free */
+	struct zone_extent i_ext[INODE_EXTENTS]; /* see read_map() */
+	int i_ext_next;			/* extent to replace next */
+	struct delalloc *i_delalloc;	/* blocks written with no zone yet,
+					 * see delalloc.h */
+	zone_nr i_resv_start;		/* first zone set aside for the file */
+	int i_resv_len;			/* # of them. see map_zones() */
+	struct minix_inode *i_resv_next; /* next inode with a window */
+	struct minix_inode *i_resv_prev; /* prev inode with a window */
+	char i_orphan;			/* in the orphan table, see orphan.h */
+	char i_reclaim;			/* given to the reclaimer */
+	struct minix_inode *i_reclaim_next; /* next orphan to reclaim */
 };
 
-struct minix_inode inode_table[NR_INODES];
-
+/**
+ * The inode cache. get_inode() returns the in memory copy of an inode,
+ * reading it in if it isn't cached, and put_inode() releases it. Inodes that
+ * nobody is using are kept, clean, in LRU order until INODE_CACHE_IDLE of
+ * them are. The number in use is only limited by memory. Neither holds the
+ * cache's lock while reading or writing an inode, so other inodes can be got
+ * meanwhile. Getting the inode itself waits until it is done.
+ */
 struct minix_inode *get_inode(inode_nr i_num);
 void put_inode(struct minix_inode *inode);
+
+/**
+ * Fills in 'st' with the inode's attributes, as stat(2) gives them.
+ */
+void stat_inode(struct minix_inode *inode, struct stat *st);
+
+/**
+ * Brings the inode table blocks holding the n inodes that aren't cached into
+ * the buffer cache, a run of blocks at a time, ahead of their being got. n
+ * must be no more than PREFETCH_MAX.
+ */
+void prefetch_inodes(const inode_nr *i_nums, int n);
+
+/**
+ * Writes the inode to disk now if it is dirty, rather than when it is last
+ * put.
+ */
+void write_inode(struct minix_inode *inode);
+
+/**
+ * Writes the inode to disk, dirty or not, and waits for it to get there.
+ */
+void sync_inode(struct minix_inode *inode);
 struct minix_inode *alloc_inode(void);
 void free_inode(inode_nr i_num);
 void inode_print(struct minix_inode *inode);
 void print_inode_table(void);
 void flush_inode_table(void);
+
+/**
+ * Frees every cached inode. Called at unmount after flush_inode_table().
+ */
+void inode_cache_destroy(void);
 #endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "const.h"
 #include "cache.h"
 #include "comms.h"
@@ -10,9 +11,29 @@
 #include "superblock.h"
 #include "inode.h"
 #include "mount.h"
+#include "dcache.h"
+#include "write.h"
+#include "orphan.h"
 
 struct minix_super_block sb;
 
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void fs_lock_shared(void)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+}
+
+void fs_lock_excl(void)
+{
+	pthread_rwlock_wrlock(&fs_lock);
+}
+
+void fs_unlock(void)
+{
+	pthread_rwlock_unlock(&fs_lock);
+}
+
 /**
  * Load and return a bitmap of size 'num_blocks' that starts at block offset
  * 'blk_offset'.
@@ -25,10 +46,13 @@ static struct generic_bitmap *get_bitmap(int blk_offset, int num_blocks)
 	bmap->blocks = (struct minix_block **) 
 		malloc(num_blocks * sizeof(struct minix_block *));
 
-	for(i = 0; i < num_blocks; i++) {
-		debug("get_bitmap(%d, %d): loading bitmap block %d...", 
+	/* the bitmap is contiguous on disk so read it in with as few reads
+	 * as get_blocks allows */
+	for(i = 0; i < num_blocks; i += MAX_RUN) {
+		debug("get_bitmap(%d, %d): loading bitmap blocks from %d...", 
 			blk_offset, num_blocks, i);
-		bmap->blocks[i] = get_block(blk_offset + i, TRUE);
+		get_blocks(blk_offset + i, MIN(num_blocks - i, MAX_RUN), TRUE,
+			&bmap->blocks[i]);
 	}
 
 	return bmap;
@@ -105,8 +129,11 @@ static void minix_print_version(void)
 			printf("unable to identify minix file system\n");
 	}
 	printf("block size = %d bytes\n", BLOCK_SIZE);
-	printf("buffer cache size = %dMB\n", NR_BUFS / 1024);
-	printf("buffer cache hash table size = %d\n", NR_BUF_HASH);
+	printf("buffer cache size = %d blocks (%.2fMB)\n", cache_nr_bufs(),
+		(double) cache_nr_bufs() * BLOCK_SIZE / (1024 * 1024));
+	printf("buffer cache hash table size = %d\n", cache_nr_hash());
+	printf("buffer cache policy = %s\n", cache_policy_name());
+	printf("buffer cache I/O = %s\n", cache_io_name());
 
 #ifdef CACHE_WRITE_IMMED_OFF
 	printf("cache write_immed = OFF\n");
@@ -121,6 +148,7 @@ static void load_bitmaps(void)
 	debug("load_bitmaps(): loading bitmaps...");
 	sb.imap = get_imap();
 	sb.zmap = get_zmap();
+	bitmap_build_tree(sb.zmap);
 }
 
 static void unload_bitmaps(void)
@@ -131,23 +159,29 @@ static void unload_bitmaps(void)
 
 	for(i = 0; i < sb.zmap->num_blocks; i++)
 		put_block(sb.zmap->blocks[i], ZMAP_BLOCK);
+	extent_tree_destroy(sb.zmap->tree);
+	sb.zmap->tree = NULL;
 }
 
 /**
  * Attempts to mount a Minix file system located on the given device.
+ *
+ * opts configures the buffer cache and may be NULL for the defaults.
  */
-void minix_mount(const char *device_name)
+void minix_mount(const char *device_name, const struct cache_opts *opts)
 {
 	open_blk_device(device_name);
-	init_cache();
+	init_cache(opts);
+	dcache_init();
 	read_super();
 
 	minix_print_version();
 	
-	sb.device_name = malloc(strlen(device_name));
+	sb.device_name = malloc(strlen(device_name) + 1);
 	strcpy(sb.device_name, device_name);
 	load_bitmaps();
 	sb.root_inode = get_inode(ROOT_INODE);
+	orphan_recover();
 
 }
 
@@ -184,17 +218,26 @@ void minix_unmount(void)
 {
 	clock_t cpu_start, cpu_end;
 	struct timeval wall_start, wall_end, wall_elapsed;
+	struct cache_stats before, after;
 
 	float cpu_elapsed;
 	
 	cpu_start = clock();
 	gettimeofday(&wall_start, NULL);
 
+	debug("minix_unmount(): freeing orphans queued...");
+	reclaimer_stop();
+
+	debug("minix_unmount(): giving zones to blocks held back...");
+	flush_delalloc_all();
+	release_reservations();
+
 	debug("minix_unmount(): saving root inode...");
 	put_inode(sb.root_inode);
 
 	debug("minix_unmount(): flushing inode table...");
 	flush_inode_table();
+	inode_cache_destroy();
 
 	debug("minix_unmount(): unloading bitmaps...");
 	unload_bitmaps();
@@ -203,7 +246,9 @@ void minix_unmount(void)
 	//debug("minix_unmount(): unloading superblock...");
 	
 	debug("minix_unmount(): syncing with disk...");
+	cache_get_stats(&before);
 	sync_cache();
+	cache_get_stats(&after);
 
 	cpu_end = clock();
 	gettimeofday(&wall_end, NULL);
@@ -215,6 +260,9 @@ void minix_unmount(void)
 	info_1("umount(): Wall time elapsed: %ld.%06ld seconds", 
 		(long) wall_elapsed.tv_sec, 
 		(long) wall_elapsed.tv_usec);
+	info_1("unmount(): synced %lu blocks in %lu writes",
+		after.writes - before.writes, 
+		after.write_calls - before.write_calls);
 
 	info_1("unmount(): destroying cache...");
 	cache_destroy();
@@ -1,2 +1,11 @@
-void minix_mount(const char *device_name);
+struct cache_opts;
+
+void minix_mount(const char *device_name, const struct cache_opts *opts);
 void minix_unmount(void);
+
+/* filesystem wide lock. operations that only look at the filesystem take it
+ * shared so they run in parallel, anything that modifies it takes it 
+ * exclusively. */
+void fs_lock_shared(void);
+void fs_lock_excl(void);
+void fs_unlock(void);
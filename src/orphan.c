@@ -0,0 +1,254 @@
+#include <string.h>
+#include <pthread.h>
+#include "types.h"
+#include "const.h"
+#include "comms.h"
+#include "cache.h"
+#include "superblock.h"
+#include "inode.h"
+#include "mount.h"
+#include "write.h"
+#include "bitmap.h"
+#include "orphan.h"
+
+extern struct minix_super_block sb;
+
+/* the orphan table, as on disk */
+static struct orphan_table_disk table;
+
+/* orphans waiting for the reclaimer, oldest first, linked through
+ * i_reclaim_next */
+static struct minix_inode *queue_front = NO_INODE, *queue_rear = NO_INODE;
+
+static pthread_t reclaimer_thread;
+static int reclaimer_running = FALSE;
+static int reclaimer_stopping;
+
+/* protects all of the above. never held while taking the inode cache lock
+ * or the filesystem lock */
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t orphan_wake = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Copies the table into the superblock's block. If 'sync' is set the block is
+ * written to disk before returning, otherwise whenever the cache gets to it.
+ */
+static void write_table(int sync)
+{
+	struct minix_block *blk;
+
+	blk = get_block(SUPER_BLOCK_NR, TRUE);
+	lock_block(blk);
+	memcpy(blk->blk_data + ORPHAN_OFFSET, &table, sizeof(table));
+	mark_dirty(blk);
+	unlock_block(blk);
+	if(sync)
+		sync_block(blk);
+	put_block(blk, SUPER_BLOCK);
+}
+
+int orphan_add(struct minix_inode *inode)
+{
+	int added = FALSE;
+
+	/* on disk the inode must have no links before it is in the table,
+	 * or orphan_recover() takes the entry to be stale. the flusher writes
+	 * in block number order, which would put the table first, so both
+	 * are written here in turn */
+	sync_inode(inode);
+
+	pthread_mutex_lock(&orphan_lock);
+	if(table.o_count < ORPHAN_MAX) {
+		table.o_inodes[table.o_count++] = inode->i_num;
+		write_table(TRUE);
+		inode->i_orphan = TRUE;
+		added = TRUE;
+	}
+	pthread_mutex_unlock(&orphan_lock);
+
+	if(!added)
+		debug("orphan_add(%d): orphan table full", inode->i_num);
+	return added;
+}
+
+/**
+ * Takes inode 'i_num' out of the table.
+ */
+static void table_remove(inode_nr i_num)
+{
+	int n;
+
+	pthread_mutex_lock(&orphan_lock);
+	for(n = 0; n < table.o_count; n++) {
+		if(table.o_inodes[n] == i_num) {
+			table.o_inodes[n] = table.o_inodes[--table.o_count];
+			/* an entry left on disk for a freed inode is dropped
+			 * by orphan_recover(), so this can wait */
+			write_table(FALSE);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+void orphan_remove(struct minix_inode *inode)
+{
+	if(inode->i_orphan) {
+		table_remove(inode->i_num);
+		inode->i_orphan = FALSE;
+	}
+}
+
+int orphan_count(void)
+{
+	return table.o_count;
+}
+
+void orphan_recover(void)
+{
+	struct minix_block *blk;
+	struct minix_inode *inode;
+	inode_nr left[ORPHAN_MAX];
+	int n, count;
+
+	blk = get_block(SUPER_BLOCK_NR, TRUE);
+	memcpy(&table, blk->blk_data + ORPHAN_OFFSET, sizeof(table));
+	put_block(blk, SUPER_BLOCK);
+
+	if(table.o_magic != ORPHAN_MAGIC || table.o_count > ORPHAN_MAX) {
+		/* made by mkfs or an older somix. start a table */
+		memset(&table, 0, sizeof(table));
+		table.o_magic = ORPHAN_MAGIC;
+		write_table(FALSE);
+		return;
+	}
+	if(table.o_count == 0)
+		return;
+
+	/* freeing each takes it out of the table, so work from a copy */
+	count = table.o_count;
+	memcpy(left, table.o_inodes, count * sizeof(inode_nr));
+	info_1("orphan_recover(): freeing %d orphaned inodes", count);
+
+	for(n = 0; n < count; n++) {
+		if(left[n] == 0 || left[n] > sb.s_ninodes ||
+			!test_bit(sb.imap, left[n])) {
+			/* freed before the table was written */
+			inode = NO_INODE;
+		}
+		else {
+			inode = get_inode(left[n]);
+			if(inode->i_nlinks != 0) {
+				put_inode(inode);
+				inode = NO_INODE;
+			}
+		}
+
+		if(inode == NO_INODE) {
+			table_remove(left[n]);
+			continue;
+		}
+
+		/* nobody else has it, so this frees it */
+		inode->i_orphan = TRUE;
+		put_inode(inode);
+	}
+}
+
+int orphan_reclaim(struct minix_inode *inode)
+{
+	int queued = FALSE;
+
+	pthread_mutex_lock(&orphan_lock);
+	if(reclaimer_running && !reclaimer_stopping && inode->i_orphan &&
+		!inode->i_reclaim) {
+		inode->i_reclaim = TRUE;
+		inode->i_reclaim_next = NO_INODE;
+		if(queue_rear != NO_INODE)
+			queue_rear->i_reclaim_next = inode;
+		else
+			queue_front = inode;
+		queue_rear = inode;
+		pthread_cond_signal(&orphan_wake);
+		queued = TRUE;
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	return queued;
+}
+
+/**
+ * Frees the orphan a step at a time from its end, writing the inode after
+ * each so that it never holds zones that have been freed, then puts it to
+ * free the rest and the inode itself.
+ */
+static void reclaim(struct minix_inode *inode)
+{
+	int blocks;
+
+	debug("reclaim(%d): freeing %d bytes", inode->i_num, inode->i_size);
+	fs_lock_excl();
+	while((blocks = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE) >
+		RECLAIM_STEP) {
+		truncate_to(inode, (off_t) (blocks - 1) / RECLAIM_STEP *
+			RECLAIM_STEP * BLOCK_SIZE);
+		write_inode(inode);
+		fs_unlock();
+		fs_lock_excl();
+	}
+	put_inode(inode);
+	fs_unlock();
+}
+
+static void *reclaimer(void *arg)
+{
+	struct minix_inode *inode;
+
+	pthread_mutex_lock(&orphan_lock);
+	for(;;) {
+		while(queue_front == NO_INODE && !reclaimer_stopping)
+			pthread_cond_wait(&orphan_wake, &orphan_lock);
+		if(queue_front == NO_INODE)
+			break;		/* stopping, and nothing left */
+
+		inode = queue_front;
+		if((queue_front = inode->i_reclaim_next) == NO_INODE)
+			queue_rear = NO_INODE;
+		pthread_mutex_unlock(&orphan_lock);
+		reclaim(inode);
+		pthread_mutex_lock(&orphan_lock);
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	return NULL;
+}
+
+void reclaimer_start(void)
+{
+	pthread_mutex_lock(&orphan_lock);
+	if(!reclaimer_running) {
+		reclaimer_stopping = FALSE;
+		if(pthread_create(&reclaimer_thread, NULL, reclaimer, NULL)
+			!= 0)
+			panic("reclaimer_start(): unable to start reclaimer");
+		reclaimer_running = TRUE;
+	}
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+void reclaimer_stop(void)
+{
+	pthread_mutex_lock(&orphan_lock);
+	if(!reclaimer_running) {
+		pthread_mutex_unlock(&orphan_lock);
+		return;
+	}
+	reclaimer_stopping = TRUE;
+	pthread_cond_signal(&orphan_wake);
+	pthread_mutex_unlock(&orphan_lock);
+
+	pthread_join(reclaimer_thread, NULL);
+
+	/* orphans put from now on are freed straight away */
+	pthread_mutex_lock(&orphan_lock);
+	reclaimer_running = FALSE;
+	pthread_mutex_unlock(&orphan_lock);
+}
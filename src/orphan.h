@@ -0,0 +1,84 @@
+#ifndef _MINIX_ORPHAN
+#define _MINIX_ORPHAN
+
+#include "types.h"
+#include "const.h"
+#include "inode.h"
+
+#define ORPHAN_OFFSET 512	/* of the table in the superblock's block, past
+				 * the on disk superblock */
+#define ORPHAN_MAGIC 0x4f52
+#define ORPHAN_MAX ((BLOCK_SIZE - ORPHAN_OFFSET - 4) / sizeof(inode_nr))
+#define RECLAIM_STEP 1024	/* blocks freed before others get a turn */
+
+/**
+ * The orphan table as it appears on disk. Minix v1 leaves all but the start
+ * of the superblock's block unused.
+ */
+struct orphan_table_disk {
+	u16 o_magic;
+	u16 o_count;
+	inode_nr o_inodes[ORPHAN_MAX];
+};
+
+/**
+ * Orphans are inodes whose last link has gone but whose zones and number
+ * haven't been freed yet, either because the file is still open or because
+ * the reclaimer hasn't got to it. They are recorded in the orphan table so
+ * that a crash before they are freed doesn't lose the space, and
+ * orphan_recover() frees any left there at mount.
+ *
+ * As an inode becomes an orphan its directory entry, the inode itself and
+ * then the table are each written to disk before the next, so that after a
+ * crash the table never names an inode that still has links or a name on
+ * disk. Taking an orphan out of the table once it is freed is written when
+ * the cache gets to it, so a crash just then can still leave its zones and
+ * number unfreed on disk, as minix always could.
+ *
+ * With the reclaimer running put_inode() hands an orphan it was the last
+ * user of to the reclaimer thread rather than freeing it, so unlinking a big
+ * file takes no longer than a small one. The reclaimer frees RECLAIM_STEP
+ * blocks at a time under the exclusive filesystem lock, letting other
+ * operations in between. Without it orphans are freed straight away, as they
+ * always were.
+ */
+
+/**
+ * Records the inode, whose last link has just gone, in the orphan table and
+ * writes it and the table to disk, waiting for both. Returns FALSE if the
+ * table is full, in which case the inode is freed straight away on its last
+ * put_inode().
+ */
+int orphan_add(struct minix_inode *inode);
+
+/**
+ * Takes the inode out of the orphan table once it has been freed.
+ */
+void orphan_remove(struct minix_inode *inode);
+
+/**
+ * Frees the orphans left in the table when the filesystem was last
+ * unmounted, or a crash stopped it. Called at mount.
+ */
+void orphan_recover(void);
+
+/**
+ * Called by put_inode() for an orphan nobody is using any more. Queues it
+ * for the reclaimer and returns TRUE if the reclaimer is running, in which
+ * case the reclaimer holds the reference put_inode() was dropping.
+ */
+int orphan_reclaim(struct minix_inode *inode);
+
+/**
+ * Starts and stops the reclaimer. reclaimer_stop() waits for every orphan
+ * queued to be freed and must not be called with the filesystem lock held.
+ */
+void reclaimer_start(void);
+void reclaimer_stop(void);
+
+/**
+ * Returns the number of orphans in the table.
+ */
+int orphan_count(void);
+
+#endif
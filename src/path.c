@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "types.h"
 #include "const.h"
 #include "inode.h"
@@ -6,53 +7,64 @@
 #include "comms.h"
 #include "superblock.h"
 #include "path.h"
+#include "dcache.h"
 
 extern struct minix_super_block sb;
 
 /**
- * Copies the n'th component of the given 'path' to buf. The component will be
- * stripped of preceeding anid trailing slashes.
- *
- * Components are indexed starting at zero.
- *
- * Returns 1 if the n'th component exists and was copied succesfully, 0
- * otherwise.
+ * Starts iterating over the components of 'path'.
  */
-static int path_get_nth_cmpo(const char *path, char *buf, int n)
+void path_iter_init(struct path_iter *it, const char *path)
 {
-	int offset = 0;				
-	
-	while(*(path + offset) == '/') 
-		offset++;		/* skip any leading slashes */
-
-	/* skip past first n components in path. After skipping past n
-	 * components we will be left pointing to the start of the
-	 * n+1'th component exluding its leading slash. */
-	for( ; *(path+offset) != '\0' && n != 0; ) {
-		if(*(path+offset) == '/') {
-			/* allows //foo////bar etc. */
-			while(*(path+offset)=='/') offset++; 
-
-			n--;
-			continue;
-		}
+	it->next = path;
+}
 
-		offset++;
+/**
+ * Copies the next component of the path being iterated over to 'buf', which
+ * must hold FILENAME_SIZE bytes, stripped of its slashes. Each call carries
+ * on from where the last left off so a whole path is only ever parsed once.
+ *
+ * Returns 1 if a component was copied, 0 if there are no more and -1 if the
+ * component is too long to be a file name.
+ */
+int path_next(struct path_iter *it, char *buf)
+{
+	const char *p = it->next;
+	int len = 0;
+
+	while(*p == '/')
+		p++;			/* allows //foo////bar etc. */
+	if(*p == '\0') {
+		it->next = p;
+		return 0;
 	}
 
-	if(n != 0) return 0;		/* n'th component doesn't exist */
-
-	if(*(path+offset) == '\0') return 0;	/* We had a trailing slash */
-	while(*(path+offset) != '/' && *(path+offset) != '\0') { 
-		*buf = *(path+offset);
-		offset++;
-		buf++;
+	while(*p != '/' && *p != '\0') {
+		if(len < FILENAME_SIZE - 1)
+			buf[len] = *p;
+		len++;
+		p++;
 	}
-	*buf = '\0';
-
+	it->next = p;
+	if(len >= FILENAME_SIZE) 
+		return -1;
+	buf[len] = '\0';
 	return 1;
 }
 
+/**
+ * Returns TRUE if there are no components left in the path being iterated
+ * over.
+ */
+int path_at_end(struct path_iter *it)
+{
+	const char *p = it->next;
+
+	while(*p == '/')
+		p++;
+	return *p == '\0';
+}
+
 /**
  * Counts the number of components in the given path.
  *
@@ -91,121 +103,105 @@ int path_cnt_cmpos(const char *path)
  */
 int path_get_last_cmpo(const char *path, char *buf)
 {
-	int cnt = 0;
-	if((cnt = path_cnt_cmpos(path)) > 0) {
-		path_get_nth_cmpo(path, buf, cnt-1);
-		return 1;
-	}
+	struct path_iter it;
+	int ret, found = 0;
 
-	return 0;
+	path_iter_init(&it, path);
+	while((ret = path_next(&it, buf)) != 0)
+		found = ret > 0;
+	return found;
 }
 
 /**
- * Given a directory inode and a string path relative to that inode this
- * function resolves the path up to the n'th component and returns the inode.
+ * Walks 'path' down from 'root', a component at a time, and returns the inode
+ * reached with a reference the caller must put. At most 'levels' components
+ * are resolved, every one for PATH_RESOLVE_ALL. If 'last' is not NULL the
+ * final component is not resolved but copied to 'last' instead, and it is 
+ * an error for there to be none.
  *
- * For the path /home/jo/foo
- * 	resolve_path(/home/jo/foo, 0) 	- returns 'inode'
- * 	resolve_path(/home/jo/foo, 1)  	- returns inode for home
- * 	resolve_path(/home/jo/foo, 2)	- returns inode for jo
- * 	etc.
+ * The path is parsed once, in step with the walk.
  *
- * set n to PATH_RESOLVE_ALL to fully resolve the path.
- *
- * The inode given is never 'put'
- *
- * Returns the inode if the path is valid, NULL otherwise.
+ * Returns NULL if a component can't be found.
  */
-#ifdef _FOO
-struct minix_inode *resolve_path(struct minix_inode *inode, const char *path, 
-	int n)
+static struct minix_inode *walk(struct minix_inode *root, const char *path,
+	int levels, char *last)
 {
 	char file[FILENAME_SIZE];
-	int i = 0;
+	struct path_iter it;
+	struct minix_inode *inode;
 	inode_nr i_num;
+	int ret;
 
-	debug("resolve_path(inode %d, \"%s\", %d): resolving %d'th "
-		"component...", inode->i_num, path, n, n);
+	/* NOTE: caller must always be free to put the inode we return */
+	inode = get_inode(root->i_num);
+	path_iter_init(&it, path);
 
-	while(n != 0 && path_get_nth_cmpo(path, file, i)) {
-		debug("resolv_path(...): looking up component \"%s\" in "
-			"inode %d...", file, inode->i_num);
-		i_num = dir_search(inode, file);
+	for(; levels != 0; levels--) {
+		if((ret = path_next(&it, file)) == 0)
+			break;
 
-		if(i_num == NO_INODE) {
-			debug("resolv_path(...): unable to find component "
-			"\"%s\"", file);
+		if(last != NULL && path_at_end(&it)) {
+			if(ret < 0)
+				break;
+			strcpy(last, file);
+			return inode;
+		}
+
+		if(ret < 0 || (i_num = dir_search(inode, file)) == NO_INODE) {
+			debug("walk(): failed to lookup \"%s\" in inode %d", 
+				file, inode->i_num);
+			put_inode(inode);
 			return NULL;
 		}
-		debug("resolv_path(...): component \"%s\" found with inode=%d",
-			file, i_num);
 
-		/* only put inodes we got ourselves */
-		if(i++ > 0) put_inode(inode); 	
+		put_inode(inode);
 		inode = get_inode(i_num);
-
-		n--;			
-	}
-	
-	if(n > 0) {
-		/* we ran out of components before getting to n'th */
-		debug("resolv_path(...): not enough components in path to "
-			"return n'th");
-		if(i > 0) put_inode(inode);
-		inode = NULL;
 	}
 
-	/* so the caller is free to put the inode they resolved */
-	if(i == 0) inode = get_inode(inode->i_num);
-
-	debug("returning inode %d", inode->i_num);
+	if(last != NULL) {
+		/* the path had no final component */
+		put_inode(inode);
+		return NULL;
+	}
 	return inode;
 }
-#endif
 
+/**
+ * Given a directory inode and a string path relative to that inode this
+ * function resolves the path up to the n'th component and returns the inode.
+ *
+ * For the path /home/jo/foo
+ * 	resolve_path(/home/jo/foo, 0) 	- returns 'inode'
+ * 	resolve_path(/home/jo/foo, 1)  	- returns inode for home
+ * 	resolve_path(/home/jo/foo, 2)	- returns inode for jo
+ * 	etc.
+ *
+ * set n to PATH_RESOLVE_ALL to fully resolve the path. Whole paths from the 
+ * root are looked up in the path cache first, see dcache_path_lookup().
+ *
+ * The caller is always free to put the inode returned.
+ *
+ * Returns the inode if the path is valid, NULL otherwise.
+ */
 struct minix_inode *resolve_path(struct minix_inode *root, const char *path, 
 	int levels)
 {
-	char file[FILENAME_SIZE];
-	int i;
 	struct minix_inode *inode;
 	inode_nr i_num;
+	int whole = levels == PATH_RESOLVE_ALL && root->i_num == ROOT_INODE;
 
-	if(levels == PATH_RESOLVE_ALL)
-		levels = path_cnt_cmpos(path);
+	if(whole && dcache_path_lookup(path, &i_num))
+		return get_inode(i_num);
 
-	/* NOTE: caller must always be free to put the inode we return */
-	if(levels == 0)
-		return get_inode(root->i_num);
-
-	/* load a copy of root inode to start with */
-	inode = get_inode(root->i_num);
-
-	for(i = 0; i < levels; i++) {
-		if(!path_get_nth_cmpo(path, file, i)) {
-			/* couldn't get component, shouldn't happen since we
-			 * counted components first. */
-			panic("resolve_path(): couldn't get component %d", i);
-		}
-
-		i_num = dir_search(inode, file);
-		if(i_num == NO_INODE) {
-			debug("resolve_path(): failed to lookup \"%s\" in "
-				"inode %d", file, inode->i_num);
-			put_inode(inode);
-			return NULL;
-		}
-
-		put_inode(inode);
-		inode = get_inode(i_num);
-	}
+	inode = walk(root, path, levels, NULL);
 
+	if(whole && inode != NULL)
+		dcache_path_enter(path, inode->i_num);
 	debug("resolve_path(): finished resolving path, returning inode %d",
-		inode->i_num);
+		inode != NULL ? inode->i_num : NO_INODE);
 	return inode;
 }
-		
-	
+
 /**
  * Returns the inode corresponding to the final directory in the given path.
  * Also returns the final component of the path in 'buf'.
@@ -213,15 +209,8 @@ struct minix_inode *resolve_path(struct minix_inode *root, const char *path,
  */
 struct minix_inode *last_dir(const char *path, char *buf)
 {
-	int n = path_cnt_cmpos(path);
-	struct minix_inode *p_dir;
-
-	if(path_get_last_cmpo(path, buf) == 0) 
-		return NULL;	/* 0 components in path = no file specified */
-
-	p_dir = resolve_path(sb.root_inode, path, n - 1);
-
-	return p_dir;
+	/* NULL if 0 components in path = no file specified */
+	return walk(sb.root_inode, path, PATH_RESOLVE_ALL, buf);
 }
 
 
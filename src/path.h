@@ -7,6 +7,17 @@
 
 #define PATH_RESOLVE_ALL -1	/* used by path_resolve to resolve entire path */
 
+/**
+ * Where an iteration over the components of a path has got to.
+ */
+struct path_iter {
+	const char *next;	/* start of the rest of the path */
+};
+
+void path_iter_init(struct path_iter *it, const char *path);
+int path_next(struct path_iter *it, char *buf);
+int path_at_end(struct path_iter *it);
+
 int path_get_last_cmpo(const char *path, char *buf);
 int path_cnt_cmpos(const char *path);
 struct minix_inode *resolve_path(struct minix_inode *inode, const char *path, int n);
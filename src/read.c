@@ -1,18 +1,24 @@
 #include <stdlib.h>		/* size_t & off_t type defs */
 #include <string.h>		/* memcpy def */
+#include <pthread.h>
 #include "types.h"
 #include "const.h"
 #include "cache.h"
 #include "inode.h"
 #include "comms.h"
 #include "read.h"
+#include "dcache.h"
+#include "dir_index.h"
+#include "delalloc.h"
 
 /**
  * Looks for entry 'file' in the given directory contents. The inode is 
  * assumed to be of directory type.
  *
  * If the file is found it's inode number is returned, otherwise NO_INODE is
- * returned.
+ * returned. The dentry cache is tried first and told what the search found,
+ * found or not. Large directories are searched with their index rather than
+ * scanned.
  */
 inode_nr dir_search(struct minix_inode *inode, const char *file)
 {
@@ -21,6 +27,17 @@ inode_nr dir_search(struct minix_inode *inode, const char *file)
 	int c_pos = 0;		/* current position in scan of directory */
 	int i;			/* current position in directory block */
 	inode_nr retval;
+	struct dir_index *ix;
+
+	if(dcache_lookup(inode->i_num, file, &retval))
+		return retval;
+
+	if((ix = dir_index_get(inode)) != NULL) {
+		if(dir_index_find(inode, ix, file, &retval) < 0)
+			retval = NO_INODE;
+		dcache_enter(inode->i_num, file, retval);
+		return retval;
+	}
 
 	debug("dir_search(%d, \"%s\"): searching...", inode->i_num,
 		file);
@@ -28,9 +45,11 @@ inode_nr dir_search(struct minix_inode *inode, const char *file)
 		blk = get_block(z, TRUE);
 		/* TODO: fix bug. shouldn't use BLOCK_SIZE */
 		for(i = 0; i < BLOCK_SIZE; i+= DENTRY_SIZE) {
-			if(strcmp((char *)(blk->blk_data + i + 2), file) == 0) {
-				retval = *((inode_nr *)(blk->blk_data + i));
+			retval = *((inode_nr *)(blk->blk_data + i));
+			if(retval != NO_INODE && 
+				strcmp((char *)(blk->blk_data + i + 2), file) == 0) {
 				put_block(blk, DIR_BLOCK);
+				dcache_enter(inode->i_num, file, retval);
 				debug("dir_search(): found \"%s\" at ix=%d", 
 					file, i);
 				return retval;
@@ -43,17 +62,210 @@ inode_nr dir_search(struct minix_inode *inode, const char *file)
 	/* couldn't find directory entry */
 	debug("dir_search(%d, \"%s\"): couldn't find entry", inode->i_num, 
 		file);
+	dcache_enter(inode->i_num, file, NO_INODE);
 	return NO_INODE;
 }
 
+int dir_empty(struct minix_inode *dir)
+{
+	struct minix_block *blk;
+	zone_nr z;
+	int pos, i;
+	char *name;
+
+	for(pos = 0; pos < dir->i_size &&
+		(z = read_map(dir, pos)) != NO_ZONE; pos += BLOCK_SIZE) {
+		blk = get_block(z, TRUE);
+		for(i = 0; i < BLOCK_SIZE && pos + i < dir->i_size;
+			i += DENTRY_SIZE) {
+			if(*(inode_nr *) (blk->blk_data + i) == NO_INODE)
+				continue;
+			name = blk->blk_data + i + 2;
+			if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+				put_block(blk, DIR_BLOCK);
+				return FALSE;
+			}
+		}
+		put_block(blk, DIR_BLOCK);
+	}
+	return TRUE;
+}
+
+void read_dir(struct minix_inode *dir, off_t offset, dir_filler fill, 
+	void *arg)
+{
+	struct minix_block *blks[READDIR_BATCH];
+	zone_nr zones[READDIR_BATCH];
+	inode_nr i_nums[READDIR_BATCH * DENTRIES_PER_BLOCK];
+	char name[FILENAME_SIZE + 1];
+	struct minix_inode *inode;
+	int first, nr_blks, slot, e, run, stop = FALSE;
+
+	first = offset / BLOCK_SIZE;
+	slot = offset % BLOCK_SIZE / DENTRY_SIZE;
+	name[FILENAME_SIZE] = '\0';
+
+	while(!stop) {
+		for(nr_blks = 0; nr_blks < READDIR_BATCH; nr_blks++) {
+			zones[nr_blks] = read_map(dir, 
+				(first + nr_blks) * BLOCK_SIZE);
+			if(zones[nr_blks] == NO_ZONE)
+				break;
+		}
+		if(nr_blks == 0)
+			break;
+
+		/* each run of the batch's blocks in one read */
+		for(e = 0; e < nr_blks; e = run) {
+			for(run = e + 1; run < nr_blks && 
+				zones[run] == zones[run - 1] + 1; run++)
+				;
+			if(run - e > 1)
+				cache_readahead(zones[e], run - e);
+		}
+		for(e = 0; e < nr_blks; e++)
+			blks[e] = get_block(zones[e], TRUE);
+
+		/* the inode table blocks for the whole batch, in as few reads
+		 * as they allow */
+		for(e = slot; e < nr_blks * DENTRIES_PER_BLOCK; e++)
+			i_nums[e - slot] = *(inode_nr *) (blks[e / 
+				DENTRIES_PER_BLOCK]->blk_data + 
+				e % DENTRIES_PER_BLOCK * DENTRY_SIZE);
+		prefetch_inodes(i_nums, nr_blks * DENTRIES_PER_BLOCK - slot);
+
+		for(e = slot; !stop && e < nr_blks * DENTRIES_PER_BLOCK; e++) {
+			if(i_nums[e - slot] == NO_INODE)
+				continue;
+			strncpy(name, blks[e / DENTRIES_PER_BLOCK]->blk_data +
+				e % DENTRIES_PER_BLOCK * DENTRY_SIZE + 2,
+				FILENAME_SIZE);
+			/* a later lookup of the name needn't search for it */
+			dcache_enter(dir->i_num, name, i_nums[e - slot]);
+
+			inode = get_inode(i_nums[e - slot]);
+			stop = fill(arg, name, inode, (off_t) first * 
+				BLOCK_SIZE + (e + 1) * DENTRY_SIZE);
+			put_inode(inode);
+		}
+
+		while(nr_blks > 0)
+			put_block(blks[--nr_blks], DIR_BLOCK);
+		first += READDIR_BATCH;
+		slot = 0;
+	}
+}
+
+/**
+ * Sets up readahead state for a newly opened file. At most 'max' blocks are
+ * read ahead at a time, none if max <= 0.
+ */
+void ra_init(struct readahead *ra, int max)
+{
+	pthread_mutex_init(&ra->lock, NULL);
+	ra->next = 0;
+	ra->window = 0;
+	ra->ahead = 0;
+	ra->max = max;
+}
+
+/**
+ * Frees what ra_init() set up, once the file is closed.
+ */
+void ra_destroy(struct readahead *ra)
+{
+	pthread_mutex_destroy(&ra->lock);
+}
+
+/**
+ * Reads file blocks first to first + n - 1 of inode into the cache. Each run
+ * of them that is contiguous on disk is read with a single read.
+ */
+static void prefetch(struct minix_inode *inode, int first, int n)
+{
+	zone_nr z, run_start = NO_ZONE;
+	int run_len = 0, i;
+
+	for(i = first; i < first + n; i++) {
+		z = read_map(inode, i * BLOCK_SIZE);
+		if(run_len > 0 && z == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if(run_len > 0)
+			cache_readahead(run_start, run_len);
+		run_start = z;
+		run_len = z == NO_ZONE ? 0 : 1;
+	}
+	if(run_len > 0)
+		cache_readahead(run_start, run_len);
+}
+
+/**
+ * Called by minix_read() before reading 'size' bytes at 'offset'. If the read
+ * carries on from where the last one finished the blocks after it are read
+ * ahead. The window starts at RA_MIN blocks and is topped up, doubled, each
+ * time the reader gets within half a window of its end, up to ra->max.
+ * Anything other than a sequential read ends the run.
+ */
+static void readahead(struct minix_inode *inode, struct readahead *ra,
+	off_t offset, size_t size)
+{
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	int end = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start, ahead;
+
+	if(ra->max <= 0 || size == 0)
+		return;
+
+	/* the window is moved under the lock, but the blocks are read after
+	 * it is dropped so that other reads of the file don't wait on them */
+	pthread_mutex_lock(&ra->lock);
+	if(offset != ra->next) {
+		/* not sequential. forget the run */
+		ra->next = offset + size;
+		ra->window = 0;
+		pthread_mutex_unlock(&ra->lock);
+		return;
+	}
+	ra->next = offset + size;
+
+	if(ra->window == 0) {
+		/* start of a run. read this request and the window after it
+		 * in one go */
+		ra->window = MIN(RA_MIN, ra->max);
+		start = first;
+	}
+	else if(ra->ahead - (last + 1) >= ra->window / 2) {
+		pthread_mutex_unlock(&ra->lock);
+		return;		/* still plenty read ahead */
+	}
+	else {
+		ra->window = MIN(ra->window * 2, ra->max);
+		start = MAX(ra->ahead, first);
+	}
+
+	ra->ahead = MIN(last + 1 + ra->window, end);
+	ahead = ra->ahead;
+	pthread_mutex_unlock(&ra->lock);
+
+	if(ahead > start)
+		prefetch(inode, start, ahead - start);
+}
+
 /**
  * Reads 'size' bytes starting at 'offset' from the data of the given inode.
  * 
  * If successful buf[0] -> buf[size-1] will contain bytes read.
  *
+ * ra is the readahead state of the open file being read from, or NULL for no
+ * readahead.
+ *
  * Returns the number of bytes successfully read.
  */
-int minix_read(struct minix_inode *inode, char *buf, size_t size, off_t offset)
+int minix_read(struct minix_inode *inode, char *buf, size_t size, off_t offset,
+	struct readahead *ra)
 {
 	int sbytes = 0;		/* bytes read so far */
 	int nbytes = size;	/* bytes remaining to be read */
@@ -63,43 +275,161 @@ int minix_read(struct minix_inode *inode, char *buf, size_t size, off_t offset)
 	zone_nr z_data = 0;	/* the zone # on disk that holds c_pos */
 	int z_offset = 0;	/* c_pos's offset in this zone */
 	int chunk = 0;		/* # bytes we're reading from this zone */
+	int run, want, i;
+	char *pending;		/* data of a block held back */
+
+	struct minix_block *blks[MAX_RUN];	/* run of blocks we're reading */
 
-	struct minix_block *blk;	/* current block we're reading */
+	/* can't possibly read more than the file has to offer from offset */
+	if(offset >= inode->i_size)
+		return 0;
+	if(nbytes > inode->i_size - offset)
+		nbytes = inode->i_size - offset;
 
-	/* can't possibly read more than the file has to offer */
-	if(nbytes > inode->i_size)
-		nbytes = inode->i_size;
+	if(ra != NULL)
+		readahead(inode, ra, offset, nbytes);
 
 	while(nbytes > 0) {
 		z = c_pos / BLOCK_SIZE;
 		z_offset = c_pos % BLOCK_SIZE;
-		chunk = MIN(nbytes, (BLOCK_SIZE - z_offset));
 
-		/* if we try to read past file end then stop and just return
-		 * bytes read so far. */
-		if((z_data = read_map(inode, z * BLOCK_SIZE)) == NO_ZONE)
-			return sbytes;
+		/* a block with no zone may be being held back, see 
+		 * delalloc.h. otherwise it's a hole, which reads as zeros. */
+		if((z_data = read_map(inode, z * BLOCK_SIZE)) == NO_ZONE) {
+			chunk = MIN(nbytes, (BLOCK_SIZE - z_offset));
+			if((pending = delalloc_find(inode, z)) != NULL)
+				memcpy(buf + sbytes, pending + z_offset, chunk);
+			else
+				memset(buf + sbytes, 0, chunk);
+			sbytes += chunk;
+			nbytes -= chunk;
+			c_pos += chunk;
+			continue;
+		}
 
-		blk = get_block(z_data, TRUE);
+		/* take as many of the zones still to be read as follow on
+		 * from z_data on disk, and get them all at once. */
+		want = MIN((z_offset + nbytes + BLOCK_SIZE - 1) / BLOCK_SIZE,
+			MAX_RUN);
+		for(run = 1; run < want; run++)
+			if(read_map(inode, (z + run) * BLOCK_SIZE) != 
+				z_data + run)
+				break;
+		get_blocks(z_data, run, TRUE, blks);
 
-		/* copy the required contents (chunk bytes) of the block to 
- 		 * correct position in user buffer. */
-		memcpy(buf + sbytes, blk->blk_data + z_offset, chunk);
+		for(i = 0; i < run; i++) {
+			chunk = MIN(nbytes, (BLOCK_SIZE - z_offset));
 
-		put_block(blk, DATA_BLOCK);
+			/* copy the required contents (chunk bytes) of the 
+			 * block to correct position in user buffer. */
+			memcpy(buf + sbytes, blks[i]->blk_data + z_offset, 
+				chunk);
+			put_block(blks[i], DATA_BLOCK);
 
-		sbytes += chunk;	/* ++ bytes read so far */
-		nbytes -= chunk;	/* -- bytes left to read */
-		c_pos += chunk;		/* ++ current position in file data */
+			sbytes += chunk;	/* ++ bytes read so far */
+			nbytes -= chunk;	/* -- bytes left to read */
+			c_pos += chunk;		/* ++ current position */
+			z_offset = 0;
+		}
 	}
 
 	/* return the number of bytes we managed to read */
 	return sbytes;
 }
 
+/* protects the extents of every inode. read_map() runs under the shared 
+ * fs_lock from concurrent reads. */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Looks for file zone 'rel_z' in the extents cached for 'inode'. Returns the 
+ * disk zone, or NO_ZONE if no extent covers it.
+ */
+static zone_nr map_cache_find(struct minix_inode *inode, int rel_z)
+{
+	struct zone_extent *e;
+	zone_nr z = NO_ZONE;
+
+	pthread_mutex_lock(&map_lock);
+	for(e = inode->i_ext; e < &inode->i_ext[INODE_EXTENTS]; e++) {
+		if(rel_z >= e->e_start && rel_z < e->e_start + e->e_len) {
+			z = e->e_zone + (rel_z - e->e_start);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&map_lock);
+	return z;
+}
+
+/**
+ * Caches the run of zones around entry 'ix' of the indirect block 'map', 
+ * whose first entry maps file zone 'base'. The run is as long as the zones 
+ * follow on from each other on disk, within this indirect block.
+ */
+static void map_cache_fill(struct minix_inode *inode, int base, zone_nr *map,
+	int ix)
+{
+	struct zone_extent *e;
+	int lo = ix, hi = ix + 1;
+
+	while(lo > 0 && map[lo - 1] != NO_ZONE && map[lo - 1] + 1 == map[lo])
+		lo--;
+	while(hi < NR_INDIRECTS && map[hi] != NO_ZONE && 
+		map[hi] == map[hi - 1] + 1)
+		hi++;
+
+	pthread_mutex_lock(&map_lock);
+	e = &inode->i_ext[inode->i_ext_next];
+	inode->i_ext_next = (inode->i_ext_next + 1) % INODE_EXTENTS;
+	e->e_start = base + lo;
+	e->e_len = hi - lo;
+	e->e_zone = map[lo];
+	pthread_mutex_unlock(&map_lock);
+}
+
+void map_cache_update(struct minix_inode *inode, int rel_z, zone_nr z)
+{
+	struct zone_extent *e, *tail = NULL;
+
+	if(rel_z < NR_DZONE_NUM)
+		return;		/* direct zones are never cached */
+
+	pthread_mutex_lock(&map_lock);
+	for(e = inode->i_ext; e < &inode->i_ext[INODE_EXTENTS]; e++) {
+		if(e->e_len == 0)
+			continue;
+		if(rel_z >= e->e_start && rel_z < e->e_start + e->e_len &&
+			e->e_zone + (rel_z - e->e_start) != z) {
+			/* keep what comes before rel_z */
+			e->e_len = rel_z - e->e_start;
+		}
+		else if(rel_z == e->e_start + e->e_len && z != NO_ZONE &&
+			z == (zone_nr) (e->e_zone + e->e_len))
+			tail = e;
+	}
+
+	/* a file being written in order keeps growing the one extent */
+	if(tail != NULL)
+		tail->e_len++;
+	pthread_mutex_unlock(&map_lock);
+}
+
+void map_cache_clear(struct minix_inode *inode)
+{
+	pthread_mutex_lock(&map_lock);
+	memset(inode->i_ext, 0, sizeof(inode->i_ext));
+	inode->i_ext_next = 0;
+	pthread_mutex_unlock(&map_lock);
+}
+
 /*
  * Given an inode and a byte offset in a file this function returns the 
  * zone number on disk of the zone holding data at that offset.
+ *
+ * Zones past the direct ones are first looked for in the extents cached for
+ * the inode. Failing that the indirect block is read and the run of zones
+ * around the one wanted is cached, so that reading through a file reads
+ * each indirect block once per run rather than once per zone.
  */
 zone_nr read_map(struct minix_inode *inode, int byte_offset)
 {
@@ -114,6 +444,9 @@ zone_nr read_map(struct minix_inode *inode, int byte_offset)
 			return NO_ZONE;	
 		return z;
 	}		
+
+	if((z = map_cache_find(inode, rel_z)) != NO_ZONE)
+		return z;
 		
 	excess = rel_z - NR_DZONE_NUM;
 	if(excess < NR_INDIRECTS) {
@@ -143,8 +476,10 @@ zone_nr read_map(struct minix_inode *inode, int byte_offset)
 	if(z == NO_ZONE) return NO_ZONE;	/* no data at byte_offset */
 	blk = get_block(z, TRUE);		/* load indirect mappings */
 	z = ((u16 *)blk->blk_data)[excess];	/* z now points to data zone */
+	if(z != NO_ZONE)
+		map_cache_fill(inode, rel_z - excess, (zone_nr *) blk->blk_data,
+			excess);
 	put_block(blk, INDIRECT_BLOCK);
 
 	return z;				/* could be NO_ZONE */
 }
-
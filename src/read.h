@@ -1,7 +1,54 @@
 #include <stdlib.h>
+#include <pthread.h>
 #include "types.h"
 #include "inode.h"
 
+/**
+ * Readahead state kept for each open file by the caller of minix_read(). Reads
+ * of the same open file can run at once under the shared fs lock, so it has a
+ * lock of its own.
+ */
+struct readahead {
+	pthread_mutex_t lock;
+	off_t next;		/* where the next read starts if sequential */
+	int window;		/* blocks read ahead last time. 0 if not in a
+				 * sequential run */
+	int ahead;		/* file block after the last one read ahead */
+	int max;		/* most blocks to read ahead. <= 0 for none */
+};
+
 inode_nr dir_search(struct minix_inode *inode, const char *file);
-int minix_read(struct minix_inode *inode, char *buf, size_t size, off_t offset);
+
+/**
+ * Returns TRUE if the directory has no entries but . and ..
+ */
+int dir_empty(struct minix_inode *dir);
+
+/**
+ * Called by read_dir() with each entry and its inode. 'next' is the offset to
+ * carry on from after it. Returns non-zero to stop there.
+ */
+typedef int (*dir_filler)(void *arg, const char *name, 
+	struct minix_inode *inode, off_t next);
+
+/**
+ * Lists the directory's entries from 'offset', which is 0 or a 'next' given
+ * to 'fill', until 'fill' stops it or there are none left. The entries' 
+ * inodes are read READDIR_BATCH directory blocks' worth at a time, and their
+ * names are entered in the dentry cache.
+ */
+void read_dir(struct minix_inode *dir, off_t offset, dir_filler fill, 
+	void *arg);
+void ra_init(struct readahead *ra, int max);
+void ra_destroy(struct readahead *ra);
+int minix_read(struct minix_inode *inode, char *buf, size_t size, off_t offset,
+	struct readahead *ra);
 zone_nr read_map(struct minix_inode *inode, int byte_offset);
+
+/**
+ * Keep the extents read_map() caches in step with the zone map. 
+ * map_cache_update() is told that file zone 'rel_z' now maps to disk zone 'z'
+ * (NO_ZONE if freed) and map_cache_clear() forgets every extent of the inode.
+ */
+void map_cache_update(struct minix_inode *inode, int rel_z, zone_nr z);
+void map_cache_clear(struct minix_inode *inode);
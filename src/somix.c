@@ -4,8 +4,10 @@
 #include <fuse_opt.h>
 #include <fuse_lowlevel.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <linux/falloc.h>
 #include "const.h"
 #include "types.h"
 #include "superblock.h"
@@ -16,76 +18,147 @@
 #include "write.h"
 #include "cache.h"
 #include "mount.h"
+#include "dir_index.h"
+#include "delalloc.h"
+#include "orphan.h"
 
 extern struct minix_super_block sb;
 
 /* for command line options */
 static struct options {
 	char *device_name;
+	struct cache_opts cache;
+	int readahead;		/* most blocks to read ahead. 0 for RA_MAX */
+	char *write_mode;	/* "cached" (default) or "direct" */
+	int write_direct;	/* whole blocks bypass the cache */
+	int dir_index;		/* entries before a directory is indexed. 0
+				 * for DIR_INDEX_MIN */
+	int delalloc;		/* hold back blocks with no zone yet */
+	int resv_zones;		/* zones set aside for a file being written.
+				 * 0 for RESV_ZONES, < 0 for none */
+	int sync_delete;	/* free unlinked files before returning rather
+				 * than in the background */
 } options;
 
 static struct fuse_opt options_desc[] =
 {
-	{"-dev=%s", offsetof(struct options, device_name), 0}
+	{"-dev=%s", offsetof(struct options, device_name), 0},
+	{"-cache_mb=%d", offsetof(struct options, cache.cache_mb), 0},
+	{"-cache_policy=%s", offsetof(struct options, cache.policy), 0},
+	{"-cache_io=%s", offsetof(struct options, cache.io), 0},
+	{"-cache_trace=%s", offsetof(struct options, cache.trace_file), 0},
+	{"-dirty_bg=%d", offsetof(struct options, cache.dirty_bg), 0},
+	{"-dirty_max=%d", offsetof(struct options, cache.dirty_max), 0},
+	{"-dirty_expire=%d", offsetof(struct options, cache.dirty_expire), 0},
+	{"-flush_interval=%d", offsetof(struct options, cache.flush_interval), 0},
+	{"-readahead=%d", offsetof(struct options, readahead), 0},
+	{"-write_mode=%s", offsetof(struct options, write_mode), 0},
+	{"-dir_index=%d", offsetof(struct options, dir_index), 0},
+	{"-delalloc", offsetof(struct options, delalloc), 1},
+	{"-resv_zones=%d", offsetof(struct options, resv_zones), 0},
+	{"-sync_delete", offsetof(struct options, sync_delete), 1},
+	FUSE_OPT_END
 };
 
+/**
+ * What fi->fh points to for every open file and directory.
+ */
+struct open_file {
+	struct minix_inode *inode;
+	struct readahead ra;		/* not used for directories */
+};
+
+#define OPEN_FILE(fi) ((struct open_file *) (unsigned long) (fi)->fh)
+
+static struct open_file *open_file_new(struct minix_inode *inode)
+{
+	struct open_file *of;
+
+	if((of = malloc(sizeof(struct open_file))) == NULL)
+		panic("open_file_new(): unable to allocate open file");
+	of->inode = inode;
+	ra_init(&of->ra, options.readahead == 0 ? RA_MAX : options.readahead);
+	return of;
+}
+
+/**
+ * Closes an open file or directory.
+ */
+static int open_file_release(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+
+	if(of == NULL) {
+		debug("release(\"%s\", ...): cannot release. "
+			"file does not appear to be open", path);
+		return -1;
+	}
+
+	fs_lock_excl();
+	put_inode(of->inode);
+	fs_unlock();
+
+	ra_destroy(&of->ra);
+	free(of);
+	fi->fh = 0;
+	return 0;
+}
+
 static int somix_getattr(const char *path, struct stat *stbuf)
 {
 	int res = 0;
 	struct minix_inode *inode;
 
 	debug("getattr(\"%s\", ...)", path);
-	memset(stbuf, 0, sizeof(struct stat));
 
-
-	
+	fs_lock_shared();
 	inode = resolve_path(sb.root_inode, path, PATH_RESOLVE_ALL);
 	if(inode == NULL) {
+		fs_unlock();
 		debug("getattr(\"%s\", ...): cannot find item", path);
 		return -ENOENT;
 	}
 	debug("filling in and returning...");
 	debug("mode=%d nlink=%d size=%d...", inode->i_mode, inode->i_nlinks, inode->i_size);
-	stbuf->st_mode = inode->i_mode;
-	stbuf->st_nlink = inode->i_nlinks;
-	stbuf->st_size = inode->i_size;
-	stbuf->st_uid = inode->i_uid;
-	stbuf->st_gid = inode->i_gid;
-	stbuf->st_atime = inode->i_time;
-	stbuf->st_mtime = inode->i_time;
-	stbuf->st_ctime = inode->i_time;
-	
+	stat_inode(inode, stbuf);
 	put_inode(inode);
+	fs_unlock();
 	return res;
 }
 
+/**
+ * Where somix_readdir() is filling.
+ */
+struct readdir_buf {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(void *arg, const char *name, struct minix_inode *inode,
+	off_t next)
+{
+	struct readdir_buf *rb = arg;
+	struct stat st;
+
+	debug("readdir_fill(): adding \"%s\" to filler", name);
+	stat_inode(inode, &st);
+	return rb->filler(rb->buf, name, &st, next);
+}
+
+/**
+ * Lists the directory from 'offset', passing the offset of the next entry
+ * with each so that a big directory can be listed over several calls, and
+ * the entry's attributes.
+ */
 static int somix_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi)
 {
-	struct minix_inode *d_inode;	/* the directory we want to read */
-	struct minix_block *blk;	/* to hold directory contents */
-	zone_nr	z;			/* current zone of directory we're on */
-	int c_pos = 0;			/* current position in directory */
-	int i;				/* current position in directory block */
-
-	d_inode = (struct minix_inode *) fi->fh;
-
-	inode_nr *i_num;
-	debug("readdir(\"%s\", ...):", path);
-	while((z = read_map(d_inode, c_pos)) != 0) {
-		blk = get_block(z, TRUE);
-		for(i = 0; i < BLOCK_SIZE; i += DENTRY_SIZE) {
-			i_num = (inode_nr *) (blk->blk_data + i);
-			if(*i_num == NO_INODE) 
-				continue;	/* ignore these entries */
-			debug("somix_readdir(): adding \"%s\" to filler", 
-				blk->blk_data+i+2);
-			filler(buf, blk->blk_data + i + 2, NULL, 0);
-			/* ignoring inode for the moment */
-		}
-		put_block(blk, DIR_BLOCK);
-		c_pos += BLOCK_SIZE;
-	}
+	struct readdir_buf rb = { buf, filler };
+
+	debug("readdir(\"%s\", %lld):", path, (long long) offset);
+	fs_lock_shared();
+	read_dir(OPEN_FILE(fi)->inode, offset, readdir_fill, &rb);
+	fs_unlock();
 
 	debug("readdir(): finished");
 	return 0;
@@ -95,39 +168,31 @@ static int somix_open(const char *path, struct fuse_file_info *fi)
 {
 	struct minix_inode *inode;
 	debug("open(\"%s\")", path);
-	if((struct minix_inode *)fi->fh != NULL)
+	if(OPEN_FILE(fi) != NULL)
 		panic("strange");
-	if((inode = resolve_path(sb.root_inode, path, 
-		PATH_RESOLVE_ALL)) == NULL) {
+	fs_lock_shared();
+	inode = resolve_path(sb.root_inode, path, PATH_RESOLVE_ALL);
+	fs_unlock();
+	if(inode == NULL)
 		return -ENOENT;
-	}
 
-	/* set file handle to point to inode */
-	fi->fh = (unsigned long) inode;
+	/* set file handle to point to inode and readahead state */
+	fi->fh = (unsigned long) open_file_new(inode);
 	return 0;
 }
 
 int somix_release(const char *path, struct fuse_file_info *fi)
 {
-	struct minix_inode *inode = (struct minix_inode *) fi->fh;
-
 	debug("release(\"%s\")", path);
-
-	if(inode == NULL) {
-		debug("release(\"%s\", ...): cannot release. "
-			"file does not appear to be open", path);
-		return -1;
-	}
-
-	put_inode(inode);
-
-	return 0;
+	return open_file_release(path, fi);
 }
 
 static int somix_read(const char *path, char *buf, size_t size, off_t offset,
 	struct fuse_file_info *fi)
 {
-	struct minix_inode *inode = (struct minix_inode *) fi->fh;
+	struct open_file *of = OPEN_FILE(fi);
+	struct minix_inode *inode = of != NULL ? of->inode : NULL;
+	int ret;
 	
 	debug("somix_read(): reading bytes %d -> %d from file \"%s\"...",
 		(int) offset, (int) (offset + size), path);
@@ -140,13 +205,18 @@ static int somix_read(const char *path, char *buf, size_t size, off_t offset,
 		
 	debug("read(\"%s\", ...): inode(%d) open", path, inode->i_num);
 
-	return minix_read(inode, buf, size, offset);
+	fs_lock_shared();
+	ret = minix_read(inode, buf, size, offset, &of->ra);
+	fs_unlock();
+	return ret;
 }
 
 static int somix_write(const char *path, const char *buf, size_t size, 
 	off_t offset, struct fuse_file_info *fi)
 {
-	struct minix_inode *inode = (struct minix_inode *) fi->fh;
+	struct open_file *of = OPEN_FILE(fi);
+	struct minix_inode *inode = of != NULL ? of->inode : NULL;
+	int ret;
 
 	debug("somix_write(): writing bytes %d -> %d of file \"%s\"...",
 		(int) offset, (int) (offset + size), path);
@@ -156,7 +226,30 @@ static int somix_write(const char *path, const char *buf, size_t size,
 	debug("write(\"%s\", %p, %d, %d, %d): writing...",
 		path, buf, (int) size, (int) offset, inode->i_num);
 
-	return write_buf(inode, buf, size, offset);
+	fs_lock_excl();
+	ret = write_buf(inode, buf, size, offset, options.write_direct);
+	fs_unlock();
+	return ret;
+}
+
+static int somix_fallocate(const char *path, int mode, off_t offset, 
+	off_t length, struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+	int ret;
+
+	debug("fallocate(\"%s\", %d, %lld, %lld):", path, mode, 
+		(long long) offset, (long long) length);
+	if(of == NULL)
+		return -EBADF;
+	if(mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;	/* no holes punched */
+
+	fs_lock_excl();
+	ret = preallocate(of->inode, offset, length, 
+		(mode & FALLOC_FL_KEEP_SIZE) != 0);
+	fs_unlock();
+	return ret;
 }
 
 
@@ -164,15 +257,15 @@ int somix_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	debug("create(\"%s\", ...):", path);
 
-	int n = path_cnt_cmpos(path);
 	struct minix_inode *p_dir;
 	struct minix_inode *new_i;
 	char filename[FILENAME_SIZE];
 
-	if(path_get_last_cmpo(path, filename) == 0) 
-		return -1;	/* 0 components in path = no file specified */
-
-	p_dir = resolve_path(sb.root_inode, path, n - 1);
+	fs_lock_excl();
+	if((p_dir = last_dir(path, filename)) == NULL) {
+		fs_unlock();
+		return -ENOENT;
+	}
 
 	debug("create(\"%s\", ...): attempting to insert \"%s\" into "
 		"directory %d...", path, filename, p_dir->i_num); 
@@ -184,8 +277,9 @@ int somix_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  	 * inode we give it (sb.root_inode) if we resolve the path /
  	 */
 	put_inode(p_dir);
+	fs_unlock();
 
-	fi->fh = (unsigned long) new_i;
+	fi->fh = (unsigned long) open_file_new(new_i);
 	debug("create(...): complete");
 	return 0;
 }
@@ -194,33 +288,44 @@ void somix_destroy(void * v)
 {
 	/* flush everything */
 	debug("somix_destroy(): unmounting...");
+	reclaimer_stop();	/* it takes fs_lock */
+	cache_set_flush_hook(NULL);	/* so does the flusher's */
+	fs_lock_excl();
 	minix_unmount();
+	fs_unlock();
 	debug("somix_destory(): finished");
 }
 
 static int somix_truncate(const char *path, off_t offset)
 {
 	struct minix_inode *i;
+	int ret;
 	debug("somix_truncate(): truncating \"%s\" to %d bytes...", path, 
 		(int) offset);
 
+	fs_lock_excl();
 	i = resolve_path(sb.root_inode, path, PATH_RESOLVE_ALL);
 	if(i == NULL)
 		panic("truncate(\"%s\", %d): cannot resolve path",
 			path, (int) offset);
 
-	truncate(i);
+	ret = truncate_to(i, offset);
 
 	put_inode(i);
+	fs_unlock();
 
-	return 0;
+	return ret;
 }
 
 static int somix_unlink(const char *path)
 {
+	int ret;
 	debug("somix_unlink(\"%s\")", path);
 
-	if(!unlink(path))
+	fs_lock_excl();
+	ret = unlink(path);
+	fs_unlock();
+	if(!ret)
 		return -EIO;	/* TODO: return correct error */
 
 	debug("somix_unlink(\"%s\"): complete", path);
@@ -237,8 +342,10 @@ static int somix_mkdir(const char *path, mode_t mode)
 	debug("somix_mkdir(\"%s\", %d): creating directory...", path, mode);
 	mode += S_IFDIR;
 
+	fs_lock_excl();
 	i = last_dir(path, filename);
 	if(i == NULL) {
+		fs_unlock();
 		debug("somix_mkdir(\"%s\", ...): connot find parent directory",
 			path);
 		return -ENOENT;
@@ -248,15 +355,20 @@ static int somix_mkdir(const char *path, mode_t mode)
 
 	put_inode(i);
 	put_inode(new_i);
+	fs_unlock();
 	debug("somix_mkdir(): complete");
 	return 0;
 }
 
 static int somix_rmdir(const char *path)
 {
+	int ret;
 	debug("somix_rmdir(): removing directory \"%s\"...", path);
 
-	if(!unlink(path))
+	fs_lock_excl();
+	ret = unlink(path);
+	fs_unlock();
+	if(!ret)
 		return -EIO;	/* TODO: return correct error */
 
 	debug("somix_rmdir(\"%s\"): complete", path);
@@ -268,7 +380,10 @@ static int somix_rename(const char *old_path, const char *new_path)
 	int ret;
 	debug("somix_rename(): renaming \"%s\" to \"%s\"...", old_path, new_path);
 
-	if((ret = rename(old_path, new_path)) != 1)
+	fs_lock_excl();
+	ret = rename(old_path, new_path);
+	fs_unlock();
+	if(ret != 1)
 		return ret;
 
 	return 0;
@@ -276,20 +391,8 @@ static int somix_rename(const char *old_path, const char *new_path)
 
 static int somix_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	struct minix_inode *inode = (struct minix_inode *) fi->fh;
-
 	debug("somix_releasedir(): releasing directory \"%s\"...", path);
-
-	if(inode == NULL) {
-		debug("release(\"%s\", ...): cannot release. "
-			"file does not appear to be open", path);
-		return -1;
-	}
-
-	put_inode(inode);
-
-
-	return 0;
+	return open_file_release(path, fi);
 }
 
 static int somix_statfs(const char *path, struct statvfs *svfs)
@@ -312,6 +415,7 @@ static struct fuse_operations somix_oper = {
 	.create		= somix_create,
 	.destroy	= somix_destroy,
 	.write		= somix_write,
+	.fallocate	= somix_fallocate,
 	.truncate	= somix_truncate,
 	.unlink		= somix_unlink,
 	.mkdir		= somix_mkdir,
@@ -343,9 +447,25 @@ int main(int argc, char *argv[])
 	/* parse the command line options */
 	if(fuse_opt_parse(&args, &options, options_desc, NULL) == -1)
 		return -1;
-	
-	minix_mount(options.device_name);
 
+	if(options.write_mode != NULL &&
+		strcmp(options.write_mode, "direct") == 0)
+		options.write_direct = TRUE;
+	else if(options.write_mode != NULL &&
+		strcmp(options.write_mode, "cached") != 0)
+		panic("main(): unknown write mode \"%s\"", options.write_mode);
+	dir_index_set_min(options.dir_index);
+	delalloc_set(options.delalloc);
+	resv_set_zones(options.resv_zones);
+	
+	minix_mount(options.device_name, &options.cache);
+	if(!options.sync_delete)
+		reclaimer_start();
+	cache_set_flush_hook(flush_delalloc_expired);
+
+	/* fuse_main runs its multi-threaded loop unless -s is given. the
+	 * buffer cache is sharded and locked and the operations above take
+	 * fs_lock so this is safe. */
 	ret = fuse_main(args.argc, args.argv, &somix_oper, NULL);
 
 	fuse_opt_free_args(&args);
@@ -0,0 +1,605 @@
+/**
+ * Somix on FUSE's low level interface.
+ *
+ * somix.c is given a path with every request and has to resolve it from the
+ * root each time. Here the kernel is given inode numbers instead, which it
+ * hands back with each request on that file, so nothing but lookup() ever
+ * looks a name up. Minix's root inode is 1, the same as FUSE_ROOT_ID, so the
+ * numbers are used as they are.
+ *
+ * Each time the kernel is told of an inode, by lookup(), mkdir() or
+ * create(), the inode is got from the inode cache and the reference kept
+ * until the kernel forgets it. The inode stays cached for as long as the
+ * kernel knows it, and get_inode() on its number is only a hash lookup. An
+ * unlinked file the kernel still knows is only freed once it is forgotten.
+ */
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/falloc.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "comms.h"
+#include "read.h"
+#include "write.h"
+#include "cache.h"
+#include "mount.h"
+#include "bitmap.h"
+#include "extent_tree.h"
+#include "dir_index.h"
+#include "delalloc.h"
+#include "orphan.h"
+
+#define ATTR_TIMEOUT 1.0	/* secs the kernel may cache attributes */
+#define ENTRY_TIMEOUT 1.0	/* secs the kernel may cache a lookup */
+
+extern struct minix_super_block sb;
+
+/* for command line options. see somix.c */
+static struct options {
+	char *device_name;
+	struct cache_opts cache;
+	int readahead;
+	char *write_mode;
+	int write_direct;
+	int dir_index;
+	int delalloc;
+	int resv_zones;
+	int sync_delete;
+} options;
+
+static struct fuse_opt options_desc[] =
+{
+	{"-dev=%s", offsetof(struct options, device_name), 0},
+	{"-cache_mb=%d", offsetof(struct options, cache.cache_mb), 0},
+	{"-cache_policy=%s", offsetof(struct options, cache.policy), 0},
+	{"-cache_io=%s", offsetof(struct options, cache.io), 0},
+	{"-cache_trace=%s", offsetof(struct options, cache.trace_file), 0},
+	{"-dirty_bg=%d", offsetof(struct options, cache.dirty_bg), 0},
+	{"-dirty_max=%d", offsetof(struct options, cache.dirty_max), 0},
+	{"-dirty_expire=%d", offsetof(struct options, cache.dirty_expire), 0},
+	{"-flush_interval=%d", offsetof(struct options, cache.flush_interval), 0},
+	{"-readahead=%d", offsetof(struct options, readahead), 0},
+	{"-write_mode=%s", offsetof(struct options, write_mode), 0},
+	{"-dir_index=%d", offsetof(struct options, dir_index), 0},
+	{"-delalloc", offsetof(struct options, delalloc), 1},
+	{"-resv_zones=%d", offsetof(struct options, resv_zones), 0},
+	{"-sync_delete", offsetof(struct options, sync_delete), 1},
+	FUSE_OPT_END
+};
+
+/**
+ * What fi->fh points to for every open file and directory.
+ */
+struct open_file {
+	struct minix_inode *inode;
+	struct readahead ra;		/* not used for directories */
+};
+
+#define OPEN_FILE(fi) ((struct open_file *) (unsigned long) (fi)->fh)
+
+static struct open_file *open_file_new(struct minix_inode *inode)
+{
+	struct open_file *of;
+
+	if((of = malloc(sizeof(struct open_file))) == NULL)
+		panic("open_file_new(): unable to allocate open file");
+	of->inode = inode;
+	ra_init(&of->ra, options.readahead == 0 ? RA_MAX : options.readahead);
+	return of;
+}
+
+/**
+ * Tells the kernel of the inode, keeping the caller's reference to it for
+ * the kernel until it is forgotten.
+ */
+static void reply_entry(fuse_req_t req, struct minix_inode *inode)
+{
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode->i_num;
+	e.attr_timeout = ATTR_TIMEOUT;
+	e.entry_timeout = ENTRY_TIMEOUT;
+	stat_inode(inode, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct minix_inode *dir, *inode = NULL;
+	inode_nr i_num;
+
+	debug("ll_lookup(%lu, \"%s\")", parent, name);
+	fs_lock_shared();
+	dir = get_inode(parent);
+	if(strlen(name) < FILENAME_SIZE &&
+		(i_num = dir_search(dir, name)) != NO_INODE)
+		inode = get_inode(i_num);
+	put_inode(dir);
+	fs_unlock();
+
+	if(inode == NULL)
+		fuse_reply_err(req, ENOENT);
+	else
+		reply_entry(req, inode);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct minix_inode *inode;
+
+	debug("ll_forget(%lu, %lu)", ino, nlookup);
+	fs_lock_excl();
+	inode = get_inode(ino);
+	while(nlookup-- > 0)
+		put_inode(inode);
+	put_inode(inode);
+	fs_unlock();
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
+{
+	struct minix_inode *inode;
+	struct stat st;
+
+	fs_lock_shared();
+	inode = get_inode(ino);
+	stat_inode(inode, &st);
+	put_inode(inode);
+	fs_unlock();
+	fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	int to_set, struct fuse_file_info *fi)
+{
+	struct minix_inode *inode;
+	struct stat st;
+	int ret = 0;
+
+	debug("ll_setattr(%lu, %x)", ino, to_set);
+	fs_lock_excl();
+	inode = get_inode(ino);
+	if(to_set & FUSE_SET_ATTR_SIZE)
+		ret = truncate_to(inode, attr->st_size);
+	if(ret == 0) {
+		if(to_set & FUSE_SET_ATTR_MODE)
+			inode->i_mode = (inode->i_mode & S_IFMT) |
+				(attr->st_mode & ~S_IFMT);
+		if(to_set & FUSE_SET_ATTR_UID)
+			inode->i_uid = attr->st_uid;
+		if(to_set & FUSE_SET_ATTR_GID)
+			inode->i_gid = attr->st_gid;
+		/* minix has the one time */
+		if(to_set & FUSE_SET_ATTR_MTIME)
+			inode->i_time = attr->st_mtime;
+		if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+			FUSE_SET_ATTR_GID | FUSE_SET_ATTR_MTIME))
+			inode->i_dirty = TRUE;
+		stat_inode(inode, &st);
+	}
+	put_inode(inode);
+	fs_unlock();
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+/**
+ * Makes 'name' in directory 'parent'. Returns its inode, or NULL with *err
+ * set.
+ */
+static struct minix_inode *make_node(fuse_ino_t parent, const char *name,
+	mode_t mode, int *err)
+{
+	struct minix_inode *dir, *inode = NULL;
+
+	if(strlen(name) >= FILENAME_SIZE) {
+		*err = ENAMETOOLONG;
+		return NULL;
+	}
+
+	fs_lock_excl();
+	dir = get_inode(parent);
+	if(dir_search(dir, name) != NO_INODE)
+		*err = EEXIST;
+	else
+		inode = new_node(dir, name, mode);
+	put_inode(dir);
+	fs_unlock();
+	return inode;
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode)
+{
+	struct minix_inode *inode;
+	int err;
+
+	debug("ll_mkdir(%lu, \"%s\", %o)", parent, name, mode);
+	if((inode = make_node(parent, name, (mode & ~S_IFMT) | S_IFDIR,
+		&err)) == NULL)
+		fuse_reply_err(req, err);
+	else
+		reply_entry(req, inode);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	struct minix_inode *inode;
+	int err;
+
+	debug("ll_create(%lu, \"%s\", %o)", parent, name, mode);
+	if((inode = make_node(parent, name, mode, &err)) == NULL) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	/* one reference for the kernel knowing it, one for it being open */
+	fs_lock_shared();
+	get_inode(inode->i_num);
+	fs_unlock();
+	fi->fh = (unsigned long) open_file_new(inode);
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode->i_num;
+	e.attr_timeout = ATTR_TIMEOUT;
+	e.entry_timeout = ENTRY_TIMEOUT;
+	stat_inode(inode, &e.attr);
+	fuse_reply_create(req, &e, fi);
+}
+
+/**
+ * Returns the mode of 'name' in 'dir', or 0 if it isn't there. *empty is set
+ * to whether it is an empty directory if 'empty' is not NULL.
+ */
+static mode_t node_mode(struct minix_inode *dir, const char *name, int *empty)
+{
+	struct minix_inode *inode;
+	inode_nr i_num;
+	mode_t mode;
+
+	if((i_num = dir_search(dir, name)) == NO_INODE)
+		return 0;
+	inode = get_inode(i_num);
+	mode = inode->i_mode;
+	if(empty != NULL)
+		*empty = S_ISDIR(mode) && dir_empty(inode);
+	put_inode(inode);
+	return mode;
+}
+
+/**
+ * Removes 'name' from directory 'parent' if it is a directory, for rmdir(),
+ * or if it isn't, for unlink(). Returns 0 or an errno.
+ */
+static int remove_node(fuse_ino_t parent, const char *name, int is_dir)
+{
+	struct minix_inode *dir;
+	mode_t mode;
+	int empty, err = 0;
+
+	fs_lock_excl();
+	dir = get_inode(parent);
+	if((mode = node_mode(dir, name, &empty)) == 0)
+		err = ENOENT;
+	else if(!is_dir && S_ISDIR(mode))
+		err = EISDIR;
+	else if(is_dir && !S_ISDIR(mode))
+		err = ENOTDIR;
+	else if(is_dir && !empty)
+		err = ENOTEMPTY;
+	else
+		unlink_at(dir, name);
+	put_inode(dir);
+	fs_unlock();
+	return err;
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	debug("ll_unlink(%lu, \"%s\")", parent, name);
+	fuse_reply_err(req, remove_node(parent, name, FALSE));
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	debug("ll_rmdir(%lu, \"%s\")", parent, name);
+	fuse_reply_err(req, remove_node(parent, name, TRUE));
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname)
+{
+	struct minix_inode *s_dir, *d_dir;
+	mode_t mode, d_mode;
+	int empty, err = 0;
+
+	debug("ll_rename(%lu, \"%s\", %lu, \"%s\")", parent, name, newparent,
+		newname);
+	if(strlen(newname) >= FILENAME_SIZE) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	fs_lock_excl();
+	s_dir = get_inode(parent);
+	d_dir = get_inode(newparent);
+	/* whatever is replaced must be of the same kind, and empty if a
+	 * directory */
+	if((mode = node_mode(s_dir, name, NULL)) == 0)
+		err = ENOENT;
+	else if((d_mode = node_mode(d_dir, newname, &empty)) != 0) {
+		if(S_ISDIR(mode) && !S_ISDIR(d_mode))
+			err = ENOTDIR;
+		else if(!S_ISDIR(mode) && S_ISDIR(d_mode))
+			err = EISDIR;
+		else if(S_ISDIR(d_mode) && !empty &&
+			dir_search(d_dir, newname) != dir_search(s_dir, name))
+			err = ENOTEMPTY;
+	}
+	if(err == 0)
+		rename_at(s_dir, name, d_dir, newname);
+	put_inode(s_dir);
+	put_inode(d_dir);
+	fs_unlock();
+	fuse_reply_err(req, err);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct minix_inode *inode;
+
+	fs_lock_shared();
+	inode = get_inode(ino);
+	fs_unlock();
+	fi->fh = (unsigned long) open_file_new(inode);
+	fuse_reply_open(req, fi);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+
+	fs_lock_excl();
+	put_inode(of->inode);
+	fs_unlock();
+	ra_destroy(&of->ra);
+	free(of);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+	char *buf;
+	int ret;
+
+	if((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fs_lock_shared();
+	ret = minix_read(of->inode, buf, size, off, &of->ra);
+	fs_unlock();
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+	size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+	int ret;
+
+	fs_lock_excl();
+	ret = write_buf(of->inode, buf, size, off, options.write_direct);
+	fs_unlock();
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+	off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	struct open_file *of = OPEN_FILE(fi);
+	int ret;
+
+	if(mode & ~FALLOC_FL_KEEP_SIZE) {
+		fuse_reply_err(req, EOPNOTSUPP);	/* no holes punched */
+		return;
+	}
+
+	fs_lock_excl();
+	ret = preallocate(of->inode, offset, length,
+		(mode & FALLOC_FL_KEEP_SIZE) != 0);
+	fs_unlock();
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * Where ll_readdir() is filling.
+ */
+struct readdir_buf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+static int readdir_fill(void *arg, const char *name, struct minix_inode *inode,
+	off_t next)
+{
+	struct readdir_buf *rb = arg;
+	struct stat st;
+	size_t len;
+
+	stat_inode(inode, &st);
+	len = fuse_add_direntry(rb->req, rb->buf + rb->used,
+		rb->size - rb->used, name, &st, next);
+	if(len > rb->size - rb->used)
+		return 1;	/* doesn't fit. it comes first next time */
+	rb->used += len;
+	return 0;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t off, struct fuse_file_info *fi)
+{
+	struct readdir_buf rb;
+
+	debug("ll_readdir(%lu, %lu, %lld)", ino, (unsigned long) size,
+		(long long) off);
+	rb.req = req;
+	rb.size = size;
+	rb.used = 0;
+	if((rb.buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fs_lock_shared();
+	read_dir(OPEN_FILE(fi)->inode, off, readdir_fill, &rb);
+	fs_unlock();
+
+	fuse_reply_buf(req, rb.buf, rb.used);
+	free(rb.buf);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = BLOCK_SIZE;
+	st.f_frsize = BLOCK_SIZE;
+	st.f_namemax = FILENAME_SIZE - 1;
+
+	fs_lock_shared();
+	st.f_blocks = sb.s_nzones;
+	st.f_bfree = st.f_bavail = sb.zmap->tree->nr_free;
+	st.f_files = sb.s_ninodes;
+	for(i = 1; i <= sb.s_ninodes; i++)
+		if(!test_bit(sb.imap, i))
+			st.f_ffree++;
+	st.f_favail = st.f_ffree;
+	fs_unlock();
+
+	fuse_reply_statfs(req, &st);
+}
+
+/* the reclaimer is started here rather than in main() so that it is running
+ * in the process left once fuse_daemonize() has forked */
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	if(!options.sync_delete)
+		reclaimer_start();
+}
+
+static void ll_destroy(void *userdata)
+{
+	debug("ll_destroy(): unmounting...");
+	reclaimer_stop();	/* it takes fs_lock */
+	cache_set_flush_hook(NULL);	/* so does the flusher's */
+	fs_lock_excl();
+	minix_unmount();
+	fs_unlock();
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+	.init		= ll_init,
+	.destroy	= ll_destroy,
+	.lookup		= ll_lookup,
+	.forget		= ll_forget,
+	.getattr	= ll_getattr,
+	.setattr	= ll_setattr,
+	.mkdir		= ll_mkdir,
+	.unlink		= ll_unlink,
+	.rmdir		= ll_rmdir,
+	.rename		= ll_rename,
+	.open		= ll_open,
+	.read		= ll_read,
+	.write		= ll_write,
+	.release	= ll_release,
+	.opendir	= ll_open,
+	.readdir	= ll_readdir,
+	.releasedir	= ll_release,
+	.statfs		= ll_statfs,
+	.create		= ll_create,
+	.fallocate	= ll_fallocate,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground, ret = 1;
+
+	memset(&options, 0, sizeof(struct options));
+	if(fuse_opt_parse(&args, &options, options_desc, NULL) == -1)
+		return 1;
+	if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+		&foreground) == -1)
+		return 1;
+
+	if(options.write_mode != NULL &&
+		strcmp(options.write_mode, "direct") == 0)
+		options.write_direct = TRUE;
+	else if(options.write_mode != NULL &&
+		strcmp(options.write_mode, "cached") != 0)
+		panic("main(): unknown write mode \"%s\"", options.write_mode);
+	dir_index_set_min(options.dir_index);
+	delalloc_set(options.delalloc);
+	resv_set_zones(options.resv_zones);
+
+	/* mounted here so that we can exit gracefully if it goes wrong */
+	minix_mount(options.device_name, &options.cache);
+	cache_set_flush_hook(flush_delalloc_expired);
+
+	if((ch = fuse_mount(mountpoint, &args)) != NULL) {
+		se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+		if(se != NULL) {
+			if(fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				/* multi-threaded unless -s is given, as
+				 * somix.c */
+				ret = multithreaded ? fuse_session_loop_mt(se) :
+					fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+/**
+ * Benchmark and check of alloc_bit() on a fragmented zone bitmap.
+ *
+ * The file system is first fragmented the way fs_condition/fs_fragmented.sh
+ * does it through FUSE: files of between SMALLEST and LARGEST KB are written
+ * until WRITE_LIMIT KB have been, then every other one is deleted. Then:
+ *	- alloc_bit() from NR_CHECKS random origins must find the same bit as
+ *	  a plain search a bit at a time, with the free extent tree and
+ *	  without.
+ *	- NR_ALLOCS zones are allocated from the start of the zone map, as
+ *	  for a file whose first zone is there, three ways:
+ *		old	- alloc_bit() as it was, a bit at a time
+ *		scan	- alloc_bit() searching the bitmap a word at a time
+ *		tree	- alloc_bit() finding the bit in the free extent tree
+ *	  All three must allocate the same zones.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=AB.IMG bs=1M count=70
+ *	$ ./mkfs.somix AB.IMG
+ *
+ * usage: test_alloc_bit [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "bitmap.h"
+#include "write.h"
+
+#define DEVICE "AB.IMG"
+#define SMALLEST 64
+#define LARGEST 256
+#define WRITE_LIMIT (60 * 1024)
+#define NR_CHECKS 10000
+#define NR_ALLOCS 4000
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bit(char *addr, unsigned int nr)
+{
+	return (addr[nr >> 3] & (1 << (nr & 7))) != 0;
+}
+
+static int is_set(struct generic_bitmap *bitmap, int nr)
+{
+	return bit(bitmap->blocks[nr / BITS_PER_BLOCK]->blk_data,
+		nr % BITS_PER_BLOCK);
+}
+
+/**
+ * alloc_bit() as it was, testing the bits of each int that isn't all ones
+ * one at a time.
+ */
+static int old_alloc_bit(struct generic_bitmap *bitmap, int origin)
+{
+	register unsigned k;
+	register int a;
+	register int *wptr, *wlim;
+	int i, b, w, o, block_count;
+	struct minix_block *bp;
+
+	if(origin >= bitmap->num_bits) origin = 0;
+
+	b = origin >> 13;
+	o = origin - (b << 13);
+	w = o/INT_BITS;
+
+	block_count = bitmap->num_blocks;
+	while(block_count--) {
+		bp = bitmap->blocks[b];
+		wptr = ((int *) bp->blk_data) + w;
+		wlim = ((int *) bp->blk_data) + INTS_PER_BLOCK;
+		a = w * INT_BITS;
+		while(wptr != wlim) {
+			if((k = (unsigned) *wptr) != (unsigned) ~0) {
+				for(i = 0; i < INT_BITS; i++) {
+					if(!bit((char *)wptr, i)) {
+						a += (b * INTS_PER_BLOCK *
+							INT_BITS) + i;
+						if(a >= bitmap->num_bits) {
+							wptr = wlim - 1;
+							break;
+						}
+						((char *) wptr)[i >> 3] |=
+							1 << (i & 7);
+						mark_dirty(bp);
+						return a;
+					}
+				}
+			}
+			wptr++;
+			a += INT_BITS;
+		}
+		if(++b == bitmap->num_blocks) b = 0;
+		w = 0;
+	}
+	return -1;
+}
+
+/**
+ * The first clear bit at or after 'origin', wrapping round, found a bit at a
+ * time.
+ */
+static int slow_find(struct generic_bitmap *bitmap, int origin)
+{
+	int n, nr;
+
+	for(n = 0; n < bitmap->num_bits; n++) {
+		nr = (origin + n) % bitmap->num_bits;
+		if(!is_set(bitmap, nr))
+			return nr;
+	}
+	return -1;
+}
+
+/**
+ * Writes files until WRITE_LIMIT KB have been written, then deletes every
+ * other one.
+ */
+static void fragment(void)
+{
+	static char buf[LARGEST * 1024];
+	struct minix_inode *inode;
+	char name[FILENAME_SIZE], path[64];
+	int written = 0, count, i, size;
+
+	for(count = 0; written <= WRITE_LIMIT; count++) {
+		size = SMALLEST + rand() % (LARGEST - SMALLEST + 1);
+		sprintf(name, "dummy_%d", count);
+		inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+		if(write_buf(inode, buf, size * 1024, 0, FALSE) != size * 1024)
+			panic("fragment(): unable to write %s", name);
+		put_inode(inode);
+		written += size;
+	}
+	for(i = 0; i < count; i += 2) {
+		sprintf(path, "/dummy_%d", i);
+		unlink(path);
+	}
+	printf("%d files written, every other one deleted\n", count);
+}
+
+/**
+ * Allocates NR_ALLOCS zones from the start of the zone map into 'got', then
+ * frees them again, and returns the seconds the allocations took. The tree
+ * is set aside while they are made with anything else.
+ */
+static double alloc_run(int (*alloc)(struct generic_bitmap *, int), 
+	int use_tree, int *got)
+{
+	struct extent_tree *tree = sb.zmap->tree;
+	double elapsed, start;
+	int i;
+
+	if(!use_tree)
+		sb.zmap->tree = NULL;
+	start = now();
+	for(i = 0; i < NR_ALLOCS; i++)
+		got[i] = alloc(sb.zmap, 1);
+	elapsed = now() - start;
+	for(i = 0; i < NR_ALLOCS; i++)
+		free_bit(sb.zmap, got[i]);
+	sb.zmap->tree = tree;
+	return elapsed;
+}
+
+/**
+ * Returns how many of NR_CHECKS allocations from random origins alloc_bit()
+ * gets wrong. Each is freed again straight away.
+ */
+static int check(int use_tree)
+{
+	struct extent_tree *tree = sb.zmap->tree;
+	int i, origin, want, got, bad = 0;
+
+	if(!use_tree)
+		sb.zmap->tree = NULL;
+	for(i = 0; i < NR_CHECKS; i++) {
+		origin = i == 0 ? sb.zmap->num_bits - 1 : rand() %
+			sb.zmap->num_bits;
+		want = slow_find(sb.zmap, origin);
+		if((got = alloc_bit(sb.zmap, origin)) != want) {
+			printf("FAILED: alloc_bit(%d) got %d, expected %d\n",
+				origin, got, want);
+			bad++;
+		}
+		if(got >= 0)
+			free_bit(sb.zmap, got);
+	}
+	sb.zmap->tree = tree;
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	static int old_got[NR_ALLOCS], scan_got[NR_ALLOCS];
+	static int tree_got[NR_ALLOCS];
+	double t_old, t_scan, t_tree;
+	int i, free_bits = 0, runs = 0, bad = 0;
+
+	srand(1);
+	minix_mount(device, NULL);
+	fragment();
+	for(i = 1; i < sb.zmap->num_bits; i++) {
+		if(!is_set(sb.zmap, i)) {
+			free_bits++;
+			if(is_set(sb.zmap, i - 1))
+				runs++;
+		}
+	}
+	printf("%d of %d zones free in %d runs\n", free_bits,
+		sb.zmap->num_bits, runs);
+
+	bad += check(TRUE) + check(FALSE);
+
+	t_old = alloc_run(old_alloc_bit, FALSE, old_got);
+	t_scan = alloc_run(alloc_bit, FALSE, scan_got);
+	t_tree = alloc_run(alloc_bit, TRUE, tree_got);
+	for(i = 0; i < NR_ALLOCS; i++)
+		if(scan_got[i] != old_got[i] || tree_got[i] != old_got[i])
+			bad++;
+	printf("%d allocations from zone 1 (ns each): old %.0f, scan %.0f, "
+		"tree %.0f\n", NR_ALLOCS, t_old * 1e9 / NR_ALLOCS,
+		t_scan * 1e9 / NR_ALLOCS, t_tree * 1e9 / NR_ALLOCS);
+	minix_unmount();
+
+	if(bad > 0)
+		printf("FAILED: %d allocations wrong\n", bad);
+	else
+		printf("passed\n");
+	return bad > 0;
+}
@@ -3,12 +3,11 @@
 #include "cache.h"
 
 #include <unistd.h>
-extern struct minix_block *front;
 
 int main(void)
 {
 	open_blk_device("TEST3.IMG");	
-	init_cache();
+	init_cache(NULL);
 
 	struct minix_block *b1, *b2, *b3;
 
@@ -18,9 +17,9 @@ int main(void)
 
 	b2 = get_block(1002, TRUE);
 
-	b1->blk_dirty = TRUE;
-	b2->blk_dirty = TRUE;
-	b3->blk_dirty = TRUE;
+	mark_dirty(b1);
+	mark_dirty(b2);
+	mark_dirty(b3);
 	printf("\n");
 	put_block(b1, SUPER_BLOCK);
 	put_block(b2, DATA_BLOCK);
@@ -0,0 +1,82 @@
+/**
+ * Microbenchmark of get_block miss latency against cache size.
+ *
+ * load_bitmaps() leaves every bitmap block pinned for the life of the mount.
+ * For each cache size this pins an increasing share of the cache in the same
+ * way and times a long run of misses at each step. No disk I/O is involved,
+ * misses are fetched with do_read == FALSE and never dirtied, so what is
+ * measured is purely the cost of finding and recycling a victim buffer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "const.h"
+#include "cache.h"
+
+#define DEVICE "MISS.IMG"
+#define NR_MISSES 1000000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	int sizes[] = { 1, 4, 16, 64 };			/* cache MB */
+	int steps[] = { 0, 50, 90 };			/* % of cache pinned */
+	struct cache_opts opts = { 0, NULL, NULL };
+	int pinned, nr_bufs, miss_base, target, i, j, k, f;
+	double start, elapsed;
+	struct cache_stats before, after;
+
+	/* misses never touch the disk but the cache still wants a device */
+	if((f = open(DEVICE, O_CREAT | O_WRONLY, 0644)) < 0) {
+		perror("open");
+		return 1;
+	}
+	close(f);
+	open_blk_device(DEVICE);
+
+	printf("%8s %8s %10s %12s\n", "buffers", "pinned", "evictable",
+		"ns/miss");
+	for(k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		opts.cache_mb = sizes[k];
+		init_cache(&opts);
+		nr_bufs = cache_nr_bufs();
+		miss_base = nr_bufs * 16;	/* clear of the pinned blocks */
+
+		pinned = 0;
+		for(i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+			/* pin consecutive blocks. they spread evenly over the
+			 * shards just like a run of bitmap blocks does. */
+			target = nr_bufs * steps[i] / 100;
+			for( ; pinned < target; pinned++)
+				get_block(pinned, FALSE);
+
+			cache_get_stats(&before);
+			start = now();
+			for(j = 0; j < NR_MISSES; j++)
+				put_block(get_block(miss_base + j, FALSE),
+					DATA_BLOCK);
+			elapsed = now() - start;
+			cache_get_stats(&after);
+
+			if(after.misses - before.misses != NR_MISSES) {
+				printf("FAILED: expected %d misses, got %lu\n",
+					NR_MISSES, after.misses - before.misses);
+				return 1;
+			}
+			printf("%8d %8d %10d %12.1f\n", nr_bufs, pinned,
+				nr_bufs - pinned, elapsed * 1e9 / NR_MISSES);
+		}
+
+		cache_destroy();
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * Stress test for the buffer cache. A number of threads hammer get_block and
+ * put_block at the same time, first over a set of blocks small enough to fit
+ * in the cache and then over a set large enough to force constant eviction.
+ *
+ * The test creates its own image file. Every block of it starts with its own
+ * block number followed by a counter which the threads increment. Afterwards
+ * the hit/miss totals and the counters on disk are checked.
+ *
+ * usage: test_cache_stress [sync|uring]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "const.h"
+#include "cache.h"
+
+#define DEVICE "STRESS.IMG"
+#define NR_THREADS 8
+#define NR_OPS 20000			/* get_block's per thread per phase */
+#define HOT_BLOCKS (NR_BUFS / 2)	/* fits in the cache */
+#define COLD_BLOCKS (NR_BUFS * 4)	/* forces evictions */
+
+static int expected[COLD_BLOCKS];	/* increments made to each block */
+static int failures = 0;
+
+/**
+ * Writes a fresh image of COLD_BLOCKS blocks. Block n holds n then 0.
+ */
+static void mk_image(void)
+{
+	char buf[BLOCK_SIZE];
+	int f, i;
+
+	if((f = open(DEVICE, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(buf, 0, BLOCK_SIZE);
+	for(i = 0; i < COLD_BLOCKS; i++) {
+		((int *) buf)[0] = i;
+		if(write(f, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+			perror("write");
+			exit(1);
+		}
+	}
+	close(f);
+}
+
+/**
+ * Reads hot blocks only. Every block is visited in order first so that each
+ * one is certain to be missed exactly once across all threads.
+ */
+static void *hot_reader(void *arg)
+{
+	unsigned int seed = (unsigned long) arg;
+	struct minix_block *blk;
+	int i, b;
+
+	for(i = 0; i < NR_OPS; i++) {
+		b = i < HOT_BLOCKS ? i : rand_r(&seed) % HOT_BLOCKS;
+		blk = get_block(b, TRUE);
+		if(((int *) blk->blk_data)[0] != b)
+			__sync_fetch_and_add(&failures, 1);
+		put_block(blk, DATA_BLOCK);
+	}
+	return NULL;
+}
+
+/**
+ * Reads and increments the counters of random blocks.
+ */
+static void *cold_writer(void *arg)
+{
+	unsigned int seed = (unsigned long) arg;
+	struct minix_block *blk;
+	int i, b;
+
+	for(i = 0; i < NR_OPS; i++) {
+		b = rand_r(&seed) % COLD_BLOCKS;
+		blk = get_block(b, TRUE);
+		if(((int *) blk->blk_data)[0] != b)
+			__sync_fetch_and_add(&failures, 1);
+		lock_block(blk);
+		((int *) blk->blk_data)[1]++;
+		mark_dirty(blk);
+		unlock_block(blk);
+		__sync_fetch_and_add(&expected[b], 1);
+		put_block(blk, DATA_BLOCK);
+	}
+	return NULL;
+}
+
+static void run_threads(void *(*fn)(void *))
+{
+	pthread_t threads[NR_THREADS];
+	long i;
+
+	for(i = 0; i < NR_THREADS; i++)
+		pthread_create(&threads[i], NULL, fn, (void *) (i + 1));
+	for(i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/**
+ * Checks the counters written to the image match the increments made.
+ */
+static int check_image(void)
+{
+	int buf[INTS_PER_BLOCK];
+	int f, i, bad = 0;
+
+	if((f = open(DEVICE, O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for(i = 0; i < COLD_BLOCKS; i++) {
+		if(pread(f, buf, BLOCK_SIZE, (off_t) i * BLOCK_SIZE) !=
+			BLOCK_SIZE || buf[0] != i || buf[1] != expected[i])
+			bad++;
+	}
+	close(f);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	struct cache_opts opts = { 0 };
+	struct cache_stats before, after;
+	unsigned long gets = (unsigned long) NR_THREADS * NR_OPS;
+	int bad, ok = 1;
+
+	mk_image();
+	open_blk_device(DEVICE);
+	if(argc > 1)
+		opts.io = argv[1];
+	init_cache(&opts);
+	printf("I/O backend: %s\n", cache_io_name());
+
+	printf("hot phase: %d threads x %d reads over %d blocks...\n",
+		NR_THREADS, NR_OPS, HOT_BLOCKS);
+	cache_get_stats(&before);
+	run_threads(hot_reader);
+	cache_get_stats(&after);
+	printf("  hits=%lu misses=%lu reads=%lu\n", after.hits - before.hits,
+		after.misses - before.misses, after.reads - before.reads);
+	if(after.hits - before.hits + after.misses - before.misses != gets) {
+		printf("  FAILED: hits + misses != %lu\n", gets);
+		ok = 0;
+	}
+	if(after.misses - before.misses != HOT_BLOCKS) {
+		printf("  FAILED: expected exactly %d misses\n", HOT_BLOCKS);
+		ok = 0;
+	}
+
+	printf("cold phase: %d threads x %d increments over %d blocks...\n",
+		NR_THREADS, NR_OPS, COLD_BLOCKS);
+	cache_get_stats(&before);
+	run_threads(cold_writer);
+	cache_get_stats(&after);
+	printf("  hits=%lu misses=%lu reads=%lu writes=%lu flushed=%lu\n",
+		after.hits - before.hits, after.misses - before.misses,
+		after.reads - before.reads, after.writes - before.writes,
+		after.flushed - before.flushed);
+	if(after.hits - before.hits + after.misses - before.misses != gets) {
+		printf("  FAILED: hits + misses != %lu\n", gets);
+		ok = 0;
+	}
+
+	printf("syncing...\n");
+	sync_cache();
+	if(failures > 0) {
+		printf("  FAILED: %d blocks handed out with wrong data\n",
+			failures);
+		ok = 0;
+	}
+	if((bad = check_image()) > 0) {
+		printf("  FAILED: %d blocks on disk have wrong counters\n",
+			bad);
+		ok = 0;
+	}
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
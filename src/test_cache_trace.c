@@ -0,0 +1,170 @@
+/**
+ * Replays a get_block/put_block trace against each buffer cache replacement
+ * policy and reports the hit ratio of each.
+ *
+ * Traces are recorded by mounting with -cache_trace=FILE. With no trace file
+ * given a synthetic one is used instead: a working set of inode and directory
+ * blocks that is revisited throughout a long sequential read, which is the
+ * pattern that flushes metadata out of a plain LRU cache.
+ *
+ * Blocks are fetched with do_read == FALSE so no disk I/O is done and only
+ * the placement decisions of the cache are measured.
+ *
+ * usage: test_cache_trace [trace_file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "const.h"
+#include "cache.h"
+
+#define DEVICE "TRACE.IMG"
+#define META_BLOCKS (NR_BUFS / 2)	/* synthetic metadata working set */
+#define SCAN_BLOCKS (NR_BUFS * 16)	/* synthetic sequential read */
+#define META_BASE 100			/* where the metadata lives */
+#define SCAN_BASE (META_BASE + META_BLOCKS)
+
+struct trace_rec {
+	char op;		/* 'g' or 'p' */
+	int blk_nr;
+	int arg;		/* do_read for 'g', block_type for 'p' */
+};
+
+struct pinned {
+	int blk_nr;
+	struct minix_block *blk;
+};
+
+static struct trace_rec *trace;
+static int trace_len = 0, trace_cap = 0;
+
+static void trace_add(char op, int blk_nr, int arg)
+{
+	if(trace_len == trace_cap) {
+		trace_cap = trace_cap ? trace_cap * 2 : 1024;
+		trace = realloc(trace, trace_cap * sizeof(struct trace_rec));
+		if(trace == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	trace[trace_len].op = op;
+	trace[trace_len].blk_nr = blk_nr;
+	trace[trace_len].arg = arg;
+	trace_len++;
+}
+
+static void trace_load(const char *file)
+{
+	FILE *fp;
+	char op;
+	int blk_nr, arg;
+
+	if((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	while(fscanf(fp, " %c %d %d", &op, &blk_nr, &arg) == 3)
+		trace_add(op, blk_nr, arg);
+	fclose(fp);
+}
+
+/**
+ * Metadata is touched once for every four data blocks read. Each data block
+ * is read a 1K chunk at a time, i.e. once.
+ */
+static void trace_synthesize(void)
+{
+	unsigned int seed = 1;
+	int i, m;
+
+	for(i = 0; i < SCAN_BLOCKS; i++) {
+		trace_add('g', SCAN_BASE + i, TRUE);
+		trace_add('p', SCAN_BASE + i, DATA_BLOCK);
+		if(i % 4 == 0) {
+			m = META_BASE + rand_r(&seed) % META_BLOCKS;
+			trace_add('g', m, TRUE);
+			trace_add('p', m, m % 2 ? INODE_BLOCK : DIR_BLOCK);
+		}
+	}
+}
+
+/**
+ * Replays the trace. Returns the hit ratio.
+ */
+static double replay(void)
+{
+	struct pinned *pins = NULL;
+	int nr_pins = 0, cap = 0, i, j;
+	struct cache_stats stats;
+
+	for(i = 0; i < trace_len; i++) {
+		if(trace[i].op == 'g') {
+			if(nr_pins == cap) {
+				cap = cap ? cap * 2 : 64;
+				pins = realloc(pins, cap * sizeof(*pins));
+			}
+			pins[nr_pins].blk_nr = trace[i].blk_nr;
+			pins[nr_pins].blk = get_block(trace[i].blk_nr, FALSE);
+			nr_pins++;
+			continue;
+		}
+
+		/* put the most recent matching get */
+		for(j = nr_pins - 1; j >= 0; j--)
+			if(pins[j].blk_nr == trace[i].blk_nr)
+				break;
+		if(j < 0)
+			continue;	/* trace started after the get */
+		put_block(pins[j].blk, trace[i].arg);
+		pins[j] = pins[--nr_pins];
+	}
+
+	/* release anything still pinned so the cache can be destroyed */
+	while(nr_pins > 0)
+		put_block(pins[--nr_pins].blk, DATA_BLOCK);
+	free(pins);
+
+	cache_get_stats(&stats);
+	return (double) stats.hits / (stats.hits + stats.misses);
+}
+
+int main(int argc, char **argv)
+{
+	char *policies[] = { "lru", "2q" };
+	struct cache_opts opts = { 0, NULL, NULL };
+	double ratio[NR_CACHE_POLICIES];
+	int i, f;
+
+	if(argc > 1) {
+		trace_load(argv[1]);
+		printf("replaying %d records from %s\n", trace_len, argv[1]);
+	}
+	else {
+		trace_synthesize();
+		printf("replaying synthetic trace: %d metadata blocks during "
+			"a %d block sequential read\n", META_BLOCKS,
+			SCAN_BLOCKS);
+	}
+
+	if((f = open(DEVICE, O_CREAT | O_WRONLY, 0644)) < 0) {
+		perror("open");
+		return 1;
+	}
+	close(f);
+	open_blk_device(DEVICE);
+
+	for(i = 0; i < NR_CACHE_POLICIES; i++) {
+		opts.policy = policies[i];
+		init_cache(&opts);
+		ratio[i] = replay();
+		cache_destroy();
+	}
+
+	printf("%8s %10s\n", "policy", "hit ratio");
+	for(i = 0; i < NR_CACHE_POLICIES; i++)
+		printf("%8s %9.2f%%\n", policies[i], ratio[i] * 100);
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * Checks that path lookups answered by the dentry cache agree with the
+ * directories on disk as files and directories are created, deleted and
+ * renamed, and that a repeated lookup of a deep path reads no blocks.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=DC.IMG bs=1M count=70
+ *	$ ./mkfs.somix DC.IMG
+ *
+ * usage: test_dcache [image]
+ */
+#include <stdio.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "write.h"
+#include "dcache.h"
+
+#define DEVICE "DC.IMG"
+
+extern struct minix_super_block sb;
+
+static int ok = 1;
+
+/**
+ * Returns the inode number 'path' resolves to, NO_INODE if it doesn't.
+ */
+static inode_nr lookup(const char *path)
+{
+	struct minix_inode *inode;
+	inode_nr i_num;
+
+	if((inode = resolve_path(sb.root_inode, path, PATH_RESOLVE_ALL)) ==
+		NULL)
+		return NO_INODE;
+	i_num = inode->i_num;
+	put_inode(inode);
+	return i_num;
+}
+
+static void expect(const char *path, inode_nr want)
+{
+	inode_nr got = lookup(path);
+
+	if(got != want) {
+		printf("FAILED: %s is inode %d, expected %d\n", path, got,
+			want);
+		ok = 0;
+	}
+}
+
+/**
+ * Creates 'name' in the directory 'dir' resolves to and returns its inode
+ * number.
+ */
+static inode_nr create(const char *dir, const char *name, mode_t mode)
+{
+	struct minix_inode *p_dir, *inode;
+	inode_nr i_num;
+
+	p_dir = resolve_path(sb.root_inode, dir, PATH_RESOLVE_ALL);
+	inode = new_node(p_dir, name, mode);
+	i_num = inode->i_num;
+	put_inode(inode);
+	put_inode(p_dir);
+	return i_num;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct cache_stats before, after;
+	struct dcache_stats ds;
+	inode_nr a, b, c, f, d, e;
+
+	minix_mount(device, NULL);
+	a = create("/", "a", S_IFDIR | 0755);
+	b = create("/a", "b", S_IFDIR | 0755);
+	c = create("/a/b", "c", S_IFDIR | 0755);
+	f = create("/a/b/c", "f", S_IFREG | 0644);
+
+	/* the second lookup shouldn't need any blocks */
+	expect("/a/b/c/f", f);
+	cache_get_stats(&before);
+	expect("/a/b/c/f", f);
+	cache_get_stats(&after);
+	if(after.hits + after.misses != before.hits + before.misses) {
+		printf("FAILED: repeated lookup got %lu blocks\n",
+			after.hits + after.misses - before.hits - before.misses);
+		ok = 0;
+	}
+
+	/* negative entries must go once the name is created */
+	expect("/a/b/c/nope", NO_INODE);
+	expect("/a/b/c/nope", NO_INODE);
+	dcache_get_stats(&ds);
+	if(ds.neg_hits == 0) {
+		printf("FAILED: no negative hits\n");
+		ok = 0;
+	}
+	e = create("/a/b/c", "nope", S_IFREG | 0644);
+	expect("/a/b/c/nope", e);
+
+	/* and come back when it is unlinked or renamed away */
+	unlink("/a/b/c/f");
+	expect("/a/b/c/f", NO_INODE);
+	rename("/a/b/c/nope", "/a/x");
+	expect("/a/b/c/nope", NO_INODE);
+	expect("/a/x", e);
+
+	/* a directory's entries go with it, even if its inode is reused */
+	d = create("/", "d", S_IFDIR | 0755);
+	expect("/d/..", ROOT_INODE);
+	unlink("/d");
+	expect("/d", NO_INODE);
+	if(create("/a", "d2", S_IFDIR | 0755) != d)
+		printf("inode %d not reused, purge not tested\n", d);
+	expect("/a/d2/..", a);
+
+	dcache_get_stats(&ds);
+	printf("dcache: %lu hits (%lu negative), %lu misses\n", ds.hits,
+		ds.neg_hits, ds.misses);
+	minix_unmount();
+
+	/* everything the cache said must be on disk too */
+	minix_mount(device, NULL);
+	expect("/a/b/c", c);
+	expect("/a/b/c/f", NO_INODE);
+	expect("/a/b/c/nope", NO_INODE);
+	expect("/a/x", e);
+	expect("/a/b", b);
+	expect("/a/d2/..", a);
+	minix_unmount();
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
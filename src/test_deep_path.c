@@ -0,0 +1,151 @@
+/**
+ * Microbenchmark of resolving deep paths.
+ *
+ * Builds a chain of MAX_DEPTH nested directories, then for each depth times
+ * LOOKUPS resolutions of the path to that depth:
+ *	nth	- parsing alone, a component at a time from the start of the
+ *		  path the way resolve_path() used to
+ *	iter	- parsing alone with path_next()
+ *	walk	- resolve_path() one component at a time, with every name in
+ *		  the dentry cache
+ *	cached	- resolve_path() of the whole path, found in the path cache
+ * Each resolution is checked against the inode the directory was created as.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=DP.IMG bs=1M count=70
+ *	$ ./mkfs.somix DP.IMG
+ *
+ * usage: test_deep_path [image]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "write.h"
+#include "dcache.h"
+
+#define DEVICE "DP.IMG"
+#define MAX_DEPTH 16
+#define LOOKUPS 100000
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The n'th component of path as resolve_path() used to find it, by skipping
+ * the first n from the start of the path every time.
+ */
+static int nth_cmpo(const char *path, char *buf, int n)
+{
+	while(*path == '/')
+		path++;
+	while(*path != '\0' && n != 0) {
+		if(*path++ == '/') {
+			while(*path == '/')
+				path++;
+			n--;
+		}
+	}
+	if(n != 0 || *path == '\0')
+		return 0;
+	while(*path != '/' && *path != '\0')
+		*buf++ = *path++;
+	*buf = '\0';
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	char path[MAX_DEPTH * FILENAME_SIZE], name[FILENAME_SIZE];
+	char file[FILENAME_SIZE];
+	inode_nr dirs[MAX_DEPTH + 1];
+	struct minix_inode *dir, *inode;
+	struct path_iter it;
+	struct dcache_stats ds;
+	double t_nth, t_iter, t_walk, t_cached, start;
+	int depth, i, j, bad = 0;
+
+	minix_mount(device, NULL);
+
+	/* /level_00_abcdefgh/level_01_abcdefgh/... */
+	dir = get_inode(ROOT_INODE);
+	dirs[0] = ROOT_INODE;
+	for(depth = 1; depth <= MAX_DEPTH; depth++) {
+		sprintf(name, "level_%02d_abcdefgh", depth - 1);
+		inode = new_node(dir, name, S_IFDIR | 0755);
+		dirs[depth] = inode->i_num;
+		put_inode(dir);
+		dir = inode;
+	}
+	put_inode(dir);
+
+	printf("%6s %6s %10s %10s %10s %10s (ns per lookup)\n", "depth",
+		"chars", "nth", "iter", "walk", "cached");
+	path[0] = '\0';
+	for(depth = 1; depth <= MAX_DEPTH; depth++) {
+		sprintf(path + strlen(path), "/level_%02d_abcdefgh", depth - 1);
+
+		start = now();
+		for(i = 0; i < LOOKUPS; i++)
+			for(j = 0; nth_cmpo(path, file, j); j++)
+				;
+		t_nth = now() - start;
+
+		start = now();
+		for(i = 0; i < LOOKUPS; i++) {
+			path_iter_init(&it, path);
+			while(path_next(&it, file) > 0)
+				;
+		}
+		t_iter = now() - start;
+
+		start = now();
+		for(i = 0; i < LOOKUPS; i++) {
+			inode = resolve_path(sb.root_inode, path, depth);
+			if(inode == NULL || inode->i_num != dirs[depth])
+				bad++;
+			put_inode(inode);
+		}
+		t_walk = now() - start;
+
+		start = now();
+		for(i = 0; i < LOOKUPS; i++) {
+			inode = resolve_path(sb.root_inode, path,
+				PATH_RESOLVE_ALL);
+			if(inode == NULL || inode->i_num != dirs[depth])
+				bad++;
+			put_inode(inode);
+		}
+		t_cached = now() - start;
+
+		printf("%6d %6d %10.0f %10.0f %10.0f %10.0f\n", depth,
+			(int) strlen(path), t_nth * 1e9 / LOOKUPS,
+			t_iter * 1e9 / LOOKUPS, t_walk * 1e9 / LOOKUPS,
+			t_cached * 1e9 / LOOKUPS);
+	}
+
+	dcache_get_stats(&ds);
+	printf("path cache: %lu hits, %lu misses\n", ds.path_hits,
+		ds.path_misses);
+	minix_unmount();
+
+	if(bad > 0)
+		printf("FAILED: %d lookups found the wrong inode\n", bad);
+	else
+		printf("passed\n");
+	return bad > 0;
+}
@@ -0,0 +1,301 @@
+/**
+ * Check of delayed allocation and how much it saves files being fragmented.
+ *
+ * Each workload replays two of the fs_condition scripts in process: files of
+ * between SMALLEST and LARGEST KB are written until WRITE_LIMIT KB have been
+ * (fs_fragmented.sh or fs_create_files.sh, the first deleting every other
+ * one), then NR_APPENDS 1KB appends are made to files picked at random
+ * (random_append.sh). The appends are made with delayed allocation off and
+ * on, starting from the same image each time. Then
+ *	- every file must read back right before the blocks held back are
+ *	  flushed and again after a remount.
+ *	- the zone runs ("extents") the files are in on disk are counted, on
+ *	  average and for the worst file, and the blocks got per read when
+ *	  they are all read through cold. A file of more than 7 blocks is
+ *	  always in at least two since its indirect block comes between.
+ *
+ * Last, with flush_delalloc_expired() as the flush hook, blocks held back
+ * must be on disk EXPIRE_WAIT seconds after they were written, without an
+ * unmount.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=DA.IMG bs=1M count=70
+ *	$ ./mkfs.somix DA.IMG
+ *
+ * usage: test_delalloc [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+#include "delalloc.h"
+#include "test_util.h"
+
+#define DEVICE "DA.IMG"
+#define MAX_FILES 1024
+#define NR_APPENDS 6000
+#define READ_CHUNK (32 * 1024)
+#define EXPIRE_BLKS 8
+#define EXPIRE_WAIT 3		/* secs. a flush interval, dirty_expire and 1 */
+
+extern struct minix_super_block sb;
+
+static struct workload {
+	char *name;
+	int smallest, largest;	/* KB */
+	int write_limit;	/* KB */
+	int delete;		/* every other file deleted */
+} workloads[] = {
+	{ "fragmented", 32, 64, 20 * 1024, TRUE },
+	{ "create_files", 64, 256, 20 * 1024, FALSE },
+};
+
+static inode_nr files[MAX_FILES];
+static int sizes[MAX_FILES];	/* KB */
+static int nr_files;
+
+/**
+ * The byte at 'pos' in the file with inode 'i_num'.
+ */
+static char file_byte(inode_nr i_num, int pos)
+{
+	return (i_num * 7 + pos / 1024) & 0xff;
+}
+
+/**
+ * Writes 'kb' KB of file n's data to the end of it.
+ */
+static void append(struct minix_inode *inode, int n, int kb)
+{
+	static char buf[256 * 1024];
+	int i, pos = sizes[n] * 1024;
+
+	for(i = 0; i < kb * 1024; i++)
+		buf[i] = file_byte(files[n], pos + i);
+	if(write_buf(inode, buf, kb * 1024, pos, TRUE) != kb * 1024)
+		panic("append(): short write to file %d", n);
+	sizes[n] += kb;
+}
+
+/**
+ * Runs the workload, with delayed allocation 'on' or not for the appends. The
+ * files are always written first without it so that the appends start from
+ * the same file system each time. The files left are put in files[].
+ */
+static void run(struct workload *w, int on)
+{
+	struct minix_inode *inode;
+	char name[FILENAME_SIZE], path[64];
+	int written = 0, count, n, i;
+
+	for(count = 0; written <= w->write_limit; count++) {
+		if(count == MAX_FILES)
+			panic("run(): too many files");
+		sprintf(name, "dummy_%d", count);
+		inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+		files[count] = inode->i_num;
+		sizes[count] = 0;
+		append(inode, count, w->smallest + rand() %
+			(w->largest - w->smallest + 1));
+		written += sizes[count];
+		put_inode(inode);
+	}
+
+	/* keep what's left at the front of files[] */
+	nr_files = 0;
+	for(i = 0; i < count; i++) {
+		if(w->delete && i % 2 == 0) {
+			sprintf(path, "/dummy_%d", i);
+			unlink(path);
+			continue;
+		}
+		files[nr_files] = files[i];
+		sizes[nr_files++] = sizes[i];
+	}
+
+	delalloc_set(on);
+	for(i = 0; i < NR_APPENDS; i++) {
+		n = rand() % nr_files;
+		inode = get_inode(files[n]);
+		append(inode, n, 1);
+		put_inode(inode);
+	}
+}
+
+/**
+ * Reads every file through once. Returns the number of bad bytes read.
+ */
+static int read_files(void)
+{
+	static char buf[READ_CHUNK];
+	struct minix_inode *inode;
+	struct readahead ra;
+	int bad = 0, n, got, pos, i;
+
+	for(n = 0; n < nr_files; n++) {
+		inode = get_inode(files[n]);
+		if(inode->i_size != sizes[n] * 1024)
+			bad++;
+		ra_init(&ra, RA_MAX);
+		for(pos = 0; pos < inode->i_size; pos += got) {
+			got = minix_read(inode, buf, READ_CHUNK, pos, &ra);
+			if(got <= 0)
+				panic("read_files(): short read of file %d", n);
+			for(i = 0; i < got; i++)
+				if(buf[i] != file_byte(files[n], pos + i))
+					bad++;
+		}
+		put_inode(inode);
+	}
+	return bad;
+}
+
+/**
+ * Returns the number of runs of zones on disk file n is in.
+ */
+static int extents(int n)
+{
+	struct minix_inode *inode = get_inode(files[n]);
+	zone_nr prev = NO_ZONE, cur;
+	int z, runs = 0;
+
+	for(z = 0; z < sizes[n]; z++) {
+		cur = read_map(inode, z * BLOCK_SIZE);
+		if(cur != prev + 1)
+			runs++;
+		prev = cur;
+	}
+	put_inode(inode);
+	return runs;
+}
+
+/**
+ * Writes a file with blocks held back, waits for the flusher and checks that
+ * they are on the device. Returns TRUE if they are.
+ */
+static int expire(const char *device)
+{
+	struct cache_opts opts = { .dirty_expire = 1, .flush_interval = 1 };
+	struct timespec wait = { EXPIRE_WAIT, 0 };
+	static char buf[EXPIRE_BLKS * BLOCK_SIZE];
+	char got[BLOCK_SIZE];
+	struct minix_inode *inode;
+	int i, ok = TRUE;
+	zone_nr z;
+	FILE *f;
+
+	minix_mount(device, &opts);
+	delalloc_set(TRUE);
+	cache_set_flush_hook(flush_delalloc_expired);
+
+	for(i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 13 + 5;
+	fs_lock_excl();
+	inode = new_node(sb.root_inode, "expire", S_IFREG | 0644);
+	write_buf(inode, buf, sizeof(buf), 0, TRUE);
+	if(delalloc_pending(inode) != EXPIRE_BLKS) {
+		printf("FAILED: %d blocks held back, not %d\n", 
+			delalloc_pending(inode), EXPIRE_BLKS);
+		ok = FALSE;
+	}
+	fs_unlock();
+
+	nanosleep(&wait, NULL);
+
+	fs_lock_excl();
+	if(delalloc_pending(inode) != 0) {
+		printf("FAILED: %d blocks still held back after %ds\n",
+			delalloc_pending(inode), EXPIRE_WAIT);
+		ok = FALSE;
+	}
+	if((f = fopen(device, "rb")) == NULL)
+		panic("expire(): unable to open %s", device);
+	for(i = 0; ok && i < EXPIRE_BLKS; i++) {
+		z = read_map(inode, i * BLOCK_SIZE);
+		if(z == NO_ZONE || fseek(f, (long) z * BLOCK_SIZE, SEEK_SET) ||
+			fread(got, 1, BLOCK_SIZE, f) != BLOCK_SIZE ||
+			memcmp(got, buf + i * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+			printf("FAILED: block %d not on disk after %ds\n", i,
+				EXPIRE_WAIT);
+			ok = FALSE;
+		}
+	}
+	fclose(f);
+	put_inode(inode);
+	fs_unlock();
+
+	cache_set_flush_hook(NULL);
+	minix_unmount();
+	delalloc_set(FALSE);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct cache_stats before, after;
+	int w, on, n, runs, total, worst, bad, pending, ok = 1;
+
+	save_image(device);
+	printf("%12s %8s %6s %8s %8s %6s %10s\n", "workload", "delalloc",
+		"files", "extents", "per file", "worst", "blks/read");
+	for(w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for(on = FALSE; on <= TRUE; on++) {
+			restore_image(device);
+			srand(1);
+			minix_mount(device, NULL);
+			run(&workloads[w], on);
+
+			/* blocks held back must read back too */
+			pending = delalloc_pending_all();
+			bad = read_files();
+			if(on && pending == 0) {
+				printf("FAILED: no blocks held back\n");
+				ok = 0;
+			}
+			minix_unmount();
+			delalloc_set(FALSE);
+
+			minix_mount(device, NULL);
+			total = worst = 0;
+			for(n = 0; n < nr_files; n++) {
+				runs = extents(n);
+				total += runs;
+				if(runs > worst)
+					worst = runs;
+			}
+			cache_get_stats(&before);
+			bad += read_files();
+			cache_get_stats(&after);
+			minix_unmount();
+
+			printf("%12s %8s %6d %8d %8.2f %6d %10.1f\n",
+				workloads[w].name, on ? "on" : "off", nr_files,
+				total, (double) total / nr_files, worst,
+				(double) (after.reads - before.reads) /
+				(after.read_calls - before.read_calls));
+			if(bad > 0) {
+				printf("FAILED: %d bytes read back wrong\n", bad);
+				ok = 0;
+			}
+		}
+	}
+	restore_image(device);
+	if(!expire(device))
+		ok = 0;
+	restore_image(device);
+	free_image();
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
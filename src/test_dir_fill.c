@@ -0,0 +1,128 @@
+/**
+ * Benchmark of filling one directory with NR_FILES files, as dir_add() has
+ * to find a free slot for each. Run three ways, with indexing off:
+ *	scan	- scanning from the start of the directory every time, as
+ *		  dir_add() used to, by clearing the free slot hint
+ *	hint	- scanning from the free slot hint
+ * and then with the directory index.
+ *
+ * Every tenth file is then unlinked and as many created again, which must
+ * fill the holes rather than grow the directory. The files are all unlinked
+ * afterwards so the inodes go round.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=DF.IMG bs=1M count=70
+ *	$ ./mkfs.somix DF.IMG
+ *
+ * usage: test_dir_fill [image]
+ */
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+#include "dir_index.h"
+
+#define DEVICE "DF.IMG"
+#define NR_FILES 10000
+
+#define SCAN 0
+#define HINT 1
+#define INDEX 2
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void create(struct minix_inode *dir, const char *name)
+{
+	put_inode(new_node(dir, name, S_IFREG | 0644));
+}
+
+/**
+ * Fills a new directory 'name'. Returns FALSE if it doesn't end up the size
+ * it should.
+ */
+static int fill(const char *name, int how)
+{
+	static char *names[] = { "scan", "hint", "index" };
+	struct minix_inode *dir, *inode;
+	struct cache_stats before, after;
+	char file[FILENAME_SIZE], path[64];
+	double start, elapsed;
+	int i, size, refilled;
+
+	dir_index_set_min(how == INDEX ? 0 : -1);
+	dir = new_node(sb.root_inode, name, S_IFDIR | 0755);
+
+	cache_get_stats(&before);
+	start = now();
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(file, "dummy_%d", i);
+		if(how == SCAN)
+			dir->i_free_hint = 0;
+		create(dir, file);
+	}
+	elapsed = now() - start;
+	cache_get_stats(&after);
+	size = dir->i_size;
+
+	printf("%8s %10.3f %10.1f\n", names[how],
+		elapsed, (double) (after.hits + after.misses - before.hits -
+		before.misses) / NR_FILES);
+
+	for(i = 0; i < NR_FILES; i += 10) {
+		sprintf(file, "dummy_%d", i);
+		inode = get_inode(dir_search(dir, file));
+		dir_delete(dir, file);
+		inode->i_nlinks--;
+		inode->i_dirty = TRUE;
+		put_inode(inode);
+	}
+	for(i = 0; i < NR_FILES; i += 10) {
+		sprintf(file, "again_%d", i);
+		create(dir, file);
+	}
+
+	refilled = dir->i_size;
+	put_inode(dir);
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(path, "/%s/%s_%d", name, i % 10 ? "dummy" : "again", i);
+		unlink(path);
+	}
+	if(size != (NR_FILES + 2) * DENTRY_SIZE || refilled != size) {
+		printf("FAILED: %s is %d bytes then %d, expected %d\n", name,
+			size, refilled, (NR_FILES + 2) * DENTRY_SIZE);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	int ok;
+
+	minix_mount(device, NULL);
+	printf("%d creates in one directory\n", NR_FILES);
+	printf("%8s %10s %10s\n", "slots", "secs", "blks/file");
+	ok = fill("scanned", SCAN);
+	ok &= fill("hinted", HINT);
+	ok &= fill("indexed", INDEX);
+	minix_unmount();
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
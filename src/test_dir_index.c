@@ -0,0 +1,172 @@
+/**
+ * Benchmark and check of the hashed directory index.
+ *
+ * NR_FILES files are created in one directory with the index off and in
+ * another with it on, each create preceded by the lookup FUSE makes to see
+ * that the name is free. Every third file is then unlinked and half as many
+ * new ones created in the holes. Both directories are checked to hold
+ * exactly the names they should, once looked up through the index and once
+ * by scanning, after remounts so the dentry cache is cold.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=DI.IMG bs=1M count=70
+ *	$ ./mkfs.somix DI.IMG
+ *
+ * usage: test_dir_index [image]
+ */
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "write.h"
+#include "dir_index.h"
+
+#define DEVICE "DI.IMG"
+#define NR_FILES 3000
+#define NR_REFILL (NR_FILES / 3 / 2)
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int exists(const char *path)
+{
+	struct minix_inode *inode;
+
+	if((inode = resolve_path(sb.root_inode, path, PATH_RESOLVE_ALL)) ==
+		NULL)
+		return FALSE;
+	put_inode(inode);
+	return TRUE;
+}
+
+static void create(const char *dir, const char *name)
+{
+	struct minix_inode *p_dir, *inode;
+	char path[64];
+
+	sprintf(path, "%s/%s", dir, name);
+	if(exists(path))
+		panic("create(): %s already exists", path);
+	p_dir = resolve_path(sb.root_inode, dir, PATH_RESOLVE_ALL);
+	inode = new_node(p_dir, name, S_IFREG | 0644);
+	put_inode(inode);
+	put_inode(p_dir);
+}
+
+/**
+ * Fills 'dir' and returns the seconds taken to create the first NR_FILES
+ * files.
+ */
+static double fill(const char *dir)
+{
+	char name[FILENAME_SIZE], path[64];
+	double start, elapsed;
+	int i;
+
+	start = now();
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(name, "dummy_%d", i);
+		create(dir, name);
+	}
+	elapsed = now() - start;
+
+	for(i = 0; i < NR_FILES; i += 3) {
+		sprintf(path, "%s/dummy_%d", dir, i);
+		unlink(path);
+	}
+	for(i = 0; i < NR_REFILL; i++) {
+		sprintf(name, "refill_%d", i);
+		create(dir, name);
+	}
+	return elapsed;
+}
+
+/**
+ * Returns the number of names in 'dir' that are wrongly there or not.
+ */
+static int check(const char *dir)
+{
+	char path[64];
+	int i, bad = 0;
+
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(path, "%s/dummy_%d", dir, i);
+		if(exists(path) != (i % 3 != 0))
+			bad++;
+	}
+	for(i = 0; i < NR_REFILL; i++) {
+		sprintf(path, "%s/refill_%d", dir, i);
+		if(!exists(path))
+			bad++;
+	}
+	sprintf(path, "%s/refill_%d", dir, NR_REFILL);
+	if(exists(path))
+		bad++;
+	return bad;
+}
+
+static int dir_size(const char *dir)
+{
+	struct minix_inode *inode;
+	int size;
+
+	inode = resolve_path(sb.root_inode, dir, PATH_RESOLVE_ALL);
+	size = inode->i_size;
+	put_inode(inode);
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct minix_inode *inode;
+	double linear, indexed;
+	int bad, ok = 1, run;
+
+	minix_mount(device, NULL);
+	inode = new_node(sb.root_inode, "linear", S_IFDIR | 0755);
+	put_inode(inode);
+	inode = new_node(sb.root_inode, "indexed", S_IFDIR | 0755);
+	put_inode(inode);
+
+	dir_index_set_min(-1);
+	linear = fill("/linear");
+	dir_index_set_min(0);
+	indexed = fill("/indexed");
+	printf("%d creates: scanning %.3fs, indexed %.3fs\n", NR_FILES,
+		linear, indexed);
+
+	if(dir_size("/linear") != dir_size("/indexed")) {
+		printf("FAILED: directory sizes differ, %d and %d\n",
+			dir_size("/linear"), dir_size("/indexed"));
+		ok = 0;
+	}
+	minix_unmount();
+
+	/* look up through the index, then by scanning */
+	for(run = 0; run < 2; run++) {
+		dir_index_set_min(run == 0 ? 0 : -1);
+		minix_mount(device, NULL);
+		if((bad = check("/linear") + check("/indexed")) > 0) {
+			printf("FAILED: %d names wrong %s\n", bad,
+				run == 0 ? "indexed" : "scanning");
+			ok = 0;
+		}
+		minix_unmount();
+	}
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
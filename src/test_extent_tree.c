@@ -0,0 +1,271 @@
+/**
+ * Check and benchmark of the free extent tree.
+ *
+ * First NR_OPS random runs of bits are freed and taken in a tree, and after
+ * each the tree must be a balanced AVL tree agreeing with a plain array of
+ * the bits on what is free, where extent_tree_find() finds runs and which is
+ * the longest.
+ *
+ * Then the file system is fragmented as fs_condition/fs_fragmented.sh does
+ * and NR_FILES files are appended to in turn, APPEND KB at a time. The
+ * number of runs on disk the files end up in is printed with the zone map's
+ * tree and without.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=ET.IMG bs=1M count=70
+ *	$ ./mkfs.somix ET.IMG
+ *
+ * usage: test_extent_tree [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+#include "extent_tree.h"
+
+#define DEVICE "ET.IMG"
+#define NR_BITS 5000
+#define NR_OPS 20000
+#define SMALLEST 64
+#define LARGEST 256
+#define WRITE_LIMIT (60 * 1024)
+#define NR_FILES 4
+#define FILE_KB 1024
+#define APPEND 32
+
+extern struct minix_super_block sb;
+
+static char is_free[NR_BITS];
+
+/**
+ * Checks the subtree at 'n' holds only extents between 'lo' and 'hi' that
+ * match is_free[], and returns its height. Returns -1 if anything is wrong.
+ */
+static int check_node(struct extent_node *n, int lo, int hi, int *nr_free)
+{
+	int l, r, i, max;
+
+	if(n == NULL)
+		return 0;
+	if(n->start < lo || n->start + n->len > hi || n->len <= 0)
+		return -1;
+	for(i = n->start; i < n->start + n->len; i++)
+		if(!is_free[i])
+			return -1;
+	if((n->start > 0 && is_free[n->start - 1]) ||
+		(n->start + n->len < NR_BITS && is_free[n->start + n->len]))
+		return -1;		/* should have been joined */
+	*nr_free += n->len;
+
+	l = check_node(n->left, lo, n->start, nr_free);
+	r = check_node(n->right, n->start + n->len, hi, nr_free);
+	if(l < 0 || r < 0 || abs(l - r) > 1 || n->height != 1 +
+		(l > r ? l : r))
+		return -1;
+	max = n->len;
+	if(n->left != NULL && n->left->max_len > max)
+		max = n->left->max_len;
+	if(n->right != NULL && n->right->max_len > max)
+		max = n->right->max_len;
+	return n->max_len == max ? n->height : -1;
+}
+
+/**
+ * extent_tree_find() done with is_free[].
+ */
+static int slow_find(int near, int len)
+{
+	int i, run, pass;
+
+	for(run = 0; near + run < NR_BITS && is_free[near + run]; run++)
+		;
+	if(run >= len)
+		return near;
+	for(pass = 0; pass < 2; pass++) {
+		for(i = pass == 0 ? near + 1 : 0; i < NR_BITS; i++) {
+			if(!is_free[i] || (i > 0 && is_free[i - 1]))
+				continue;	/* not the start of an extent */
+			for(run = 0; i + run < NR_BITS && is_free[i + run];
+				run++)
+				;
+			if(run >= len)
+				return i;
+		}
+	}
+	return -1;
+}
+
+static int slow_largest(void)
+{
+	int i, run = 0, max = 0;
+
+	for(i = 0; i < NR_BITS; i++) {
+		run = is_free[i] ? run + 1 : 0;
+		if(run > max)
+			max = run;
+	}
+	return max;
+}
+
+/**
+ * Returns the number of failed checks.
+ */
+static int check_tree(void)
+{
+	struct extent_tree *tree = extent_tree_new();
+	int op, start, len, i, near, want, nr_free, max, bad = 0;
+
+	for(op = 0; op < NR_OPS; op++) {
+		start = rand() % NR_BITS;
+		len = 1 + rand() % 16;
+		if(start + len > NR_BITS)
+			len = NR_BITS - start;
+
+		/* free the run if it's all taken, else take what's free
+		 * from start */
+		for(i = start; i < start + len && !is_free[i]; i++)
+			;
+		if(i == start + len) {
+			extent_tree_give(tree, start, len);
+			for(i = start; i < start + len; i++)
+				is_free[i] = 1;
+		}
+		else {
+			for(len = 0; start + len < NR_BITS &&
+				is_free[start + len] && len < 16; len++)
+				;
+			if(len > 0)
+				extent_tree_take(tree, start, len);
+			for(i = start; i < start + len; i++)
+				is_free[i] = 0;
+		}
+
+		nr_free = 0;
+		if(check_node(tree->root, 0, NR_BITS, &nr_free) < 0 ||
+			nr_free != tree->nr_free) {
+			printf("FAILED: tree wrong after op %d\n", op);
+			bad++;
+			break;
+		}
+
+		near = rand() % NR_BITS;
+		len = 1 + rand() % 32;
+		if((want = slow_find(near, len)) !=
+			extent_tree_find(tree, near, len)) {
+			printf("FAILED: extent_tree_find(%d, %d) got %d, "
+				"expected %d\n", near, len,
+				extent_tree_find(tree, near, len), want);
+			bad++;
+		}
+		if((max = extent_tree_largest(tree, &start)) !=
+			slow_largest() || (max > 0 && slow_find(start, max) !=
+			start)) {
+			printf("FAILED: largest extent %d at %d\n", max, start);
+			bad++;
+		}
+	}
+	printf("%d extents, %d bits free after %d changes\n", tree->nr_extents,
+		tree->nr_free, op);
+	extent_tree_destroy(tree);
+	return bad;
+}
+
+/**
+ * Writes files until WRITE_LIMIT KB have been written, then deletes every
+ * other one, as fs_fragmented.sh does.
+ */
+static void fragment(void)
+{
+	static char buf[LARGEST * 1024];
+	struct minix_inode *inode;
+	char name[FILENAME_SIZE], path[64];
+	int written = 0, count, i, size;
+
+	for(count = 0; written <= WRITE_LIMIT; count++) {
+		size = SMALLEST + rand() % (LARGEST - SMALLEST + 1);
+		sprintf(name, "dummy_%d", count);
+		inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+		if(write_buf(inode, buf, size * 1024, 0, FALSE) != size * 1024)
+			panic("fragment(): unable to write %s", name);
+		put_inode(inode);
+		written += size;
+	}
+	for(i = 0; i < count; i += 2) {
+		sprintf(path, "/dummy_%d", i);
+		unlink(path);
+	}
+}
+
+/**
+ * Appends to NR_FILES new files in turn and returns the number of runs on
+ * disk they end up in. The files are then deleted.
+ */
+static int append_runs(const char *prefix)
+{
+	static char buf[APPEND * 1024];
+	struct minix_inode *inodes[NR_FILES];
+	char name[FILENAME_SIZE], path[64];
+	int i, pos, z, runs = 0;
+	zone_nr prev, cur;
+
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(name, "%s_%d", prefix, i);
+		inodes[i] = new_node(sb.root_inode, name, S_IFREG | 0644);
+	}
+	for(pos = 0; pos < FILE_KB * 1024; pos += APPEND * 1024)
+		for(i = 0; i < NR_FILES; i++)
+			if(write_buf(inodes[i], buf, APPEND * 1024, pos,
+				FALSE) != APPEND * 1024)
+				panic("append_runs(): short write");
+
+	for(i = 0; i < NR_FILES; i++) {
+		prev = NO_ZONE;
+		for(z = 0; z < FILE_KB; z++) {
+			cur = read_map(inodes[i], z * BLOCK_SIZE);
+			if(cur != prev + 1)
+				runs++;
+			prev = cur;
+		}
+		put_inode(inodes[i]);
+		sprintf(path, "/%s_%d", prefix, i);
+		unlink(path);
+	}
+	return runs;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct extent_tree *tree;
+	int bad, with, without;
+
+	srand(1);
+	bad = check_tree();
+
+	minix_mount(device, NULL);
+	fragment();
+	tree = sb.zmap->tree;
+	printf("fragmented: %d free zones in %d extents\n", tree->nr_free,
+		tree->nr_extents);
+
+	sb.zmap->tree = NULL;
+	without = append_runs("without");
+	sb.zmap->tree = tree;
+	with = append_runs("with");
+	printf("%d files of %dKB appended %dKB at a time: %d runs without "
+		"tree, %d with\n", NR_FILES, FILE_KB, APPEND, without, with);
+	minix_unmount();
+
+	if(bad > 0)
+		printf("FAILED\n");
+	else
+		printf("passed\n");
+	return bad > 0;
+}
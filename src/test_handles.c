@@ -0,0 +1,179 @@
+/**
+ * Benchmark of finding a file by inode number, as somix_ll does, against
+ * resolving its path, as somix does, and check of unlink_at() and
+ * rename_at(), which somix_ll is built on.
+ *
+ * The attributes of a file DEPTH directories down are got NR_STATS times:
+ *	path	- its path resolved from the root each time
+ *	inode	- the inode got by number each time, the kernel having looked
+ *		  it up once
+ * The time taken and the get_block() calls made are printed.
+ *
+ * Then:
+ *	- a file renamed into another directory must be found there and not
+ *	  where it was.
+ *	- a file renamed over another must replace it, and the one replaced
+ *	  be freed.
+ *	- renaming a name onto itself changes nothing.
+ *	- unlink_at() and rename_at() of a name that isn't there fail.
+ *	- a file unlinked with unlink_at() is freed.
+ *	- dir_empty(), which somix_ll checks rmdir() with, is only TRUE for a
+ *	  directory with nothing but . and .. in it.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=HD.IMG bs=1M count=70
+ *	$ ./mkfs.somix HD.IMG
+ *
+ * usage: test_handles [image]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "read.h"
+#include "write.h"
+#include "bitmap.h"
+#include "extent_tree.h"
+#include "test_util.h"
+
+#define DEVICE "HD.IMG"
+#define DEPTH 16
+#define NR_STATS 100000
+
+extern struct minix_super_block sb;
+
+/**
+ * Makes a file of 'size' bytes, at most 8KB, in 'dir' and returns its inode
+ * number.
+ */
+static inode_nr make_file(struct minix_inode *dir, const char *name, int size)
+{
+	static char buf[8192];
+	struct minix_inode *inode;
+	inode_nr i_num;
+
+	inode = new_node(dir, name, S_IFREG | 0644);
+	write_buf(inode, buf, size, 0, TRUE);
+	i_num = inode->i_num;
+	put_inode(inode);
+	return i_num;
+}
+
+static void stats(const char *device)
+{
+	struct cache_stats before, after;
+	struct minix_inode *dir, *next, *inode;
+	struct stat st;
+	char path[DEPTH * 8 + 16], name[16];
+	inode_nr i_num;
+	int d, n, by_inode;
+	double start, elapsed;
+
+	minix_mount(device, NULL);
+	dir = get_inode(ROOT_INODE);
+	path[0] = '\0';
+	for(d = 0; d < DEPTH; d++) {
+		sprintf(name, "dir_%d", d);
+		sprintf(path + strlen(path), "/%s", name);
+		next = new_node(dir, name, S_IFDIR | 0755);
+		put_inode(dir);
+		dir = next;
+	}
+	i_num = make_file(dir, "file", 1234);
+	strcat(path, "/file");
+	put_inode(dir);
+
+	printf("getting the attributes of a file %d directories down %d "
+		"times\n", DEPTH, NR_STATS);
+	printf("%6s %10s %10s\n", "", "ms", "get_blocks");
+	for(by_inode = 0; by_inode <= 1; by_inode++) {
+		cache_get_stats(&before);
+		start = now();
+		for(n = 0; n < NR_STATS; n++) {
+			if(by_inode)
+				inode = get_inode(i_num);
+			else
+				inode = resolve_path(sb.root_inode, path,
+					PATH_RESOLVE_ALL);
+			stat_inode(inode, &st);
+			put_inode(inode);
+		}
+		elapsed = now() - start;
+		cache_get_stats(&after);
+		printf("%6s %10.3f %10lu\n", by_inode ? "inode" : "path",
+			elapsed * 1000,
+			(after.hits + after.misses) - (before.hits + before.misses));
+		check(st.st_ino == i_num && st.st_size == 1234,
+			"wrong attributes");
+	}
+	minix_unmount();
+}
+
+static void renames(const char *device)
+{
+	struct minix_inode *root, *a, *b;
+	inode_nr moved, kept, replaced;
+	int nr_free;
+
+	minix_mount(device, NULL);
+	root = sb.root_inode;
+	nr_free = sb.zmap->tree->nr_free;
+	a = new_node(root, "a", S_IFDIR | 0755);
+	b = new_node(root, "b", S_IFDIR | 0755);
+
+	check(dir_empty(a), "new directory not empty");
+	check(!dir_empty(root), "root directory empty");
+	moved = make_file(a, "moved", 100);
+	check(!dir_empty(a), "directory with a file empty");
+	check(rename_at(a, "moved", b, "here") == 1, "rename_at() failed");
+	check(dir_search(a, "moved") == NO_INODE, "renamed file still there");
+	check(dir_search(b, "here") == moved, "renamed file not moved");
+
+	kept = make_file(a, "kept", 100);
+	replaced = make_file(b, "replaced", 5000);
+	check(rename_at(a, "kept", b, "replaced") == 1,
+		"rename_at() over a file failed");
+	check(dir_search(b, "replaced") == kept, "file not replaced");
+	check(!test_bit(sb.imap, replaced), "replaced file not freed");
+
+	check(rename_at(b, "replaced", b, "replaced") == 1 &&
+		dir_search(b, "replaced") == kept && test_bit(sb.imap, kept),
+		"rename onto itself changed something");
+
+	check(rename_at(a, "missing", b, "x") == -ENOENT,
+		"rename_at() of a missing name");
+	check(unlink_at(a, "missing") == 0, "unlink_at() of a missing name");
+
+	check(unlink_at(b, "here") == 1 && unlink_at(b, "replaced") == 1,
+		"unlink_at() failed");
+	check(!test_bit(sb.imap, moved) && !test_bit(sb.imap, kept),
+		"unlinked files not freed");
+	check(dir_empty(a) && dir_empty(b), "emptied directory not empty");
+
+	put_inode(a);
+	put_inode(b);
+	unlink("/a");
+	unlink("/b");
+	check(sb.zmap->tree->nr_free == nr_free, "zones not all freed");
+	minix_unmount();
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+
+	stats(device);
+	renames(device);
+
+	printf("%s\n", test_failures > 0 ? "FAILED" : "passed");
+	return test_failures > 0;
+}
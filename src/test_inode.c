@@ -7,7 +7,7 @@
 
 int main(void)
 {
-	minix_mount(DEVICE);
+	minix_mount(DEVICE, NULL);
 
 	struct minix_inode *i1 = get_inode(1);
 	inode_print(i1);
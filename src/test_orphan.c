@@ -0,0 +1,269 @@
+/**
+ * Check of the orphan table and the reclaimer.
+ *
+ *	- a FILE_MB MB file is unlinked cold, without the reclaimer and then
+ *	  with it. The time taken and the get_block() calls made are printed.
+ *	  With the reclaimer the file must be in the orphan table until it
+ *	  has run and every zone it had free afterwards.
+ *	- a file unlinked while open must still read back and only be freed
+ *	  once it is closed.
+ *	- an orphan left in the table by a crash, which is simulated by
+ *	  keeping a copy of the image as it was synced with the file open and
+ *	  unlinked, must be freed when that copy is mounted.
+ *	- the same without the sync, with the flusher off, so that only what
+ *	  unlink() wrote to disk itself is in the copy. The file must be gone
+ *	  from its directory and freed when the copy is mounted.
+ *	- more files unlinked while open than the table holds are still all
+ *	  freed.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=OR.IMG bs=1M count=70
+ *	$ ./mkfs.somix OR.IMG
+ *
+ * usage: test_orphan [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "read.h"
+#include "write.h"
+#include "bitmap.h"
+#include "extent_tree.h"
+#include "orphan.h"
+#include "test_util.h"
+
+#define DEVICE "OR.IMG"
+#define FILE_MB 40
+#define CHUNK (32 * 1024)
+#define NR_OPEN (ORPHAN_MAX + 20)
+
+extern struct minix_super_block sb;
+
+/**
+ * Creates file 'name' of 'kb' KB and returns its inode.
+ */
+static struct minix_inode *make_file(const char *name, int kb)
+{
+	static char buf[CHUNK];
+	struct minix_inode *inode;
+	int pos, i;
+
+	for(i = 0; i < CHUNK; i++)
+		buf[i] = i % 251;
+	inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+	for(pos = 0; pos < kb * 1024; pos += CHUNK)
+		if(write_buf(inode, buf, CHUNK, pos, TRUE) != CHUNK)
+			panic("make_file(): short write");
+	return inode;
+}
+
+/**
+ * Unlinks a big file after a remount, with the reclaimer or not.
+ */
+static void unlink_big(const char *device, int background)
+{
+	struct cache_stats before, after;
+	struct minix_inode *inode;
+	inode_nr i_num;
+	int nr_free;
+	double start, elapsed;
+
+	minix_mount(device, NULL);
+	nr_free = sb.zmap->tree->nr_free;
+	inode = make_file("big", FILE_MB * 1024);
+	i_num = inode->i_num;
+	put_inode(inode);
+	minix_unmount();
+
+	minix_mount(device, NULL);
+	if(background)
+		reclaimer_start();
+
+	/* held so that the reclaimer can't start until we've looked */
+	fs_lock_excl();
+	cache_get_stats(&before);
+	start = now();
+	unlink("/big");
+	elapsed = now() - start;
+	cache_get_stats(&after);
+	printf("%10s %10.3f %10lu %10lu\n", background ? "background" :
+		"sync", elapsed * 1000,
+		(after.hits + after.misses) - (before.hits + before.misses),
+		after.reads - before.reads);
+	if(background)
+		check(orphan_count() == 1 && sb.zmap->tree->nr_free < nr_free,
+			"unlinked file not left to the reclaimer");
+	fs_unlock();
+
+	reclaimer_stop();
+	check(orphan_count() == 0, "orphan left in the table");
+	check(sb.zmap->tree->nr_free == nr_free, "zones not freed");
+	check(!test_bit(sb.imap, i_num), "inode not freed");
+	minix_unmount();
+}
+
+/**
+ * Unlinks a file while it is open, then closes it.
+ */
+static void unlink_open(const char *device)
+{
+	static char buf[CHUNK];
+	struct minix_inode *inode;
+	int nr_free;
+
+	minix_mount(device, NULL);
+	reclaimer_start();
+	nr_free = sb.zmap->tree->nr_free;
+
+	fs_lock_excl();
+	inode = make_file("open", 64);
+	unlink("/open");
+	fs_unlock();
+
+	check(orphan_count() == 1, "open file not in the table");
+	check(minix_read(inode, buf, CHUNK, CHUNK, NULL) == CHUNK &&
+		buf[7] == 7, "open file not readable after unlink");
+	check(sb.zmap->tree->nr_free < nr_free, "open file freed");
+
+	fs_lock_excl();
+	put_inode(inode);
+	fs_unlock();
+	reclaimer_stop();
+	check(orphan_count() == 0 && sb.zmap->tree->nr_free == nr_free,
+		"closed file not freed");
+	minix_unmount();
+}
+
+/**
+ * Syncs with a file open and unlinked, keeps a copy of the image as it is
+ * then, and mounts the copy later on.
+ */
+static void crash(const char *device)
+{
+	struct minix_inode *inode;
+	inode_nr i_num;
+	int nr_free;
+
+	minix_mount(device, NULL);
+	nr_free = sb.zmap->tree->nr_free;
+	inode = make_file("crash", 1024);
+	i_num = inode->i_num;
+	unlink("/crash");
+	sync_cache();
+	save_image(device);
+	put_inode(inode);
+	minix_unmount();
+
+	restore_image(device);
+	minix_mount(device, NULL);
+	check(orphan_count() == 0, "orphan left in the table after crash");
+	check(sb.zmap->tree->nr_free == nr_free, "zones not freed after crash");
+	check(!test_bit(sb.imap, i_num), "inode not freed after crash");
+	minix_unmount();
+}
+
+/**
+ * Keeps a copy of the image as it is straight after a file is unlinked while
+ * open, with nothing else written, and mounts the copy later on.
+ */
+static void crash_unsynced(const char *device)
+{
+	struct cache_opts opts;
+	struct minix_inode *inode;
+	inode_nr i_num;
+	int nr_free;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flush_interval = -1;
+
+	minix_mount(device, NULL);
+	nr_free = sb.zmap->tree->nr_free;
+	inode = make_file("unsynced", 1024);
+	i_num = inode->i_num;
+	put_inode(inode);
+	minix_unmount();
+
+	minix_mount(device, &opts);
+	inode = resolve_path(sb.root_inode, "/unsynced", PATH_RESOLVE_ALL);
+	unlink("/unsynced");
+	save_image(device);
+	put_inode(inode);
+	minix_unmount();
+
+	restore_image(device);
+	minix_mount(device, NULL);
+	check(resolve_path(sb.root_inode, "/unsynced", PATH_RESOLVE_ALL) ==
+		NULL, "unlinked name still there after unsynced crash");
+	check(orphan_count() == 0, "orphan left in the table after unsynced "
+		"crash");
+	check(sb.zmap->tree->nr_free == nr_free, "zones not freed after "
+		"unsynced crash");
+	check(!test_bit(sb.imap, i_num), "inode not freed after unsynced "
+		"crash");
+	minix_unmount();
+}
+
+/**
+ * Unlinks more open files than the table holds.
+ */
+static void overflow(const char *device)
+{
+	struct minix_inode *inodes[NR_OPEN];
+	inode_nr i_nums[NR_OPEN];
+	char name[FILENAME_SIZE], path[64];
+	int i, nr_free, freed = 1;
+
+	minix_mount(device, NULL);
+	reclaimer_start();
+	nr_free = sb.zmap->tree->nr_free;
+
+	fs_lock_excl();
+	for(i = 0; i < NR_OPEN; i++) {
+		sprintf(name, "open_%d", i);
+		inodes[i] = make_file(name, 1);
+		i_nums[i] = inodes[i]->i_num;
+		sprintf(path, "/open_%d", i);
+		unlink(path);
+	}
+	check(orphan_count() == ORPHAN_MAX, "orphan table not filled");
+	for(i = 0; i < NR_OPEN; i++)
+		put_inode(inodes[i]);
+	fs_unlock();
+
+	reclaimer_stop();
+	for(i = 0; i < NR_OPEN; i++)
+		if(test_bit(sb.imap, i_nums[i]))
+			freed = 0;
+	check(freed && orphan_count() == 0 && sb.zmap->tree->nr_free ==
+		nr_free, "not every file freed with the table full");
+	minix_unmount();
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+
+	printf("unlinking a %dMB file cold\n", FILE_MB);
+	printf("%10s %10s %10s %10s\n", "", "ms", "get_blocks", "reads");
+	unlink_big(device, FALSE);
+	unlink_big(device, TRUE);
+	unlink_open(device);
+	crash(device);
+	crash_unsynced(device);
+	overflow(device);
+
+	free_image();
+
+	printf("%s\n", test_failures > 0 ? "FAILED" : "passed");
+	return test_failures > 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * Check of reservation windows and preallocate().
+ *
+ *	- NR_FILES files are appended to in turn a block at a time, as
+ *	  concurrent writers would, without windows and then with. The runs
+ *	  of zones on disk they end up in are printed, and once the files are
+ *	  closed every zone set aside must be free again.
+ *	- preallocate() must give a file zeroed zones and grow it, or with
+ *	  'keep_size' only set zones aside, which the file's writes then use.
+ *	- a request for more zones than are free must fail with -ENOSPC, and
+ *	  zones set aside for one file must be given up when another needs
+ *	  them.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=PA.IMG bs=1M count=70
+ *	$ ./mkfs.somix PA.IMG
+ *
+ * usage: test_prealloc [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+#include "extent_tree.h"
+#include "test_util.h"
+
+#define DEVICE "PA.IMG"
+#define NR_FILES 8
+#define FILE_KB 512
+#define PREALLOC_KB 300
+
+extern struct minix_super_block sb;
+
+/**
+ * Returns the number of runs of zones on disk the first 'kb' KB of the file
+ * are in.
+ */
+static int runs(struct minix_inode *inode, int kb)
+{
+	zone_nr prev = NO_ZONE, cur;
+	int z, n = 0;
+
+	for(z = 0; z < kb; z++) {
+		cur = read_map(inode, z * BLOCK_SIZE);
+		if(cur != prev + 1)
+			n++;
+		prev = cur;
+	}
+	return n;
+}
+
+/**
+ * Appends to NR_FILES new files in turn, a block at a time, and returns the
+ * runs of zones they end up in. The files are then deleted.
+ */
+static int append_runs(const char *prefix)
+{
+	static char buf[BLOCK_SIZE];
+	struct minix_inode *inodes[NR_FILES];
+	char name[FILENAME_SIZE], path[64];
+	int i, pos, n = 0, nr_free = sb.zmap->tree->nr_free;
+
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(name, "%s_%d", prefix, i);
+		inodes[i] = new_node(sb.root_inode, name, S_IFREG | 0644);
+	}
+	for(pos = 0; pos < FILE_KB * 1024; pos += BLOCK_SIZE)
+		for(i = 0; i < NR_FILES; i++)
+			if(write_buf(inodes[i], buf, BLOCK_SIZE, pos, TRUE) !=
+				BLOCK_SIZE)
+				panic("append_runs(): short write");
+
+	for(i = 0; i < NR_FILES; i++) {
+		n += runs(inodes[i], FILE_KB);
+		put_inode(inodes[i]);
+	}
+	check(sb.zmap->tree->nr_free == nr_free - NR_FILES * (FILE_KB + 1),
+		"zones still set aside after close");
+
+	for(i = 0; i < NR_FILES; i++) {
+		sprintf(path, "/%s_%d", prefix, i);
+		unlink(path);
+	}
+	check(sb.zmap->tree->nr_free == nr_free, "zones lost");
+	return n;
+}
+
+static void check_prealloc(void)
+{
+	static char buf[PREALLOC_KB * 1024];
+	struct extent_tree *tree = sb.zmap->tree;
+	struct minix_inode *a, *b;
+	int i, nr_free, zero = 1;
+
+	/* zeroed zones, and the file grows to cover them */
+	a = new_node(sb.root_inode, "prealloc_a", S_IFREG | 0644);
+	for(i = 0; i < sizeof(buf); i++)
+		buf[i] = 'x';
+	write_buf(a, buf, 1000, 0, TRUE);
+	check(preallocate(a, 0, PREALLOC_KB * 1024, FALSE) == 0,
+		"preallocate() failed");
+	check(a->i_size == PREALLOC_KB * 1024, "file not grown");
+	check(minix_read(a, buf, sizeof(buf), 0, NULL) == sizeof(buf),
+		"short read");
+	for(i = 1000; i < sizeof(buf); i++)
+		if(buf[i] != 0)
+			zero = 0;
+	check(buf[0] == 'x' && buf[999] == 'x' && zero,
+		"data wrong after preallocate()");
+	check(runs(a, PREALLOC_KB) <= 2, "preallocated zones not together");
+
+	/* zones only set aside, then written into */
+	b = new_node(sb.root_inode, "prealloc_b", S_IFREG | 0644);
+	nr_free = tree->nr_free;
+	check(preallocate(b, 0, PREALLOC_KB * 1024, TRUE) == 0,
+		"preallocate() with keep_size failed");
+	check(b->i_size == 0 && tree->nr_free == nr_free - PREALLOC_KB,
+		"keep_size didn't set the zones aside");
+	for(i = 0; i < PREALLOC_KB; i++) {
+		write_buf(b, buf, BLOCK_SIZE, i * BLOCK_SIZE, TRUE);
+		write_buf(a, buf, BLOCK_SIZE, (PREALLOC_KB + i) * BLOCK_SIZE,
+			TRUE);
+	}
+	check(runs(b, PREALLOC_KB) <= 2, "writes didn't use the zones aside");
+
+	/* too much */
+	nr_free = tree->nr_free;
+	check(preallocate(b, b->i_size, (tree->nr_free + 100) * 1024, FALSE) ==
+		-ENOSPC, "preallocate() of too much didn't fail");
+	check(b->i_size == PREALLOC_KB * 1024, "file changed by failure");
+
+	/* a, still open, sets aside all but a few zones, which b then runs
+	 * out of */
+	check(preallocate(a, a->i_size, (tree->nr_free - 200) * 1024, TRUE) ==
+		0, "preallocate() of the rest failed");
+	check(tree->nr_free == 200, "the rest not set aside");
+	for(i = 0; i < 300; i++)
+		write_buf(b, buf, BLOCK_SIZE, b->i_size, TRUE);
+	check(b->i_size == (PREALLOC_KB + 300) * 1024 && a->i_resv_len == 0,
+		"zones set aside not given up");
+
+	put_inode(a);
+	put_inode(b);
+	unlink("/prealloc_a");
+	unlink("/prealloc_b");
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	int without, with;
+
+	minix_mount(device, NULL);
+
+	resv_set_zones(-1);
+	without = append_runs("without");
+	resv_set_zones(0);
+	with = append_runs("with");
+	printf("%d files of %dKB appended a block at a time: %d runs without "
+		"windows, %d with\n", NR_FILES, FILE_KB, without, with);
+	check(with < without, "windows didn't help");
+
+	check_prealloc();
+	minix_unmount();
+
+	printf("%s\n", test_failures > 0 ? "FAILED" : "passed");
+	return test_failures > 0;
+}
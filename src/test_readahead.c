@@ -0,0 +1,151 @@
+/**
+ * Benchmark of sequential file reads with and without readahead.
+ *
+ * Fills the image with files the way fs_condition/fs_create_files.sh does,
+ * randomly sized between 64 and 256KB until about 20MB has been written. The
+ * image is then remounted so the cache starts cold and every file is read
+ * back start to finish in READ_CHUNK sized reads, first with readahead off
+ * and then on, with each I/O backend. The contents read are checked in every
+ * run.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=RA.IMG bs=1M count=70
+ *	$ ./mkfs.somix RA.IMG
+ *
+ * usage: test_readahead [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+
+#define DEVICE "RA.IMG"
+#define SMALLEST 64		/* KB, as in fs_create_files.sh */
+#define LARGEST 256
+#define WRITE_LIMIT (20 * 1024)
+#define MAX_FILES (WRITE_LIMIT / SMALLEST + 1)
+#define READ_CHUNK 4096
+
+extern struct minix_super_block sb;
+
+static inode_nr files[MAX_FILES];
+static int nr_files = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Byte 'pos' of file 'n' as written by create_files().
+ */
+static char file_byte(int n, int pos)
+{
+	return (char) (n * 31 + pos / BLOCK_SIZE);
+}
+
+static void create_files(void)
+{
+	static char buf[LARGEST * 1024];
+	struct minix_inode *inode;
+	char name[FILENAME_SIZE];
+	unsigned int seed = 1;
+	int total = 0, size, i;
+
+	while(total <= WRITE_LIMIT) {
+		size = SMALLEST + rand_r(&seed) % (LARGEST - SMALLEST + 1);
+		for(i = 0; i < size * 1024; i++)
+			buf[i] = file_byte(nr_files, i);
+
+		sprintf(name, "dummy_%d", nr_files);
+		inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+		if(write_buf(inode, buf, size * 1024, 0, FALSE) != size * 1024)
+			panic("create_files(): unable to write %s", name);
+		files[nr_files++] = inode->i_num;
+		put_inode(inode);
+		total += size;
+	}
+	printf("%d files successfully written, %dKB\n", nr_files, total);
+}
+
+/**
+ * Reads every file through once. Returns the number of bad bytes read.
+ */
+static int read_files(int ra_max)
+{
+	static char buf[READ_CHUNK];
+	struct minix_inode *inode;
+	struct readahead ra;
+	int bad = 0, n, got, pos, i;
+
+	for(n = 0; n < nr_files; n++) {
+		inode = get_inode(files[n]);
+		ra_init(&ra, ra_max);
+		for(pos = 0; pos < inode->i_size; pos += got) {
+			got = minix_read(inode, buf, READ_CHUNK, pos, &ra);
+			if(got <= 0)
+				panic("read_files(): short read of file %d", n);
+			for(i = 0; i < got; i++)
+				if(buf[i] != file_byte(n, pos + i))
+					bad++;
+		}
+		put_inode(inode);
+	}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct {
+		int ra_max;
+		char *io;
+	} runs[] = { { 0, "sync" }, { RA_MAX, "sync" }, { RA_MAX, "uring" } };
+	struct cache_opts opts = { 0 };
+	struct cache_stats before, after;
+	double start, elapsed;
+	int i, bad, ok = 1;
+
+	minix_mount(device, NULL);
+	create_files();
+	minix_unmount();
+
+	printf("%10s %6s %10s %10s %10s %10s\n", "readahead", "io", "secs",
+		"blocks", "reads", "blks/read");
+	for(i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+		opts.io = runs[i].io;
+		minix_mount(device, &opts);	/* start cold */
+		cache_get_stats(&before);
+		start = now();
+		bad = read_files(runs[i].ra_max);
+		elapsed = now() - start;
+		cache_get_stats(&after);
+		minix_unmount();
+
+		printf("%10d %6s %10.3f %10lu %10lu %10.1f\n", runs[i].ra_max, 
+			runs[i].io, elapsed,
+			after.reads - before.reads,
+			after.read_calls - before.read_calls,
+			(double) (after.reads - before.reads) /
+			(after.read_calls - before.read_calls));
+		if(bad > 0) {
+			printf("FAILED: %d bytes read back wrong\n", bad);
+			ok = 0;
+		}
+	}
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
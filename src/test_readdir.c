@@ -0,0 +1,257 @@
+/**
+ * Benchmark and check of read_dir().
+ *
+ * A directory of NR_FILES files, each a different size, is listed with
+ * every file's attributes, as ls -l lists it, after a remount so that
+ * nothing is cached:
+ *	old	- the names read as readdir used to, then each file's path
+ *		  resolved for its attributes as getattr does
+ *	new	- read_dir() giving the attributes with the names in one pass
+ * The time taken, the get_block() calls made, the blocks read and the reads
+ * they took, and the lookups the dentry cache couldn't answer are printed.
+ * Both must list every file once with the right size.
+ *
+ * Then the directory is listed PIECE entries at a time, each listing
+ * carrying on from the offset the last one stopped at, which must give the
+ * same entries in the same order.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=RD.IMG bs=1M count=70
+ *	$ ./mkfs.somix RD.IMG
+ *
+ * usage: test_readdir [image]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "path.h"
+#include "read.h"
+#include "write.h"
+#include "dcache.h"
+#include "test_util.h"
+
+#define DEVICE "RD.IMG"
+#define NR_FILES 10000
+#define NR_ENTRIES (NR_FILES + 2)	/* with . and .. */
+#define PIECE 100
+
+extern struct minix_super_block sb;
+
+/* what a listing found */
+static struct entry {
+	char name[FILENAME_SIZE + 1];
+	inode_nr i_num;
+	int size;
+} listed[NR_ENTRIES];
+static int nr_listed;
+
+/**
+ * The name of file n. Some are as long as path lookups take.
+ */
+static void file_name(int n, char *name)
+{
+	if(n % 10 == 0)
+		sprintf(name, "long_name_of_twenty_nine_%04d", n);
+	else
+		sprintf(name, "file_%d", n);
+}
+
+/**
+ * Checks the listing holds every file once, with its size.
+ */
+static void check_listed(const char *what)
+{
+	static char seen[NR_FILES];
+	char name[FILENAME_SIZE + 1];
+	int e, n, wrong = 0;
+
+	memset(seen, 0, sizeof(seen));
+	for(e = 0; e < nr_listed; e++) {
+		if(strcmp(listed[e].name, ".") == 0 ||
+			strcmp(listed[e].name, "..") == 0)
+			continue;
+		if(sscanf(listed[e].name, "file_%d", &n) != 1 &&
+			sscanf(listed[e].name, "long_name_of_twenty_nine_%d",
+			&n) != 1)
+			n = -1;
+		if(n >= 0 && n < NR_FILES)
+			file_name(n, name);
+		if(n < 0 || n >= NR_FILES || strcmp(name, listed[e].name) != 0 ||
+			seen[n]++ || listed[e].size != n % 1000 + 1)
+			wrong++;
+	}
+	if(nr_listed != NR_ENTRIES || wrong > 0) {
+		printf("FAILED: %s: %d entries listed, %d wrong\n", what,
+			nr_listed, wrong);
+		test_failures++;
+	}
+}
+
+static void make_dir(const char *device)
+{
+	static char buf[1000];
+	struct minix_inode *dir, *inode;
+	char name[FILENAME_SIZE + 1];
+	int n;
+
+	minix_mount(device, NULL);
+	dir = new_node(sb.root_inode, "dir", S_IFDIR | 0755);
+	for(n = 0; n < NR_FILES; n++) {
+		file_name(n, name);
+		inode = new_node(dir, name, S_IFREG | 0644);
+		write_buf(inode, buf, n % 1000 + 1, 0, TRUE);
+		put_inode(inode);
+	}
+	put_inode(dir);
+	minix_unmount();
+}
+
+/**
+ * Lists the directory as readdir used to, a name at a time.
+ */
+static void list_old(struct minix_inode *dir)
+{
+	struct minix_block *blk;
+	zone_nr z;
+	int pos, i;
+
+	for(pos = 0; (z = read_map(dir, pos)) != NO_ZONE; pos += BLOCK_SIZE) {
+		blk = get_block(z, TRUE);
+		for(i = 0; i < BLOCK_SIZE; i += DENTRY_SIZE) {
+			if(*(inode_nr *) (blk->blk_data + i) == NO_INODE)
+				continue;
+			strncpy(listed[nr_listed].name, blk->blk_data + i + 2,
+				FILENAME_SIZE);
+			listed[nr_listed++].name[FILENAME_SIZE] = '\0';
+		}
+		put_block(blk, DIR_BLOCK);
+	}
+}
+
+static int fill_all(void *arg, const char *name, struct minix_inode *inode,
+	off_t next)
+{
+	strcpy(listed[nr_listed].name, name);
+	listed[nr_listed].i_num = inode->i_num;
+	listed[nr_listed++].size = inode->i_size;
+	return 0;
+}
+
+/**
+ * Stops every PIECE entries, setting *arg to where to carry on from.
+ */
+static int fill_piece(void *arg, const char *name, struct minix_inode *inode,
+	off_t next)
+{
+	fill_all(arg, name, inode, next);
+	if(nr_listed % PIECE == 0) {
+		*(off_t *) arg = next;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Lists the directory cold with the attributes of every entry, with
+ * read_dir() if 'new' or the old way.
+ */
+static void ls_l(const char *device, int new)
+{
+	struct cache_stats before, after;
+	struct dcache_stats ds_before, ds_after;
+	struct minix_inode *dir, *inode;
+	char path[64];
+	int e;
+	double start, elapsed;
+
+	minix_mount(device, NULL);
+	dir = resolve_path(sb.root_inode, "/dir", PATH_RESOLVE_ALL);
+	nr_listed = 0;
+
+	cache_get_stats(&before);
+	dcache_get_stats(&ds_before);
+	start = now();
+	if(new)
+		read_dir(dir, 0, fill_all, NULL);
+	else {
+		list_old(dir);
+		for(e = 0; e < nr_listed; e++) {
+			sprintf(path, "/dir/%.30s", listed[e].name);
+			inode = resolve_path(sb.root_inode, path, 
+				PATH_RESOLVE_ALL);
+			listed[e].size = inode->i_size;
+			put_inode(inode);
+		}
+	}
+	elapsed = now() - start;
+	cache_get_stats(&after);
+	dcache_get_stats(&ds_after);
+
+	printf("%6s %10.3f %10lu %10lu %10lu %10lu\n", new ? "new" : "old",
+		elapsed * 1000,
+		(after.hits + after.misses) - (before.hits + before.misses),
+		after.reads - before.reads,
+		after.read_calls - before.read_calls,
+		ds_after.misses - ds_before.misses);
+	check_listed(new ? "new" : "old");
+
+	put_inode(dir);
+	minix_unmount();
+}
+
+static void in_pieces(const char *device)
+{
+	static struct entry all[NR_ENTRIES];
+	struct minix_inode *dir;
+	off_t offset = 0, stop_at;
+	int nr_all, calls = 0;
+
+	minix_mount(device, NULL);
+	dir = resolve_path(sb.root_inode, "/dir", PATH_RESOLVE_ALL);
+
+	nr_listed = 0;
+	read_dir(dir, 0, fill_all, NULL);
+	nr_all = nr_listed;
+	memcpy(all, listed, sizeof(all));
+
+	nr_listed = 0;
+	for(;;) {
+		stop_at = -1;
+		read_dir(dir, offset, fill_piece, &stop_at);
+		calls++;
+		if(stop_at < 0)
+			break;
+		offset = stop_at;
+	}
+	check_listed("in pieces");
+	check(nr_listed == nr_all && memcmp(all, listed, sizeof(all)) == 0,
+		"listed in pieces differently");
+	check(calls == NR_ENTRIES / PIECE + 1, "wrong number of pieces");
+
+	put_inode(dir);
+	minix_unmount();
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+
+	make_dir(device);
+	printf("ls -l of a directory of %d files\n", NR_FILES);
+	printf("%6s %10s %10s %10s %10s %10s\n", "", "ms", "get_blocks",
+		"reads", "read calls", "dcache miss");
+	ls_l(device, FALSE);
+	ls_l(device, TRUE);
+	in_pieces(device);
+
+	printf("%s\n", test_failures > 0 ? "FAILED" : "passed");
+	return test_failures > 0;
+}
@@ -11,7 +11,7 @@ int main(int argc, char **argv)
 {
 	printf("attempting to mount TEST1.IMG...\n");
 
-	minix_mount("TEST1.IMG");
+	minix_mount("TEST1.IMG", NULL);
 	if(argc != 2)
 		panic("usage: test_resolv_path [path]\n");
 		
@@ -0,0 +1,310 @@
+/**
+ * Benchmark and check of truncate().
+ *
+ * A FILE_MB MB file is written and then truncated two ways, straight away and
+ * after a remount so that its indirect blocks must be read in:
+ *	old	- truncate() as it was, a read_map() and free_zone() for each
+ *		  block of the file
+ *	new	- truncate() walking the zone map once and freeing runs of
+ *		  zones with free_zones()
+ * The time taken, the get_block() calls made and the blocks read are
+ * printed. Both must leave every zone the file had free, with the bitmap
+ * and the free extent tree agreeing.
+ *
+ * Then truncate_to() cuts a file spanning its double indirect block down in
+ * steps, each ending inside or on the edge of one of its maps, and grows it
+ * again. After each the file must read back right, with what is past the
+ * old end reading as zeros, and hold just the zones its size needs. 
+ * Trimming the last block of the big file must only touch its maps on the
+ * way to that block.
+ *
+ * A v1 file system has at most 64MB of zones so the file is a little less.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=TR.IMG bs=1M count=70
+ *	$ ./mkfs.somix TR.IMG
+ *
+ * usage: test_truncate [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+#include "extent_tree.h"
+#include "delalloc.h"
+
+#define DEVICE "TR.IMG"
+#define FILE_MB 60
+#define CHUNK (32 * 1024)
+#define STEPS_KB 700		/* file cut down in steps */
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * truncate() as it was, but for freeing all of the double indirect block's
+ * indirect blocks rather than the first half.
+ */
+static void old_truncate(struct minix_inode *inode)
+{
+	int pos;
+	zone_nr dbl_z, *iz;
+	struct minix_block *blk;
+	int i;
+	zone_nr z;
+
+	for(pos = 0; pos < inode->i_size; pos += BLOCK_SIZE) {
+		if((z = read_map(inode, pos)) != NO_ZONE)
+			free_zone(z);
+	}
+
+	free_zone(inode->i_zone[NR_DZONE_NUM]);
+
+	if((dbl_z = inode->i_zone[NR_DZONE_NUM + 1]) != NO_ZONE) {
+		blk = get_block(dbl_z, TRUE);
+		for(iz = (zone_nr *) blk->blk_data;
+			iz < (zone_nr *) blk->blk_data + NR_INDIRECTS; iz++) {
+			free_zone(*iz);
+		}
+		put_block(blk, INDIRECT_BLOCK);
+		free_zone(dbl_z);
+	}
+
+	inode->i_size = 0;
+	inode->i_dirty = TRUE;
+	for(i = 0; i < NR_ZONE_NUMS; i++)
+		inode->i_zone[i] = NO_ZONE;
+	map_cache_clear(inode);
+}
+
+/**
+ * Returns the number of zones set in the bitmap.
+ */
+static int zones_set(void)
+{
+	int nr, set = 0;
+
+	for(nr = 0; nr < sb.zmap->num_bits; nr++)
+		if(sb.zmap->blocks[nr / BITS_PER_BLOCK]->blk_data[
+			(nr % BITS_PER_BLOCK) >> 3] & (1 << (nr & 7)))
+			set++;
+	return set;
+}
+
+/**
+ * Writes the file and truncates it with 'trunc', after remounting if 'cold'.
+ * Returns the number of failed checks.
+ */
+static int run(const char *device, const char *name,
+	void (*trunc)(struct minix_inode *), int cold)
+{
+	static char buf[CHUNK];
+	struct cache_stats before, after;
+	struct minix_inode *inode;
+	inode_nr i_num;
+	int pos, nr_free, bad = 0;
+	double start, elapsed;
+
+	minix_mount(device, NULL);
+	nr_free = sb.zmap->tree->nr_free;
+	inode = new_node(sb.root_inode, "big", S_IFREG | 0644);
+	for(pos = 0; pos < FILE_MB * 1024 * 1024; pos += CHUNK)
+		if(write_buf(inode, buf, CHUNK, pos, TRUE) != CHUNK)
+			panic("run(): short write");
+	if(cold) {
+		i_num = inode->i_num;
+		put_inode(inode);
+		minix_unmount();
+		minix_mount(device, NULL);
+		inode = get_inode(i_num);
+	}
+	cache_get_stats(&before);
+	start = now();
+	trunc(inode);
+	elapsed = now() - start;
+	cache_get_stats(&after);
+
+	printf("%6s %6s %10.3f %10lu %10lu\n", name, cold ? "cold" : "warm",
+		elapsed * 1000,
+		(after.hits + after.misses) - (before.hits + before.misses),
+		after.reads - before.reads);
+	if(sb.zmap->tree->nr_free != nr_free ||
+		zones_set() != sb.zmap->num_bits - nr_free) {
+		printf("FAILED: %d zones free after truncate, expected %d\n",
+			sb.zmap->tree->nr_free, nr_free);
+		bad++;
+	}
+	put_inode(inode);
+	unlink("/big");
+	minix_unmount();
+	return bad;
+}
+
+static char file_byte(int pos)
+{
+	return pos % 251 + 1;
+}
+
+/**
+ * The zones a file of 'blocks' blocks, none of them holes, has.
+ */
+static int zones_needed(int blocks)
+{
+	int n = blocks;
+
+	if(blocks > NR_DZONE_NUM)
+		n++;
+	if(blocks > NR_DZONE_NUM + NR_INDIRECTS)
+		n += 1 + (blocks - NR_DZONE_NUM - NR_INDIRECTS + 
+			NR_INDIRECTS - 1) / NR_INDIRECTS;
+	return n;
+}
+
+/**
+ * Checks the file is 'size' bytes, the first 'data' of them as written and
+ * the rest zeros, and that 'zones' zones less than 'nr_free' are free.
+ */
+static int check_file(struct minix_inode *inode, int size, int data, 
+	int nr_free, int zones, const char *what)
+{
+	static char buf[STEPS_KB * 2 * 1024];
+	int i, wrong = 0;
+
+	release_reservation(inode);	/* not counted as free */
+	if(inode->i_size != size || minix_read(inode, buf, sizeof(buf), 0,
+		NULL) != size)
+		wrong++;
+	for(i = 0; i < size && !wrong; i++)
+		if(buf[i] != (i < data ? file_byte(i) : 0))
+			wrong++;
+	if(wrong)
+		printf("FAILED: %s: data wrong\n", what);
+	if(sb.zmap->tree->nr_free != nr_free - zones ||
+		zones_set() != sb.zmap->num_bits - sb.zmap->tree->nr_free) {
+		printf("FAILED: %s: %d zones free, expected %d\n", what,
+			sb.zmap->tree->nr_free, nr_free - zones);
+		wrong++;
+	}
+	return wrong > 0;
+}
+
+static int check_truncate_to(const char *device)
+{
+	static char buf[STEPS_KB * 1024];
+	/* sizes ending inside and on the edge of the double indirect, the 
+	 * indirect and the direct zones */
+	int steps[] = { 600 * 1024 + 100, 519 * 1024, 300 * 1024 + 7, 
+		7 * 1024, 3 * 1024 + 300 };
+	struct cache_stats before, after;
+	struct minix_inode *inode;
+	char what[64];
+	int i, nr_free, bad = 0, data;
+
+	minix_mount(device, NULL);
+	nr_free = sb.zmap->tree->nr_free;
+	inode = new_node(sb.root_inode, "steps", S_IFREG | 0644);
+	for(i = 0; i < sizeof(buf); i++)
+		buf[i] = file_byte(i);
+	write_buf(inode, buf, sizeof(buf), 0, TRUE);
+	bad += check_file(inode, sizeof(buf), sizeof(buf), nr_free,
+		zones_needed(STEPS_KB), "written");
+
+	for(i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		truncate_to(inode, steps[i]);
+		sprintf(what, "cut to %d", steps[i]);
+		bad += check_file(inode, steps[i], steps[i], nr_free, 
+			zones_needed((steps[i] + BLOCK_SIZE - 1) / BLOCK_SIZE),
+			what);
+	}
+
+	/* grown, the old end to the new reads as zeros and nothing is 
+	 * allocated. then written past the hole. */
+	data = inode->i_size;
+	truncate_to(inode, STEPS_KB * 1024);
+	bad += check_file(inode, STEPS_KB * 1024, data, nr_free, 
+		zones_needed(4), "grown");
+	write_buf(inode, buf, BLOCK_SIZE, STEPS_KB * 1024, TRUE);
+	for(i = 0; i < data; i++)
+		buf[i] = file_byte(i);
+	if(minix_read(inode, buf, BLOCK_SIZE, STEPS_KB * 1024, NULL) != 
+		BLOCK_SIZE || buf[5] != file_byte(5)) {
+		printf("FAILED: write past the hole\n");
+		bad++;
+	}
+	put_inode(inode);
+	unlink("/steps");
+
+	/* blocks held back past the new end are dropped */
+	delalloc_set(TRUE);
+	inode = new_node(sb.root_inode, "held", S_IFREG | 0644);
+	for(i = 0; i < 20 * BLOCK_SIZE; i++)
+		buf[i] = file_byte(i);
+	write_buf(inode, buf, 20 * BLOCK_SIZE, 0, TRUE);
+	truncate_to(inode, 10 * BLOCK_SIZE + 10);
+	if(delalloc_pending(inode) != 11) {
+		printf("FAILED: %d blocks held back after cut, expected 11\n",
+			delalloc_pending(inode));
+		bad++;
+	}
+	truncate_to(inode, 20 * BLOCK_SIZE);
+	bad += check_file(inode, 20 * BLOCK_SIZE, 10 * BLOCK_SIZE + 10, 
+		nr_free, 0, "held back and cut");
+	delalloc_set(FALSE);
+	put_inode(inode);
+	unlink("/held");
+
+	/* the last block of a big file */
+	inode = new_node(sb.root_inode, "big", S_IFREG | 0644);
+	for(i = 0; i < FILE_MB * 1024 * 1024; i += CHUNK)
+		write_buf(inode, buf, CHUNK, i, TRUE);
+	cache_get_stats(&before);
+	truncate_to(inode, FILE_MB * 1024 * 1024 - BLOCK_SIZE);
+	cache_get_stats(&after);
+	printf("trimming a block off it took %lu get_blocks\n",
+		(after.hits + after.misses) - (before.hits + before.misses));
+	if((after.hits + after.misses) - (before.hits + before.misses) > 2) {
+		printf("FAILED: more of the map walked than needed\n");
+		bad++;
+	}
+	put_inode(inode);
+	unlink("/big");
+	if(sb.zmap->tree->nr_free != nr_free) {
+		printf("FAILED: zones lost\n");
+		bad++;
+	}
+	minix_unmount();
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	int bad = 0;
+
+	printf("truncating a %dMB file\n", FILE_MB);
+	printf("%6s %6s %10s %10s %10s\n", "", "", "ms", "get_blocks", 
+		"reads");
+	bad += run(device, "old", old_truncate, TRUE);
+	bad += run(device, "new", truncate, TRUE);
+	bad += run(device, "old", old_truncate, FALSE);
+	bad += run(device, "new", truncate, FALSE);
+	bad += check_truncate_to(device);
+
+	printf("%s\n", bad > 0 ? "FAILED" : "passed");
+	return bad > 0;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "comms.h"
+#include "test_util.h"
+
+int test_failures = 0;
+
+static char *image = NULL;
+static long image_size;
+
+void check(int ok, const char *what)
+{
+	if(!ok) {
+		printf("FAILED: %s\n", what);
+		test_failures++;
+	}
+}
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void save_image(const char *device)
+{
+	FILE *f;
+
+	free_image();
+	if((f = fopen(device, "rb")) == NULL)
+		panic("save_image(): unable to open %s", device);
+	fseek(f, 0, SEEK_END);
+	image_size = ftell(f);
+	rewind(f);
+	if((image = malloc(image_size)) == NULL ||
+		fread(image, 1, image_size, f) != image_size)
+		panic("save_image(): unable to read %s", device);
+	fclose(f);
+}
+
+void restore_image(const char *device)
+{
+	FILE *f;
+
+	if(image == NULL)
+		panic("restore_image(): no image saved");
+	if((f = fopen(device, "wb")) == NULL ||
+		fwrite(image, 1, image_size, f) != image_size)
+		panic("restore_image(): unable to write %s", device);
+	fclose(f);
+}
+
+void free_image(void)
+{
+	free(image);
+	image = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef _MINIX_TEST_UTIL
+#define _MINIX_TEST_UTIL
+
+/**
+ * Helpers shared by the test programs that run against an image.
+ */
+
+/* # of checks that have failed */
+extern int test_failures;
+
+/**
+ * Prints "FAILED: what" and counts a failure unless 'ok'.
+ */
+void check(int ok, const char *what);
+
+/**
+ * Seconds since some fixed point, for timing.
+ */
+double now(void);
+
+/**
+ * Copies the image to memory, replacing any copy already saved, and back
+ * again. restore_image() keeps the copy so it can be restored more than once.
+ * free_image() frees it.
+ */
+void save_image(const char *device);
+void restore_image(const char *device);
+void free_image(void);
+
+#endif
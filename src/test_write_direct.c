@@ -0,0 +1,160 @@
+/**
+ * Checks that whole block writes made with write_buf(..., TRUE) bypass the
+ * buffer cache without it ever handing out stale data.
+ *
+ * A file is written through the cache and left dirty, then overwritten
+ * directly from an unaligned buffer while one of its blocks is held pinned.
+ * Whatever the cache held must not be written back over the new data, the
+ * pinned block must see the new data and the file must read back as written
+ * both before and after a remount. Finally the time taken to write WRITE_MB
+ * each way is printed.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=WD.IMG bs=1M count=70
+ *	$ ./mkfs.somix WD.IMG
+ *
+ * usage: test_write_direct [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+
+#define DEVICE "WD.IMG"
+#define FILE_BLOCKS 64
+#define PINNED_BLOCK 5		/* of the file, held over the direct write */
+#define WRITE_MB 16
+#define WRITE_CHUNK (128 * 1024)	/* as FUSE hands out with big_writes */
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(char *buf, int len, char c)
+{
+	int i;
+	for(i = 0; i < len; i++)
+		buf[i] = c + i / BLOCK_SIZE;
+}
+
+/**
+ * Returns the number of bytes of the file that don't match fill(.., c).
+ */
+static int check(struct minix_inode *inode, int len, char c)
+{
+	static char expect[FILE_BLOCKS * BLOCK_SIZE], buf[FILE_BLOCKS *
+		BLOCK_SIZE];
+	struct readahead ra;
+	int bad = 0, i;
+
+	ra_init(&ra, -1);
+	fill(expect, len, c);
+	if(minix_read(inode, buf, len, 0, &ra) != len)
+		return len;
+	for(i = 0; i < len; i++)
+		if(buf[i] != expect[i])
+			bad++;
+	return bad;
+}
+
+/**
+ * Writes WRITE_MB to a new file 'name' and returns the seconds taken,
+ * including syncing it to disk.
+ */
+static double timed_write(const char *name, int direct)
+{
+	static char buf[WRITE_CHUNK];
+	struct minix_inode *inode;
+	double start;
+	int pos;
+
+	fill(buf, WRITE_CHUNK, 'w');
+	start = now();
+	inode = new_node(sb.root_inode, name, S_IFREG | 0644);
+	for(pos = 0; pos < WRITE_MB * 1024 * 1024; pos += WRITE_CHUNK)
+		if(write_buf(inode, buf, WRITE_CHUNK, pos, direct) !=
+			WRITE_CHUNK)
+			panic("timed_write(): unable to write %s", name);
+	put_inode(inode);
+	sync_cache();
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	static char raw[FILE_BLOCKS * BLOCK_SIZE + 1];
+	char *buf = raw + 1;		/* not block aligned */
+	int len = FILE_BLOCKS * BLOCK_SIZE;
+	struct minix_inode *inode;
+	struct minix_block *pinned;
+	struct cache_stats before, after;
+	inode_nr i_num;
+	int bad, ok = 1;
+	double cached, direct;
+
+	minix_mount(device, NULL);
+
+	/* dirty cached copy of every block */
+	inode = new_node(sb.root_inode, "direct", S_IFREG | 0644);
+	i_num = inode->i_num;
+	fill(buf, len, 'a');
+	write_buf(inode, buf, len, 0, FALSE);
+	pinned = get_block(read_map(inode, PINNED_BLOCK * BLOCK_SIZE), TRUE);
+
+	/* overwrite it all directly */
+	fill(buf, len, 'b');
+	cache_get_stats(&before);
+	if(write_buf(inode, buf, len, 0, TRUE) != len)
+		panic("main(): short direct write");
+	cache_get_stats(&after);
+	printf("%lu of %d blocks written directly\n",
+		after.direct - before.direct, FILE_BLOCKS);
+	if(after.direct - before.direct != FILE_BLOCKS)
+		ok = 0;
+
+	if(pinned->blk_data[0] != 'b' + PINNED_BLOCK) {
+		printf("FAILED: pinned block not updated\n");
+		ok = 0;
+	}
+	put_block(pinned, DATA_BLOCK);
+
+	if((bad = check(inode, len, 'b')) > 0) {
+		printf("FAILED: %d bytes wrong before remount\n", bad);
+		ok = 0;
+	}
+	put_inode(inode);
+	minix_unmount();
+
+	minix_mount(device, NULL);
+	inode = get_inode(i_num);
+	if((bad = check(inode, len, 'b')) > 0) {
+		printf("FAILED: %d bytes wrong after remount\n", bad);
+		ok = 0;
+	}
+	put_inode(inode);
+
+	cached = timed_write("cached", FALSE);
+	direct = timed_write("direct_big", TRUE);
+	printf("%dMB in %dKB writes: cached %.3fs, direct %.3fs\n", WRITE_MB,
+		WRITE_CHUNK / 1024, cached, direct);
+	minix_unmount();
+
+	printf("%s\n", ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
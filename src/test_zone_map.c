@@ -0,0 +1,180 @@
+/**
+ * Benchmark and check of the zone map extents read_map() caches.
+ *
+ * Two files of FILE_ZONES zones are written a RUN zones at a time in turn,
+ * so that each is made of runs of zones spread through its indirect and
+ * double indirect blocks. Every zone of the first is then mapped LOOKUPS
+ * times two ways:
+ *	old	- decoding the indirect blocks for every zone, the way
+ *		  read_map() used to
+ *	cached	- read_map()
+ * and the two must always agree. They must still agree after a zone is
+ * remapped with write_map() and after the file is truncated and written
+ * again elsewhere.
+ *
+ * The image must hold a freshly made file system, e.g.
+ *	$ dd if=/dev/zero of=ZM.IMG bs=1M count=70
+ *	$ ./mkfs.somix ZM.IMG
+ *
+ * usage: test_zone_map [image]
+ */
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "const.h"
+#include "types.h"
+#include "superblock.h"
+#include "inode.h"
+#include "cache.h"
+#include "comms.h"
+#include "mount.h"
+#include "read.h"
+#include "write.h"
+
+#define DEVICE "ZM.IMG"
+#define FILE_ZONES 4096
+#define RUN 64
+#define LOOKUPS 20
+
+extern struct minix_super_block sb;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * read_map() as it was, getting the indirect blocks for every zone.
+ */
+static zone_nr old_read_map(struct minix_inode *inode, int byte_offset)
+{
+	int rel_z = byte_offset / BLOCK_SIZE;
+	struct minix_block *blk;
+	zone_nr z;
+	int excess;
+
+	if(rel_z < NR_DZONE_NUM)
+		return inode->i_zone[rel_z];
+
+	excess = rel_z - NR_DZONE_NUM;
+	if(excess < NR_INDIRECTS)
+		z = inode->i_zone[NR_DZONE_NUM];
+	else {
+		if((z = inode->i_zone[NR_DZONE_NUM+1]) == NO_ZONE)
+			return NO_ZONE;
+		excess -= NR_INDIRECTS;
+		blk = get_block(z, TRUE);
+		z = ((u16 *)blk->blk_data)[excess/NR_INDIRECTS];
+		excess = excess % NR_INDIRECTS;
+		put_block(blk, INDIRECT_BLOCK);
+	}
+
+	if(z == NO_ZONE) return NO_ZONE;
+	blk = get_block(z, TRUE);
+	z = ((u16 *)blk->blk_data)[excess];
+	put_block(blk, INDIRECT_BLOCK);
+	return z;
+}
+
+/**
+ * Writes FILE_ZONES zones to each of 'a' and 'b', RUN at a time in turn.
+ */
+static void write_both(struct minix_inode *a, struct minix_inode *b)
+{
+	static char buf[RUN * BLOCK_SIZE];
+	int pos;
+
+	for(pos = 0; pos < FILE_ZONES * BLOCK_SIZE; pos += RUN * BLOCK_SIZE) {
+		if(write_buf(a, buf, RUN * BLOCK_SIZE, pos, FALSE) !=
+			RUN * BLOCK_SIZE || write_buf(b, buf, RUN * BLOCK_SIZE,
+			pos, FALSE) != RUN * BLOCK_SIZE)
+			panic("write_both(): short write");
+	}
+}
+
+/**
+ * Returns the number of zones of 'inode' read_map() maps wrongly.
+ */
+static int check(struct minix_inode *inode)
+{
+	int z, bad = 0;
+
+	for(z = 0; z < FILE_ZONES + RUN; z++)
+		if(read_map(inode, z * BLOCK_SIZE) !=
+			old_read_map(inode, z * BLOCK_SIZE))
+			bad++;
+	return bad;
+}
+
+/**
+ * Maps every zone of 'inode' LOOKUPS times. Prints the time taken and the
+ * blocks got per zone.
+ */
+static void bench(struct minix_inode *inode, const char *name,
+	zone_nr (*map)(struct minix_inode *, int))
+{
+	struct cache_stats before, after;
+	double start, elapsed;
+	int i, z;
+
+	cache_get_stats(&before);
+	start = now();
+	for(i = 0; i < LOOKUPS; i++)
+		for(z = 0; z < FILE_ZONES; z++)
+			map(inode, z * BLOCK_SIZE);
+	elapsed = now() - start;
+	cache_get_stats(&after);
+
+	printf("%8s %10.0f %10.3f\n", name, elapsed * 1e9 / LOOKUPS /
+		FILE_ZONES, (double) (after.hits + after.misses - before.hits -
+		before.misses) / LOOKUPS / FILE_ZONES);
+}
+
+int main(int argc, char **argv)
+{
+	char *device = argc > 1 ? argv[1] : DEVICE;
+	struct minix_inode *a, *b;
+	int bad = 0, mid = FILE_ZONES / 2 + 3;
+	zone_nr z;
+
+	minix_mount(device, NULL);
+	a = new_node(sb.root_inode, "a", S_IFREG | 0644);
+	b = new_node(sb.root_inode, "b", S_IFREG | 0644);
+	write_both(a, b);
+
+	bad += check(a) + check(b);
+	printf("%d zones mapped %d times\n", FILE_ZONES, LOOKUPS);
+	printf("%8s %10s %10s\n", "map", "ns/zone", "blks/zone");
+	bench(a, "old", old_read_map);
+	bench(a, "cached", read_map);
+
+	/* remap a zone in the middle of a run */
+	read_map(a, mid * BLOCK_SIZE);
+	if((z = alloc_zone(a->i_zone[0])) == NO_ZONE)
+		panic("main(): no free zones");
+	free_zone(read_map(a, mid * BLOCK_SIZE));
+	write_map(a, mid * BLOCK_SIZE, z);
+	if(read_map(a, mid * BLOCK_SIZE) != z) {
+		printf("FAILED: zone %d not remapped\n", mid);
+		bad++;
+	}
+	bad += check(a);
+
+	/* and the whole file */
+	truncate(a);
+	truncate(b);
+	write_both(b, a);
+	bad += check(a) + check(b);
+
+	put_inode(a);
+	put_inode(b);
+	minix_unmount();
+
+	if(bad > 0)
+		printf("FAILED: %d zones mapped wrongly\n", bad);
+	else
+		printf("passed\n");
+	return bad > 0;
+}
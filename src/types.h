@@ -4,6 +4,7 @@
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 typedef u16 inode_nr;		/* inode number */
 typedef u16 zone_nr;		/* zone number */
@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include "types.h"
 #include "superblock.h"
 #include "comms.h"
@@ -11,11 +12,20 @@
 #include "read.h"
 #include "path.h"
 #include "write.h"
+#include "dcache.h"
+#include "dir_index.h"
+#include "delalloc.h"
+#include "orphan.h"
+#include "bitmap.h"
+#include "extent_tree.h"
+#include "mount.h"
 extern struct minix_super_block sb;
 
 /**
  * Inserts a directory entry with inode_number and filename in the given
- * directory 'p_dir'
+ * directory 'p_dir'. The first free slot is used, found with the directory's
+ * index if it has one and otherwise by scanning it from the block holding
+ * its free slot hint.
  */
 static int dir_add(struct minix_inode *p_dir, const char *filename, 
 	inode_nr i_num)
@@ -27,27 +37,46 @@ static int dir_add(struct minix_inode *p_dir, const char *filename,
 	int found_slot = 0;
 	char *dentry_name;
 	inode_nr *dentry_inode_nr;
+	struct dir_index *ix = dir_index_get(p_dir);
+	int slot;
 
 	int existing_slots = p_dir->i_size / DENTRY_SIZE;
 	int new_slots = 1;
 
 	debug("dir_add(%d, \"%s\", %d):", p_dir->i_num, filename, i_num);
 
-	while((b = read_map(p_dir, c_pos)) != NO_ZONE) {
-		block = get_block(b, TRUE);
-
-		for(i = 0; i < BLOCK_SIZE; i += DENTRY_SIZE) {
-			dentry_inode_nr =  (inode_nr *) (block->blk_data + i);
-			if(*dentry_inode_nr == NO_INODE) {
-				dentry_name = block->blk_data + i + 2;
-				found_slot = 1;
-				break;
+	if(ix != NULL) {
+		if((slot = dir_index_take_slot(ix)) >= 0) {
+			c_pos = slot * DENTRY_SIZE;
+			block = get_block(read_map(p_dir, c_pos), TRUE);
+			i = c_pos % BLOCK_SIZE;
+			dentry_inode_nr = (inode_nr *) (block->blk_data + i);
+			dentry_name = block->blk_data + i + 2;
+			found_slot = 1;
+		}
+		new_slots = (found_slot ? slot : existing_slots) + 1;
+	}
+	else {
+		/* nothing below the hint is free so start in its block */
+		c_pos = p_dir->i_free_hint / DENTRIES_PER_BLOCK * BLOCK_SIZE;
+		new_slots = c_pos / DENTRY_SIZE + 1;
+		while((b = read_map(p_dir, c_pos)) != NO_ZONE) {
+			block = get_block(b, TRUE);
+
+			for(i = 0; i < BLOCK_SIZE; i += DENTRY_SIZE) {
+				dentry_inode_nr = 
+					(inode_nr *) (block->blk_data + i);
+				if(*dentry_inode_nr == NO_INODE) {
+					dentry_name = block->blk_data + i + 2;
+					found_slot = 1;
+					break;
+				}
+				new_slots++;
 			}
-			new_slots++;
+			if(found_slot) break;
+			put_block(block, DIR_BLOCK);	/* release dir block */
+			c_pos += BLOCK_SIZE;
 		}
-		if(found_slot) break;
-		put_block(block, DIR_BLOCK);		/* release dir block */
-		c_pos += BLOCK_SIZE;
 	}
 
 	if(!found_slot) {
@@ -61,12 +90,20 @@ static int dir_add(struct minix_inode *p_dir, const char *filename,
 			
 		dentry_inode_nr = (inode_nr *) (block->blk_data);
 		dentry_name = block->blk_data + 2;
+		if(ix != NULL)
+			dir_index_extend(ix, new_slots, DENTRIES_PER_BLOCK - 1);
 	}
 
+	lock_block(block);
 	*dentry_inode_nr = i_num;
 	memset(dentry_name, 0x00, FILENAME_SIZE);
 	strncpy(dentry_name, filename, FILENAME_SIZE);
-	block->blk_dirty = TRUE;	/* we just modified data in block */
+	mark_dirty(block);	/* we just modified data in block */
+	unlock_block(block);
+	dcache_enter(p_dir->i_num, filename, i_num);
+	if(ix != NULL)
+		dir_index_add(ix, filename, new_slots - 1);
+	p_dir->i_free_hint = new_slots;
 
 	debug("dir_add(): Successfully inserted directory entry");
 
@@ -108,8 +145,10 @@ static int init_dir(struct minix_inode *i, struct minix_inode *p_dir)
  */
 static int zero_block(struct minix_block *blk)
 {
+	lock_block(blk);
 	memset(blk->blk_data, 0x00, BLOCK_SIZE);
-	blk->blk_dirty = TRUE;
+	mark_dirty(blk);
+	unlock_block(blk);
 
 	return 1;
 }
@@ -126,7 +165,11 @@ zone_nr alloc_zone(zone_nr near_zone)
 	debug("alloc_zone(%d): looking for free bit near bit %d...", 
 		near_zone, bit);
 	
-	if((b = alloc_bit(sb.zmap, bit)) < 0) 
+	if((b = alloc_bit(sb.zmap, bit)) < 0) {
+		release_reservations();
+		b = alloc_bit(sb.zmap, bit);
+	}
+	if(b < 0) 
 		panic("alloc_zone(%d): no free zones available", near_zone);
 
 	z = b + (sb.s_firstdatazone - 1);
@@ -134,6 +177,115 @@ zone_nr alloc_zone(zone_nr near_zone)
 	return z;
 }
 
+/**
+ * Allocates up to 'count' zones in a row near 'near_zone', see alloc_bits().
+ * Sets *got to how many and returns the first.
+ */
+zone_nr alloc_zones(zone_nr near_zone, int count, int *got)
+{
+	int bit = near_zone - (sb.s_firstdatazone - 1);
+	int b;
+
+	debug("alloc_zones(%d, %d): looking for free bits near bit %d...",
+		near_zone, count, bit);
+
+	if((b = alloc_bits(sb.zmap, bit, count, got)) < 0) {
+		/* the zones set aside for files are wanted after all */
+		release_reservations();
+		b = alloc_bits(sb.zmap, bit, count, got);
+	}
+	if(b < 0)
+		panic("alloc_zones(%d, %d): no free zones available", 
+			near_zone, count);
+
+	return b + (sb.s_firstdatazone - 1);
+}
+
+static int resv_zones = RESV_ZONES;	/* 0 if none are set aside */
+static struct minix_inode *resv_front;	/* inodes with a window */
+
+void resv_set_zones(int zones)
+{
+	resv_zones = zones == 0 ? RESV_ZONES : MAX(zones, 0);
+}
+
+/**
+ * Sets aside a window of up to 'count' zones in a row near 'near_z' for the
+ * inode, replacing any it has. The window starts at 'near_z' if it is free.
+ * Returns the number set aside, which is 0 if too few zones are free or they
+ * can't be reserved.
+ */
+static int reserve_zones(struct minix_inode *inode, zone_nr near_z, int count)
+{
+	struct extent_tree *tree = sb.zmap->tree;
+	int bit = near_z - (sb.s_firstdatazone - 1);
+	int first, got, free;
+
+	release_reservation(inode);
+	if(tree == NULL || tree->nr_free < sb.zmap->num_bits / RESV_LOW)
+		return 0;
+
+	/* the zones following on from the file's are best even if there
+	 * are fewer of them free than wanted */
+	if((free = extent_tree_free_at(tree, bit)) > 0)
+		count = MIN(count, free);
+	if((first = reserve_bits(sb.zmap, bit, count, &got)) < 0)
+		return 0;
+
+	inode->i_resv_start = first + (sb.s_firstdatazone - 1);
+	inode->i_resv_len = got;
+	inode->i_resv_prev = NULL;
+	inode->i_resv_next = resv_front;
+	if(resv_front != NULL)
+		resv_front->i_resv_prev = inode;
+	resv_front = inode;
+
+	debug("reserve_zones(%d, %d, %d): zones %d to %d set aside",
+		inode->i_num, near_z, count, inode->i_resv_start, 
+		inode->i_resv_start + got - 1);
+	return got;
+}
+
+/**
+ * Takes the inode, whose window has just been released or used up, off the
+ * list of those with one.
+ */
+static void resv_unlink(struct minix_inode *inode)
+{
+	if(inode->i_resv_prev != NULL)
+		inode->i_resv_prev->i_resv_next = inode->i_resv_next;
+	else
+		resv_front = inode->i_resv_next;
+	if(inode->i_resv_next != NULL)
+		inode->i_resv_next->i_resv_prev = inode->i_resv_prev;
+}
+
+void release_reservation(struct minix_inode *inode)
+{
+	if(inode->i_resv_len == 0)
+		return;
+
+	unreserve_bits(sb.zmap, inode->i_resv_start - 
+		(sb.s_firstdatazone - 1), inode->i_resv_len);
+	inode->i_resv_len = 0;
+	resv_unlink(inode);
+}
+
+void release_reservations(void)
+{
+	while(resv_front != NULL)
+		release_reservation(resv_front);
+}
+
+/**
+ * Frees the 'count' zones from 'z', see free_bits().
+ */
+void free_zones(zone_nr z, int count)
+{
+	debug("free_zones(%d, %d):", (int) z, count);
+	free_bits(sb.zmap, z - (sb.s_firstdatazone - 1), count);
+}
+
 void free_zone(zone_nr z)
 {
 	int bit = z - (sb.s_firstdatazone - 1);
@@ -163,6 +315,7 @@ int write_map(struct minix_inode *inode, int pos, zone_nr new_zone)
 	char new_ind = FALSE;	/* if new indirect mapping block created */
 	char new_dbl = FALSE;	/* if new dbl indirect mapping block created */
 	struct minix_block *blk = NULL;
+	zone_nr ind_z;		/* zone given to a new indirect block */
 
 	/* is the zone we're adding a direct zone? */
 	if(zone < NR_DZONE_NUM) {
@@ -208,13 +361,21 @@ int write_map(struct minix_inode *inode, int pos, zone_nr new_zone)
 	if(*zp == NO_ZONE) {
 		/* we need to allocate a block to store all our indirect zone
 		 * numbers. */
-		*zp = alloc_zone(inode->i_zone[0]);
+		ind_z = alloc_zone(inode->i_zone[0]);
 
 		/* mark either the inode or the double indirect block as
  		 * dirty. */
-		if(blk != NULL) blk->blk_dirty = TRUE;
-		else inode->i_dirty = TRUE;
-		if(*zp == NO_ZONE) {
+		if(blk != NULL) {
+			lock_block(blk);
+			*zp = ind_z;
+			mark_dirty(blk);
+			unlock_block(blk);
+		}
+		else {
+			*zp = ind_z;
+			inode->i_dirty = TRUE;
+		}
+		if(ind_z == NO_ZONE) {
 			if(blk != NULL) put_block(blk, INDIRECT_BLOCK);
 			return -ENOSPC;		/* out of space */
 		}
@@ -235,9 +396,12 @@ int write_map(struct minix_inode *inode, int pos, zone_nr new_zone)
 	debug("write_map(...): setting index %d in indirect map to point to "
 		"new zone %d", excess, new_zone);
 
+	lock_block(blk);
 	((zone_nr *)blk->blk_data)[excess] = new_zone;
-	blk->blk_dirty = TRUE;
+	mark_dirty(blk);
+	unlock_block(blk);
 	put_block(blk, INDIRECT_BLOCK);
+	map_cache_update(inode, zone, new_zone);
 	
 	/* its up to the calling routing to put the inode */
 	return 1;
@@ -285,6 +449,78 @@ struct minix_inode *new_node(struct minix_inode *parent, const char *filename,
 	return new_inode;
 }
 
+/**
+ * Maps new zones for the 'count' blocks from the block aligned byte offset 
+ * 'pos', none of which have one yet, and puts them in 'zones'. As many as can
+ * be are allocated in a row on disk, following on from the zone of the block
+ * before 'pos' if it has one so that appends stay contiguous.
+ *
+ * Returns the number of blocks mapped, at least one, or -ENOSPC if the zone
+ * map could not be written.
+ */
+static int map_zones(struct minix_inode *inode, int pos, int count,
+	zone_nr *zones)
+{
+	zone_nr z, near_z;
+	int got, i;
+
+	if(pos >= BLOCK_SIZE && 
+		(z = read_map(inode, pos - BLOCK_SIZE)) != NO_ZONE)
+		near_z = z + 1;
+	else if(inode->i_size == 0) 
+		near_z = sb.s_firstdatazone;
+	else
+		near_z = inode->i_zone[0];
+
+	/* a file being written takes its zones from a window set aside for it
+	 * so that others written at the same time don't take the zones that
+	 * follow on from its own. */
+	if(inode->i_resv_len == 0 && resv_zones > 0 && 
+		S_ISREG(inode->i_mode))
+		reserve_zones(inode, near_z, MAX(count, resv_zones));
+	if(inode->i_resv_len > 0) {
+		z = inode->i_resv_start;
+		got = MIN(count, inode->i_resv_len);
+		claim_bits(sb.zmap, z - (sb.s_firstdatazone - 1), got);
+		inode->i_resv_start += got;
+		if((inode->i_resv_len -= got) == 0)
+			resv_unlink(inode);
+	}
+	else
+		z = alloc_zones(near_z, count, &got);
+
+	/* attempt to write the new zone numbers to the inode. This function
+	 * will deal with placing them in the direct, indirect or double
+	 * indirect slots. */
+	for(i = 0; i < got; i++) {
+		zones[i] = z + i;
+		if(write_map(inode, pos + i * BLOCK_SIZE, zones[i]) < 0) {
+			debug("map_zones(inode=%d, %d): unable to write map",
+				inode->i_num, pos + i * BLOCK_SIZE);
+			for(; i < got; i++)
+				free_zone(z + i);
+			return -ENOSPC;
+		}
+	}
+	return got;
+}
+
+/**
+ * Returns the zone holding byte offset 'pos' within the file. If there is none
+ * yet a new zone is allocated and written to the zone map.
+ *
+ * Returns NO_ZONE if the zone map could not be written.
+ */
+static zone_nr map_zone(struct minix_inode *inode, int pos)
+{
+	zone_nr z;
+
+	if((z = read_map(inode, pos)) == NO_ZONE &&
+		map_zones(inode, pos - pos % BLOCK_SIZE, 1, &z) < 0)
+		return NO_ZONE;
+	return z;
+}
+
 /*
  * Returns the zone corresponding to the given byte offset 'pos' within the 
  * file.
@@ -294,31 +530,11 @@ struct minix_inode *new_node(struct minix_inode *parent, const char *filename,
  */
 struct minix_block *new_block(struct minix_inode *inode, int pos)
 {
-	zone_nr z, near_z;
+	zone_nr z;
 	struct minix_block *retval;
-	char new_zone = FALSE;
 	debug("new_block()");
-	if((z = read_map(inode, pos)) == 0) {
-		/* no block currently allocated for this byte offset */
-		if(inode->i_size == 0) 
-			near_z = sb.s_firstdatazone;
-		else
-			near_z = inode->i_zone[0];
-
-		z = alloc_zone(near_z);
-		new_zone = TRUE;
-
-		/* attempt to write the new zone number to the inode. This
-		 * function will deal with placing the new zone number in the
-		 * direct, indirect or double indirect slots. */
-		if(write_map(inode, pos, z) < 0) {
-			debug("new_block(inode=%d, %d): unable to write map",
-			inode->i_num, pos);
-			return NULL;
-		}
-
-		
-	}
+	if((z = map_zone(inode, pos)) == NO_ZONE)
+		return NULL;
 
 	/* if we allocated a new block then we don't need to read from disk, we
  	 * we just need to zero it. */
@@ -369,17 +585,172 @@ static int write_chunk(struct minix_inode *inode, int pos, int chunk,
 	}
 
 	/* cpy 'chunk' bytes to blk->data+off from 'buf' */
+	lock_block(blk);
 	memcpy(blk->blk_data+off, buf, chunk);	
-	blk->blk_dirty = TRUE;
+	mark_dirty(blk);
+	unlock_block(blk);
 	put_block(blk, DATA_BLOCK);
 	return 1;
 }
 
+/* whether blocks of the inode without a zone are to be held back rather
+ * than given one now */
+#define HOLD_BACK(inode) (delalloc_on() || (inode)->i_delalloc != NULL)
+
+/**
+ * Writes the first 'chunk' bytes from 'buf' to the pending data of the block
+ * at position 'pos', which has no zone, making it pending if it isn't yet.
+ */
+static void write_pending(struct minix_inode *inode, int pos, int chunk,
+	const char *buf)
+{
+	char *data;
+
+	if((data = delalloc_find(inode, pos / BLOCK_SIZE)) == NULL)
+		data = delalloc_add(inode, pos / BLOCK_SIZE);
+	memcpy(data + pos % BLOCK_SIZE, buf, chunk);
+}
+
+void flush_delalloc(struct minix_inode *inode)
+{
+	struct delalloc *d = inode->i_delalloc;
+	struct minix_block *blks[MAX_RUN];
+	zone_nr zones[MAX_RUN];
+	int i, j, k, n, got, run;
+
+	if(d == NULL)
+		return;
+
+	debug("flush_delalloc(%d): %d blocks pending", inode->i_num,
+		d->nr_blks);
+	for(i = 0; i < d->nr_blks; i += n) {
+		/* the pending blocks following on from i in the file */
+		for(n = 1; i + n < d->nr_blks && n < MAX_RUN &&
+			d->blks[i + n].d_blk == d->blks[i].d_blk + n; n++)
+			;
+
+		for(j = 0; j < n; j += got) {
+			got = map_zones(inode, d->blks[i + j].d_blk * BLOCK_SIZE,
+				n - j, &zones[j]);
+			if(got < 0)
+				panic("flush_delalloc(%d): unable to map block "
+					"%d", inode->i_num, d->blks[i + j].d_blk);
+		}
+
+		for(j = 0; j < n; j += run) {
+			for(run = 1; j + run < n && 
+				zones[j + run] == zones[j] + run; run++)
+				;
+			get_blocks(zones[j], run, FALSE, blks);
+			for(k = 0; k < run; k++) {
+				lock_block(blks[k]);
+				memcpy(blks[k]->blk_data, 
+					d->blks[i + j + k].d_data, BLOCK_SIZE);
+				mark_dirty_since(blks[k], d->since);
+				unlock_block(blks[k]);
+				put_block(blks[k], DATA_BLOCK);
+			}
+		}
+	}
+	delalloc_free(inode);
+}
+
+void flush_delalloc_all(void)
+{
+	struct minix_inode *inode;
+
+	while((inode = delalloc_oldest()) != NULL)
+		flush_delalloc(inode);
+}
+
+void flush_delalloc_expired(time_t before)
+{
+	struct minix_inode *inode;
+
+	fs_lock_excl();
+	while((inode = delalloc_oldest()) != NULL &&
+		inode->i_delalloc->since <= before)
+		flush_delalloc(inode);
+	fs_unlock();
+}
+
+/**
+ * Writes up to 'nblocks' whole blocks from 'buf' to the file starting at the
+ * block aligned position 'pos'. Zones are mapped for any of the blocks that
+ * have none, in as few runs on disk as there is room for, then each run of
+ * them that is contiguous on disk is written together. Nothing needs reading
+ * in or zeroing since every byte is overwritten.
+ *
+ * If blocks are being held back (see delalloc.h) 'pos' must have a zone and
+ * the run stops short of the first block after it that doesn't.
+ *
+ * If 'direct' is TRUE each run goes straight to disk with 
+ * cache_write_direct(). Otherwise it is copied into buffers got with one
+ * get_blocks() and left for writeback.
+ *
+ * Returns the number of bytes written, or -ENOSPC.
+ */
+static int write_run(struct minix_inode *inode, int pos, int nblocks,
+	const char *buf, int direct)
+{
+	zone_nr zones[MAX_RUN];
+	struct minix_block *blks[MAX_RUN];
+	int run, i, j;
+
+	nblocks = MIN(nblocks, MAX_RUN);
+	for(i = 0; i < nblocks; i += run) {
+		run = 1;
+		if((zones[i] = read_map(inode, pos + i * BLOCK_SIZE)) != 
+			NO_ZONE)
+			continue;
+		if(HOLD_BACK(inode)) {
+			/* leave this block and those after it to 
+			 * write_pending() */
+			nblocks = i;
+			break;
+		}
+
+		/* map the blocks from i that have no zone yet together */
+		while(i + run < nblocks && 
+			read_map(inode, pos + (i + run) * BLOCK_SIZE) == NO_ZONE)
+			run++;
+		if((run = map_zones(inode, pos + i * BLOCK_SIZE, run, 
+			&zones[i])) < 0)
+			return -ENOSPC;
+	}
+
+	for(i = 0; i < nblocks; i += run) {
+		for(run = 1; i + run < nblocks && 
+			zones[i + run] == zones[i] + run; run++)
+			;
+		if(direct) {
+			cache_write_direct(zones[i], run, buf + i * BLOCK_SIZE);
+			continue;
+		}
+		get_blocks(zones[i], run, FALSE, blks);
+		for(j = 0; j < run; j++) {
+			lock_block(blks[j]);
+			memcpy(blks[j]->blk_data, buf + (i + j) * BLOCK_SIZE,
+				BLOCK_SIZE);
+			mark_dirty(blks[j]);
+			unlock_block(blks[j]);
+			put_block(blks[j], DATA_BLOCK);
+		}
+	}
+	return nblocks * BLOCK_SIZE;
+}
+
 /**
  * Writes 'size' bytes from 'buf' to data contents of inode 'inode' starting at
  * 'offset'.
+ *
+ * Whole, block aligned, blocks are written a run at a time with write_run()
+ * and any partial blocks at either end a chunk at a time. If 'direct' is TRUE
+ * the whole blocks bypass the buffer cache, see cache_write_direct(). Partial
+ * blocks always go through it.
  */
-int write_buf(struct minix_inode *inode, const char *buf, size_t size, off_t offset)
+int write_buf(struct minix_inode *inode, const char *buf, size_t size, 
+	off_t offset, int direct)
 {
 	int nbytes = size;	/* number of bytes left to write */
 	int off;		/* offset within a particular zone */
@@ -401,16 +772,32 @@ int write_buf(struct minix_inode *inode, const char *buf, size_t size, off_t off
 
 	while(nbytes > 0) {
 		off = pos % BLOCK_SIZE;
-		
-		/* the number of bytes we're gonna write to the zone */
-		chunk = MIN(nbytes, (BLOCK_SIZE - off));
-		if(chunk < 0)
-			panic("write_buf(%d, buf, %d, %d): why is chunk < 0?",
-				inode->i_num, (int) size, (int) offset);
-
-		/* write 'chunk' bytes to the inode. starting at file position=
-		 * 'pos' from the buffer starting at 'buf + sbytes' */
-		ret = write_chunk(inode, pos, chunk, buf + sbytes);
+
+		if(read_map(inode, pos) == NO_ZONE && HOLD_BACK(inode)) {
+			/* no zone yet. hold the data back, see delalloc.h */
+			chunk = MIN(nbytes, (BLOCK_SIZE - off));
+			write_pending(inode, pos, chunk, buf + sbytes);
+			ret = chunk;
+		}
+		else if(off == 0 && nbytes >= BLOCK_SIZE) {
+			/* whole blocks. chunk is however many write_run
+			 * managed. */
+			ret = chunk = write_run(inode, pos, nbytes / BLOCK_SIZE,
+				buf + sbytes, direct);
+		}
+		else {
+			/* the number of bytes we're gonna write to the zone */
+			chunk = MIN(nbytes, (BLOCK_SIZE - off));
+			if(chunk < 0)
+				panic("write_buf(%d, buf, %d, %d): why is "
+					"chunk < 0?", inode->i_num, (int) size,
+					(int) offset);
+
+			/* write 'chunk' bytes to the inode. starting at file
+			 * position='pos' from the buffer starting at 
+			 * 'buf + sbytes' */
+			ret = write_chunk(inode, pos, chunk, buf + sbytes);
+		}
 		
 		if(ret < 0) {
 			debug("minix_write_buf(...): something when wrong while"
@@ -431,10 +818,220 @@ int write_buf(struct minix_inode *inode, const char *buf, size_t size, off_t off
 	/* update mod time */
 	inode->i_time = time(NULL);
 	inode->i_dirty = TRUE;	
+
+	/* don't let too much be held back */
+	if(delalloc_pending(inode) > DELALLOC_FILE_MAX)
+		flush_delalloc(inode);
+	while(delalloc_pending_all() > DELALLOC_MAX)
+		flush_delalloc(delalloc_oldest());
 	
 	return sbytes;
 }
 
+/* blocks the direct, indirect and double indirect zones can map */
+#define MAX_FILE_BLOCKS \
+	(NR_DZONE_NUM + NR_INDIRECTS + NR_INDIRECTS * NR_INDIRECTS)
+
+int preallocate(struct minix_inode *inode, off_t offset, off_t len,
+	int keep_size)
+{
+	struct extent_tree *tree = sb.zmap->tree;
+	struct minix_block *blk;
+	zone_nr zones[MAX_RUN], near_z;
+	int first, last, b, n, i, got, need, holes = 0;
+
+	debug("preallocate(%d, %lld, %lld, %d):", inode->i_num,
+		(long long) offset, (long long) len, keep_size);
+
+	if(offset < 0 || len <= 0)
+		return -EINVAL;
+	if(offset + len > (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+		return -EFBIG;
+
+	/* blocks held back get their zones now so as not to be counted */
+	flush_delalloc(inode);
+
+	first = offset / BLOCK_SIZE;
+	last = (offset + len - 1) / BLOCK_SIZE;
+	for(b = first; b <= last; b++)
+		if(read_map(inode, b * BLOCK_SIZE) == NO_ZONE)
+			holes++;
+
+	if(holes > 0) {
+		/* the zones and, roughly, the indirect blocks mapping them */
+		need = holes + holes / NR_INDIRECTS + 2;
+		if(tree != NULL && need > tree->nr_free + inode->i_resv_len) {
+			release_reservations();
+			if(need > tree->nr_free)
+				return -ENOSPC;
+		}
+
+		if(first > 0 && (near_z = read_map(inode,
+			(first - 1) * BLOCK_SIZE)) != NO_ZONE)
+			near_z++;
+		else if(inode->i_zone[0] != NO_ZONE)
+			near_z = inode->i_zone[0];
+		else
+			near_z = sb.s_firstdatazone;
+		reserve_zones(inode, near_z, holes);
+	}
+	if(keep_size)
+		return 0;
+
+	/* give each hole its zones, out of the window, and zero them */
+	for(b = first; b <= last; b += n) {
+		if(read_map(inode, b * BLOCK_SIZE) != NO_ZONE) {
+			n = 1;
+			continue;
+		}
+		for(n = 1; b + n <= last && n < MAX_RUN &&
+			read_map(inode, (b + n) * BLOCK_SIZE) == NO_ZONE; n++)
+			;
+		for(i = 0; i < n; i += got) {
+			if((got = map_zones(inode, (b + i) * BLOCK_SIZE, n - i,
+				&zones[i])) < 0)
+				return got;
+		}
+		for(i = 0; i < n; i++) {
+			blk = get_block(zones[i], FALSE);
+			zero_block(blk);
+			put_block(blk, DATA_BLOCK);
+		}
+	}
+
+	if(offset + len > inode->i_size) {
+		inode->i_size = offset + len;
+		inode->i_time = time(NULL);
+		inode->i_dirty = TRUE;
+	}
+	return 0;
+}
+
+/**
+ * The zones of a file being truncated, collected as the runs of them next to
+ * each other on disk so that each run can be freed at once.
+ */
+struct zone_run {
+	zone_nr start;
+	int len;
+};
+
+struct zone_list {
+	struct zone_run *runs;
+	int nr, cap;
+};
+
+static void zone_list_add(struct zone_list *l, zone_nr z)
+{
+	if(z == NO_ZONE)
+		return;
+	if(l->nr > 0 && l->runs[l->nr - 1].start + l->runs[l->nr - 1].len == 
+		z) {
+		l->runs[l->nr - 1].len++;
+		return;
+	}
+	if(l->nr == l->cap) {
+		l->cap = l->cap == 0 ? 16 : l->cap * 2;
+		if((l->runs = realloc(l->runs, l->cap * 
+			sizeof(struct zone_run))) == NULL)
+			panic("zone_list_add(%d): out of memory", z);
+	}
+	l->runs[l->nr].start = z;
+	l->runs[l->nr++].len = 1;
+}
+
+/**
+ * Adds the zones mapped by the entries of the indirect block 'z' for file
+ * blocks 'from' on, counted from the first block 'z' maps, to the list and
+ * clears the entries. If 'dbl' is TRUE it is a double indirect block and
+ * each entry is an indirect block trimmed in turn.
+ *
+ * Returns TRUE if no entries are left, in which case 'z' is added too and 
+ * the caller must clear its own pointer to it.
+ */
+static int trim_indirect(struct zone_list *l, zone_nr z, int from, int dbl)
+{
+	struct minix_block *blk;
+	zone_nr *iz;
+	int i, span = dbl ? NR_INDIRECTS * NR_INDIRECTS : NR_INDIRECTS;
+	int empty = TRUE;
+
+	if(z == NO_ZONE || from >= span)
+		return FALSE;
+	blk = get_block(z, TRUE);
+	iz = (zone_nr *) blk->blk_data;
+	/* a double indirect block stays locked while those under it are
+	 * trimmed. they are never locked the other way round */
+	lock_block(blk);
+	for(i = 0; i < NR_INDIRECTS; i++) {
+		if(dbl && i >= from / NR_INDIRECTS) {
+			if(trim_indirect(l, iz[i], i == from / NR_INDIRECTS ?
+				from % NR_INDIRECTS : 0, FALSE))
+				iz[i] = NO_ZONE;
+		}
+		else if(!dbl && i >= from) {
+			zone_list_add(l, iz[i]);
+			iz[i] = NO_ZONE;
+		}
+		if(iz[i] != NO_ZONE)
+			empty = FALSE;
+	}
+
+	/* a block that is about to be freed needn't be written */
+	if(!empty)
+		mark_dirty(blk);
+	unlock_block(blk);
+	put_block(blk, INDIRECT_BLOCK);
+	if(empty)
+		zone_list_add(l, z);
+	return empty;
+}
+
+static int cmp_run(const void *a, const void *b)
+{
+	return (int) ((const struct zone_run *) a)->start - 
+		(int) ((const struct zone_run *) b)->start;
+}
+
+/**
+ * Frees the zones of file blocks 'first' on and any indirect blocks left
+ * with nothing to map. The zone map is walked once from 'first', each 
+ * indirect block it reaches being read once, and the zones are collected as
+ * runs next to each other on disk. An indirect block usually splits a run 
+ * of data zones, so the runs are sorted and those that touch are joined 
+ * before each is freed with one free_zones().
+ */
+static void free_blocks_from(struct minix_inode *inode, int first)
+{
+	struct zone_list list = { NULL, 0, 0 };
+	struct zone_run *r;
+	int i, j, from;
+
+	for(i = first; i < NR_DZONE_NUM; i++) {
+		zone_list_add(&list, inode->i_zone[i]);
+		inode->i_zone[i] = NO_ZONE;
+	}
+	from = MAX(first - NR_DZONE_NUM, 0);
+	if(trim_indirect(&list, inode->i_zone[NR_DZONE_NUM], from, FALSE))
+		inode->i_zone[NR_DZONE_NUM] = NO_ZONE;
+	from = MAX(first - NR_DZONE_NUM - NR_INDIRECTS, 0);
+	if(trim_indirect(&list, inode->i_zone[NR_DZONE_NUM + 1], from, TRUE))
+		inode->i_zone[NR_DZONE_NUM + 1] = NO_ZONE;
+
+	qsort(list.runs, list.nr, sizeof(struct zone_run), cmp_run);
+	for(i = 0; i < list.nr; i = j) {
+		r = &list.runs[i];
+		for(j = i + 1; j < list.nr && 
+			list.runs[j].start == r->start + r->len; j++)
+			r->len += list.runs[j].len;
+		free_zones(r->start, r->len);
+	}
+	debug("free_blocks_from(%d, %d): %d runs of zones freed", inode->i_num,
+		first, list.nr);
+	free(list.runs);
+	map_cache_clear(inode);
+}
+
 /**
  * Truncate the size of the given inode to zero by removing all blocks 
  * allocated to it and then setting size to 0.
@@ -443,69 +1040,123 @@ int write_buf(struct minix_inode *inode, const char *buf, size_t size, off_t off
  */
 void truncate(struct minix_inode *inode)
 {
-	int pos;
-	zone_nr dbl_z, *iz;
+	debug("truncate(%d): truncating to 0 bytes...", inode->i_num);
+
+	/* anything held back never gets a zone */
+	delalloc_free(inode);
+	release_reservation(inode);
+	free_blocks_from(inode, 0);
+
+	inode->i_size = 0;
+	inode->i_time = time(NULL);
+	inode->i_dirty = TRUE;
+}
+
+int truncate_to(struct minix_inode *inode, off_t length)
+{
 	struct minix_block *blk;
-	int i;
+	char *pending;
+	int last, off;
 	zone_nr z;
 
-	debug("truncate(%d): truncating to 0 bytes...", inode->i_num);
-	
-	/* free all allocated blocks */
-	for(pos = 0; pos < inode->i_size; pos += BLOCK_SIZE) {
-		if((z = read_map(inode, pos)) != NO_ZONE) 
-			free_zone(z);
-	}
+	debug("truncate_to(%d, %lld): size was %d", inode->i_num, 
+		(long long) length, inode->i_size);
 
-	/* free indirect */
-	free_zone(inode->i_zone[NR_DZONE_NUM]);
+	if(length < 0)
+		return -EINVAL;
+	if(length > (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+		return -EFBIG;
+	if(length == 0) {
+		truncate(inode);
+		return 0;
+	}
 
-	/* free double indirect */
-	if((dbl_z = inode->i_zone[NR_DZONE_NUM + 1]) != NO_ZONE) {
-		blk = get_block(dbl_z, TRUE);
-		for(iz = (zone_nr *) blk->blk_data; 
-			iz < (zone_nr *) &blk->blk_data[NR_INDIRECTS]; iz++) {
-			free_zone(*iz);
+	if(length < inode->i_size) {
+		/* the block the file now ends in keeps its zone, but what
+		 * is past the end of it must read as zeros if the file 
+		 * grows again */
+		last = (length - 1) / BLOCK_SIZE;
+		if((off = length % BLOCK_SIZE) != 0) {
+			if((z = read_map(inode, length)) != NO_ZONE) {
+				blk = get_block(z, TRUE);
+				lock_block(blk);
+				memset(blk->blk_data + off, 0, BLOCK_SIZE - off);
+				mark_dirty(blk);
+				unlock_block(blk);
+				put_block(blk, DATA_BLOCK);
+			}
+			else if((pending = delalloc_find(inode, last)) != NULL)
+				memset(pending + off, 0, BLOCK_SIZE - off);
 		}
-		put_block(blk, INDIRECT_BLOCK);
-		free_zone(dbl_z);
+
+		delalloc_trim(inode, last + 1);
+		release_reservation(inode);
+		free_blocks_from(inode, last + 1);
 	}
+	/* growing leaves a hole, which needs nothing allocating */
 
-	inode->i_size = 0;
+	inode->i_size = length;
 	inode->i_time = time(NULL);
 	inode->i_dirty = TRUE;
-	for(i = 0; i < NR_ZONE_NUMS; i++)
-		inode->i_zone[i] = NO_ZONE;
+	return 0;
 }
 
 /**
- * delete the directory entry 'filename' from the directory 'p_dir' by setting
- * corresponding inode_num entry to zero.
- *
- * if 'filename' cannot be found in directory, 0 is returned. 
- * retval 1 indicates success.
+ * dir_delete(), writing the entry's block to disk before returning if 'sync'
+ * is set.
  */
-int dir_delete(struct minix_inode *p_dir, const char *file)
+static int remove_entry(struct minix_inode *p_dir, const char *file, int sync)
 {
 	struct minix_block *blk;	/* block belonging to inode */
 	zone_nr z;			
 	int c_pos = 0;		/* current position in scan of directory */
 	int i;			/* current position in directory block */
+	struct dir_index *ix = dir_index_get(p_dir);
+	int slot;
+	inode_nr i_num;
 	
 	debug("dir_delete(%d, \"%s\"):", p_dir->i_num, file);
 
+	if(ix != NULL) {
+		if((slot = dir_index_find(p_dir, ix, file, &i_num)) < 0)
+			return 0;
+		c_pos = slot * DENTRY_SIZE;
+		blk = get_block(read_map(p_dir, c_pos), TRUE);
+		lock_block(blk);
+		*((inode_nr *)(blk->blk_data + c_pos % BLOCK_SIZE)) = NO_INODE;
+		mark_dirty(blk);
+		unlock_block(blk);
+		if(sync)
+			sync_block(blk);
+		put_block(blk, DIR_BLOCK);
+		dir_index_remove(ix, file, slot);
+		dcache_remove(p_dir->i_num, file);
+		p_dir->i_free_hint = MIN(p_dir->i_free_hint, slot);
+		p_dir->i_time = time(NULL);
+		p_dir->i_dirty = TRUE;	
+		return 1;
+	}
+
 	while((z = read_map(p_dir, c_pos)) != NO_ZONE) {
 		blk = get_block(z, TRUE);
 		/* TODO: fix bug. shouldn't use BLOCK_SIZE */
 		for(i = 0; i < BLOCK_SIZE; i+= DENTRY_SIZE) {
-			if(strcmp((char *)(blk->blk_data + i + 2), file) == 0) {
+			if(*((inode_nr *)(blk->blk_data + i)) != NO_INODE &&
+				strcmp((char *)(blk->blk_data + i + 2), file) == 0) {
 				/* found what we were looking for */
 				debug("dir_delete(%d, \"%s\"): found entry, "
 					"deleting...", p_dir->i_num, file);
+				lock_block(blk);
 				*((inode_nr *)(blk->blk_data + i)) = NO_INODE;	/* erase */
-				blk->blk_dirty = TRUE;
+				mark_dirty(blk);
+				unlock_block(blk);
+				dcache_remove(p_dir->i_num, file);
+				p_dir->i_free_hint = MIN(p_dir->i_free_hint,
+					(c_pos + i) / DENTRY_SIZE);
 				p_dir->i_time = time(NULL);
 				p_dir->i_dirty = TRUE;	
+				if(sync)
+					sync_block(blk);
 				put_block(blk, DIR_BLOCK);
 				return 1;	/* success */
 			}
@@ -519,35 +1170,65 @@ int dir_delete(struct minix_inode *p_dir, const char *file)
 }
 
 /**
- * Performs the rename operation. 
+ * delete the directory entry 'filename' from the directory 'p_dir' by setting
+ * corresponding inode_num entry to zero.
  *
- * Returns 1 on success.
+ * if 'filename' cannot be found in directory, 0 is returned. 
+ * retval 1 indicates success.
  */
-int rename(const char *src_path, const char *dest_path)
+int dir_delete(struct minix_inode *p_dir, const char *file)
 {
-	struct minix_inode *s_dir, *d_dir, *i, *di;
-	char old_name[FILENAME_SIZE];
-	char new_name[FILENAME_SIZE];
+	return remove_entry(p_dir, file, FALSE);
+}
 
-	debug("rename(\"%s\", \"%s\"): renaming...", src_path, dest_path);
-	if((s_dir = last_dir(src_path, old_name)) == NULL)
-		return -ENOENT;
+/**
+ * Drops a link to the inode, whose name has been deleted. With the last
+ * gone it is an orphan, freed once it is put for the last time.
+ */
+static void drop_link(struct minix_inode *i)
+{
+	i->i_nlinks--;
+	i->i_dirty = TRUE;
+	if(i->i_nlinks == 0) {
+		delalloc_free(i);	/* nothing held back is wanted */
+		orphan_add(i);		/* freed on its last put_inode() */
+	}
+}
 
-	if((d_dir = last_dir(dest_path, new_name)) == NULL)
-		return -ENOENT;
+/**
+ * Deletes the name of inode 'i' from 'p_dir' and drops the link. If it was
+ * the last link the name is gone from disk before the inode becomes an
+ * orphan, so that orphan_recover() never frees an inode a name still points
+ * at after a crash.
+ */
+static void delete_link(struct minix_inode *p_dir, const char *file,
+	struct minix_inode *i)
+{
+	remove_entry(p_dir, file, i->i_nlinks == 1);
+	drop_link(i);
+}
+
+int rename_at(struct minix_inode *s_dir, const char *old_name,
+	struct minix_inode *d_dir, const char *new_name)
+{
+	struct minix_inode *i, *di;
 
+	debug("rename_at(%d, \"%s\", %d, \"%s\"): renaming...", s_dir->i_num,
+		old_name, d_dir->i_num, new_name);
 	if((i = advance(s_dir, old_name)) == NULL)
 		return -ENOENT;
 
 	/* if the destination already exists we must first delete the 
  	 * destination file. */
 	if((di = advance(d_dir, new_name)) != NULL) {
-		dir_delete(d_dir, new_name);
-
-		di->i_nlinks--;
-		di->i_dirty = TRUE;
-
-		put_inode(di);	
+		if(di == i) {
+			/* two links to the same file. nothing to do */
+			put_inode(di);
+			put_inode(i);
+			return 1;
+		}
+		delete_link(d_dir, new_name, di);
+		put_inode(di);
 	}
 	
 	/* add file to the new directory first */
@@ -556,15 +1237,53 @@ int rename(const char *src_path, const char *dest_path)
 	/* now delete from the old directory */
 	if(dir_delete(s_dir, old_name) != 1) {
 		/* something went wrong */
-		panic("rename(\"%s\", \"%s\"): unable to delete old entry",
-			src_path, dest_path);
+		panic("rename_at(%d, \"%s\", %d, \"%s\"): unable to delete "
+			"old entry", s_dir->i_num, old_name, d_dir->i_num, 
+			new_name);
 	}
 
+	put_inode(i);
+	debug("rename_at(): success");
+	return 1;
+}
+
+/**
+ * Performs the rename operation. 
+ *
+ * Returns 1 on success.
+ */
+int rename(const char *src_path, const char *dest_path)
+{
+	struct minix_inode *s_dir, *d_dir;
+	char old_name[FILENAME_SIZE];
+	char new_name[FILENAME_SIZE];
+	int ret;
+
+	debug("rename(\"%s\", \"%s\"): renaming...", src_path, dest_path);
+	if((s_dir = last_dir(src_path, old_name)) == NULL)
+		return -ENOENT;
+
+	if((d_dir = last_dir(dest_path, new_name)) == NULL) {
+		put_inode(s_dir);
+		return -ENOENT;
+	}
+
+	ret = rename_at(s_dir, old_name, d_dir, new_name);
 	put_inode(s_dir);
 	put_inode(d_dir);
-	put_inode(i);
+	return ret;
+}
+
+int unlink_at(struct minix_inode *p_dir, const char *filename)
+{
+	struct minix_inode *i;
+
+	debug("unlink_at(%d, \"%s\"): unlinking...", p_dir->i_num, filename);
+	if((i = advance(p_dir, filename)) == NULL)
+		return 0;
 
-	debug("rename(\"%s\", \"%s\"): success", src_path, dest_path);
+	delete_link(p_dir, filename, i);
+	put_inode(i);
 	return 1;
 }
 
@@ -576,7 +1295,6 @@ int rename(const char *src_path, const char *dest_path)
 int unlink(const char *path)
 {
 	struct minix_inode *p_dir;
-	struct minix_inode *i;
 	char filename[FILENAME_SIZE];
 
 	debug("unlink(\"%s\"): unlinking...", path);
@@ -588,21 +1306,12 @@ int unlink(const char *path)
 	debug("unlink(\"%s\"): got parent directory inode %d. file to "
 		"unlink=\"%s\"", path, p_dir->i_num, filename);
 
-	if((i = advance(p_dir, filename)) == NULL) {
+	if(!unlink_at(p_dir, filename)) {
 		put_inode(p_dir);
 		panic("unlink(\"%s\"): failed to resolve final component", 
 			path);
 	}
 
-	debug("unlink(\"%s\"): decrementing nlinks and marking inode as dirty",
-		path)
-
-	dir_delete(p_dir, filename);
-
-	i->i_nlinks--;
-	i->i_dirty = TRUE;
-
-	put_inode(i);
 	put_inode(p_dir);
 	return 1;
 }
@@ -1,15 +1,85 @@
 #include <stdlib.h>
+#include <time.h>
 #include "types.h"
 #include "inode.h"
 
 zone_nr alloc_zone(zone_nr near_zone);
+zone_nr alloc_zones(zone_nr near_zone, int count, int *got);
+
+/**
+ * Reservation windows. A regular file that needs a zone is first given a run
+ * of RESV_ZONES of them, set aside for it with reserve_bits(), and then takes
+ * its zones from the front of the run until it is used up. Files growing at
+ * the same time so each keep to their own run. A window is released when
+ * the inode is put for the last time, when the file is truncated, or, for 
+ * all of them, when a zone can't be found otherwise.
+ *
+ * resv_set_zones() changes the size of a window. 0 for RESV_ZONES, < 0 for
+ * none.
+ */
+void resv_set_zones(int zones);
+void release_reservation(struct minix_inode *inode);
+void release_reservations(void);
+
 void free_zone(zone_nr z);
+void free_zones(zone_nr z, int count);
 void truncate(struct minix_inode *inode);
+
+/**
+ * Sets the size of the file to 'length' bytes. Shrinking frees the zones 
+ * past the new end, and any indirect blocks left mapping nothing, in time 
+ * proportional to what is freed. Growing leaves a hole that reads as zeros
+ * and allocates nothing.
+ *
+ * Returns 0, or -EINVAL or -EFBIG.
+ */
+int truncate_to(struct minix_inode *inode, off_t length);
 int write_map(struct minix_inode *inode, int pos, zone_nr new_zone);
 struct minix_inode *new_node(struct minix_inode *parent, const char *filename, 
 	mode_t mode);
 struct minix_block *new_block(struct minix_inode *inode, int pos);
 int write_buf(struct minix_inode *inode, const char *buf, size_t size, 
-	off_t offset);
+	off_t offset, int direct);
 int dir_delete(struct minix_inode *p_dir, const char *filename);
+
+/**
+ * Makes sure the 'len' bytes of the file from 'offset' have zones, as 
+ * fallocate(2) does. They are set aside as a reservation window and those
+ * without a zone are given one out of it and zeroed. The file grows if it
+ * ends before them.
+ *
+ * With 'keep_size' the zones are only set aside, since a file can't have 
+ * zones past its end, and so are given back once the file is closed.
+ *
+ * Returns 0, or -ENOSPC, -EFBIG or -EINVAL.
+ */
+int preallocate(struct minix_inode *inode, off_t offset, off_t len, 
+	int keep_size);
 int unlink(const char *path);
+int rename(const char *src_path, const char *dest_path);
+
+/**
+ * unlink() and rename() given the directories the names are in rather than
+ * paths. unlink_at() returns 1, or 0 if there is no such name. rename_at()
+ * returns 1 or -ENOENT. Renaming over a name replaces it. Neither puts the
+ * directories.
+ */
+int unlink_at(struct minix_inode *p_dir, const char *filename);
+int rename_at(struct minix_inode *s_dir, const char *old_name,
+	struct minix_inode *d_dir, const char *new_name);
+
+/**
+ * Gives zones to the blocks of the inode being held back, as few runs of 
+ * them as there is room for, and writes the blocks into the cache. 
+ * flush_delalloc_all() does it for every file. See delalloc.h.
+ */
+void flush_delalloc(struct minix_inode *inode);
+void flush_delalloc_all(void);
+
+/**
+ * The flush hook (see cache_set_flush_hook()). Flushes the files that have had
+ * blocks held back since 'before', their blocks counting as dirty since then
+ * so that the flusher writes them in the same pass. Takes the exclusive fs
+ * lock.
+ */
+void flush_delalloc_expired(time_t before);